@@ -2,12 +2,67 @@
 #include "rendervulkan.hpp"
 #include "wlserver.hpp"
 #include "refresh_rate.h"
+#include "steamcompmgr.hpp"
+#include "convar.h"
+#include "log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 extern int g_nPreferredOutputWidth;
 extern int g_nPreferredOutputHeight;
 
 namespace gamescope
 {
+    static LogScope s_HeadlessLog( "headless" );
+
+    ConVar<bool> cv_headless_composite( "headless_composite", false, "Run the full Vulkan composite for every frame on the headless backend. Useful for load-testing without a display." );
+    ConVar<std::string> cv_headless_timing_path( "headless_timing_path", "", "When compositing headless, write per-frame timestamps (CSV, nanoseconds) to this path." );
+    ConVar<uint32_t> cv_headless_dump_frames( "headless_dump_frames", 0, "When compositing headless, copy each frame into a ring of this many memfds (gamescope-headless-frame-N)." );
+
+    // Written at the start of every memfd in the frame dump ring,
+    // the XRGB8888 pixels follow at uDataOffset.
+    struct HeadlessFrameDumpHeader_t
+    {
+        static constexpr uint32_t k_uMagic = 0x46485347; // 'GSHF'
+
+        uint32_t uMagic;
+        uint32_t uDataOffset;
+        uint32_t uWidth;
+        uint32_t uHeight;
+        uint32_t uStride;
+        uint32_t uDrmFormat;
+        uint64_t ulWakeupTime;
+        uint64_t ulSubmitTime;
+        uint64_t ulGPUDoneTime;
+        uint64_t ulVBlankTime;
+        // Written last, 0 while the frame is being written.
+        uint64_t ulFrame;
+    };
+
+    struct HeadlessFrameTiming_t
+    {
+        uint64_t ulWakeupTime;
+        uint64_t ulSubmitTime;
+        uint64_t ulGPUDoneTime;
+        uint64_t ulVBlankTime;
+    };
+
+    struct HeadlessFrameDump_t
+    {
+        int nFd = -1;
+        void *pMapping = nullptr;
+        size_t zSize = 0;
+    };
+
     class CHeadlessConnector final : public CBaseBackendConnector
     {
     public:
@@ -16,6 +71,8 @@ namespace gamescope
         }
         virtual ~CHeadlessConnector()
         {
+            CloseTimingFile();
+            DestroyFrameDumps();
         }
 
         virtual gamescope::GamescopeScreenType GetScreenType() const override
@@ -87,11 +144,224 @@ namespace gamescope
 
 		virtual int Present( const FrameInfo_t *pFrameInfo, bool bAsync ) override
 		{
+            if ( !cv_headless_composite )
+                return 0;
+
+            HeadlessFrameTiming_t timing{};
+            timing.ulWakeupTime = g_SteamCompMgrVBlankTime.ulWakeupTime;
+            timing.ulVBlankTime = g_SteamCompMgrVBlankTime.schedule.ulTargetVBlank;
+
+            Rc<CVulkanTexture> pDumpTexture = GetFrameDumpTexture();
+
+            // TODO: Resolve const crap
+            std::optional oCompositeResult = vulkan_composite( (FrameInfo_t *)pFrameInfo, nullptr, false, pDumpTexture );
+            if ( !oCompositeResult )
+            {
+                s_HeadlessLog.errorf( "vulkan_composite failed" );
+                return -EINVAL;
+            }
+            timing.ulSubmitTime = get_time_in_nanos();
+
+            vulkan_wait( *oCompositeResult, true );
+            timing.ulGPUDoneTime = get_time_in_nanos();
+
+            m_ulFrameCount++;
+
+            GetVBlankTimer().UpdateWasCompositing( true );
+            GetVBlankTimer().UpdateLastDrawTime( timing.ulGPUDoneTime - g_SteamCompMgrVBlankTime.ulWakeupTime );
+
+            RecordFrameTiming( timing );
+            if ( pDumpTexture != nullptr )
+                DumpFrame( pDumpTexture.get(), timing );
+
             return 0;
 		}
 
+        void PrintFrameStats() const
+        {
+            if ( m_ulFrameCount == 0 )
+            {
+                s_HeadlessLog.infof( "No frames composited yet." );
+                return;
+            }
+
+            s_HeadlessLog.infof( "%" PRIu64 " frames, %" PRIu64 " missed virtual vblanks, avg CPU %.2fms (max %.2fms), avg to GPU done %.2fms (max %.2fms)",
+                m_ulFrameCount, m_ulMissedVBlanks,
+                m_ulTotalSubmitTime / double( m_ulFrameCount ) / 1'000'000.0, m_ulMaxSubmitTime / 1'000'000.0,
+                m_ulTotalGPUDoneTime / double( m_ulFrameCount ) / 1'000'000.0, m_ulMaxGPUDoneTime / 1'000'000.0 );
+        }
+
     private:
+        void RecordFrameTiming( const HeadlessFrameTiming_t &timing )
+        {
+            const uint64_t ulSubmitTime = timing.ulSubmitTime - timing.ulWakeupTime;
+            const uint64_t ulGPUDoneTime = timing.ulGPUDoneTime - timing.ulWakeupTime;
+
+            m_ulTotalSubmitTime += ulSubmitTime;
+            m_ulTotalGPUDoneTime += ulGPUDoneTime;
+            m_ulMaxSubmitTime = std::max( m_ulMaxSubmitTime, ulSubmitTime );
+            m_ulMaxGPUDoneTime = std::max( m_ulMaxGPUDoneTime, ulGPUDoneTime );
+            if ( timing.ulGPUDoneTime > timing.ulVBlankTime )
+                m_ulMissedVBlanks++;
+
+            if ( cv_headless_timing_path.Get() != m_sTimingPath )
+            {
+                CloseTimingFile();
+                m_sTimingPath = cv_headless_timing_path.Get();
+
+                if ( !m_sTimingPath.empty() )
+                {
+                    m_pTimingFile = fopen( m_sTimingPath.c_str(), "w" );
+                    if ( !m_pTimingFile )
+                        s_HeadlessLog.errorf_errno( "Failed to open timing file %s", m_sTimingPath.c_str() );
+                    else
+                        fprintf( m_pTimingFile, "frame,wakeup,submit,gpu_done,vblank\n" );
+                }
+            }
+
+            if ( !m_pTimingFile )
+                return;
+
+            fprintf( m_pTimingFile, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                m_ulFrameCount, timing.ulWakeupTime, timing.ulSubmitTime, timing.ulGPUDoneTime, timing.ulVBlankTime );
+
+            // Don't hit the disk every frame, but keep it fresh enough to tail.
+            if ( m_ulFrameCount % 60 == 0 )
+                fflush( m_pTimingFile );
+        }
+
+        void CloseTimingFile()
+        {
+            if ( m_pTimingFile )
+            {
+                fclose( m_pTimingFile );
+                m_pTimingFile = nullptr;
+            }
+            m_sTimingPath.clear();
+        }
+
+        Rc<CVulkanTexture> GetFrameDumpTexture()
+        {
+            const uint32_t uDumpCount = cv_headless_dump_frames;
+            if ( uDumpCount == 0 )
+            {
+                if ( !m_FrameDumps.empty() )
+                    DestroyFrameDumps();
+                return nullptr;
+            }
+
+            if ( m_pDumpTexture == nullptr ||
+                 m_pDumpTexture->width() != uint32_t( g_nOutputWidth ) ||
+                 m_pDumpTexture->height() != uint32_t( g_nOutputHeight ) )
+            {
+                DestroyFrameDumps();
+
+                CVulkanTexture::createFlags flags;
+                flags.bMappable = true;
+                flags.bStorage = true;
+                flags.bTransferDst = true;
+
+                OwningRc<CVulkanTexture> pTexture = new CVulkanTexture();
+                if ( !pTexture->BInit( g_nOutputWidth, g_nOutputHeight, 1u, DRM_FORMAT_XRGB8888, flags ) )
+                {
+                    s_HeadlessLog.errorf( "Failed to create frame dump texture" );
+                    return nullptr;
+                }
+                m_pDumpTexture = std::move( pTexture );
+            }
+
+            if ( m_FrameDumps.size() != uDumpCount )
+            {
+                DestroyFrameDumps( false );
+
+                const size_t zSize = sizeof( HeadlessFrameDumpHeader_t ) + size_t( m_pDumpTexture->rowPitch() ) * m_pDumpTexture->height();
+                m_FrameDumps.resize( uDumpCount );
+                for ( uint32_t i = 0; i < uDumpCount; i++ )
+                {
+                    char szName[64];
+                    snprintf( szName, sizeof( szName ), "gamescope-headless-frame-%u", i );
+
+                    HeadlessFrameDump_t &dump = m_FrameDumps[i];
+                    dump.nFd = memfd_create( szName, MFD_CLOEXEC );
+                    if ( dump.nFd < 0 || ftruncate( dump.nFd, zSize ) != 0 )
+                    {
+                        s_HeadlessLog.errorf_errno( "Failed to create frame dump memfd" );
+                        DestroyFrameDumps();
+                        return nullptr;
+                    }
+
+                    dump.pMapping = mmap( nullptr, zSize, PROT_READ | PROT_WRITE, MAP_SHARED, dump.nFd, 0 );
+                    if ( dump.pMapping == MAP_FAILED )
+                    {
+                        dump.pMapping = nullptr;
+                        s_HeadlessLog.errorf_errno( "Failed to map frame dump memfd" );
+                        DestroyFrameDumps();
+                        return nullptr;
+                    }
+                    dump.zSize = zSize;
+
+                    s_HeadlessLog.infof( "Dumping frames to /proc/%d/fd/%d (%s)", getpid(), dump.nFd, szName );
+                }
+            }
+
+            return m_pDumpTexture.get();
+        }
+
+        void DumpFrame( CVulkanTexture *pTexture, const HeadlessFrameTiming_t &timing )
+        {
+            if ( m_FrameDumps.empty() )
+                return;
+
+            HeadlessFrameDump_t &dump = m_FrameDumps[ m_ulFrameCount % m_FrameDumps.size() ];
+            HeadlessFrameDumpHeader_t *pHeader = reinterpret_cast<HeadlessFrameDumpHeader_t *>( dump.pMapping );
+
+            __atomic_store_n( &pHeader->ulFrame, 0, __ATOMIC_RELEASE );
+
+            const size_t zImageSize = size_t( pTexture->rowPitch() ) * pTexture->height();
+            memcpy( reinterpret_cast<uint8_t *>( dump.pMapping ) + sizeof( HeadlessFrameDumpHeader_t ), pTexture->mappedData(), std::min( zImageSize, dump.zSize - sizeof( HeadlessFrameDumpHeader_t ) ) );
+
+            pHeader->uMagic = HeadlessFrameDumpHeader_t::k_uMagic;
+            pHeader->uDataOffset = sizeof( HeadlessFrameDumpHeader_t );
+            pHeader->uWidth = pTexture->width();
+            pHeader->uHeight = pTexture->height();
+            pHeader->uStride = pTexture->rowPitch();
+            pHeader->uDrmFormat = pTexture->drmFormat();
+            pHeader->ulWakeupTime = timing.ulWakeupTime;
+            pHeader->ulSubmitTime = timing.ulSubmitTime;
+            pHeader->ulGPUDoneTime = timing.ulGPUDoneTime;
+            pHeader->ulVBlankTime = timing.ulVBlankTime;
+            __atomic_store_n( &pHeader->ulFrame, m_ulFrameCount, __ATOMIC_RELEASE );
+        }
+
+        void DestroyFrameDumps( bool bDestroyTexture = true )
+        {
+            for ( HeadlessFrameDump_t &dump : m_FrameDumps )
+            {
+                if ( dump.pMapping )
+                    munmap( dump.pMapping, dump.zSize );
+                if ( dump.nFd >= 0 )
+                    close( dump.nFd );
+            }
+            m_FrameDumps.clear();
+
+            if ( bDestroyTexture )
+                m_pDumpTexture = nullptr;
+        }
+
         BackendConnectorHDRInfo m_HDRInfo{};
+
+        uint64_t m_ulFrameCount = 0;
+        uint64_t m_ulMissedVBlanks = 0;
+        uint64_t m_ulTotalSubmitTime = 0;
+        uint64_t m_ulTotalGPUDoneTime = 0;
+        uint64_t m_ulMaxSubmitTime = 0;
+        uint64_t m_ulMaxGPUDoneTime = 0;
+
+        std::string m_sTimingPath;
+        FILE *m_pTimingFile = nullptr;
+
+        OwningRc<CVulkanTexture> m_pDumpTexture;
+        std::vector<HeadlessFrameDump_t> m_FrameDumps;
     };
 
 	class CHeadlessBackend final : public CBaseBackend
@@ -261,6 +531,22 @@ namespace gamescope
         CHeadlessConnector m_Connector;
 	};
 
+    ConCommand cc_headless_frame_stats( "headless_frame_stats", "Print frame timing stats for the headless backend.",
+    []( std::span<std::string_view> svArgs )
+    {
+        if ( !GetBackend() )
+            return;
+
+        CHeadlessConnector *pConnector = dynamic_cast<CHeadlessConnector *>( GetBackend()->GetCurrentConnector() );
+        if ( !pConnector )
+        {
+            s_HeadlessLog.errorf( "Not using the headless backend." );
+            return;
+        }
+
+        pConnector->PrintFrameStats();
+    });
+
 	/////////////////////////
 	// Backend Instantiator
 	/////////////////////////
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // Unbounded multi-producer/single-consumer queue.
+    //
+    // Producers push onto a lock-free stack with a single CAS, the
+    // consumer takes the whole stack with one exchange and walks it oldest
+    // first. The consumer never pops individual nodes, so there's no ABA.
+    // Any number of threads may push, exactly one thread may drain at a time.
+    //
+    // Push allocates a node with new, so it's only as lock-free as the
+    // allocator is. Fine for things that happen a few times a frame.
+    template <typename T>
+    class CMPSCQueue : public NonCopyable
+    {
+    public:
+        ~CMPSCQueue()
+        {
+            Node_t *pNode = m_pHead.exchange( nullptr, std::memory_order_acquire );
+            while ( pNode )
+            {
+                Node_t *pNext = pNode->pNext;
+                delete pNode;
+                pNode = pNext;
+            }
+        }
+
+        // Returns true if the queue was empty, ie. the consumer might need waking.
+        bool Push( T value )
+        {
+            Node_t *pNode = new Node_t{ std::move( value ), m_pHead.load( std::memory_order_relaxed ) };
+            while ( !m_pHead.compare_exchange_weak( pNode->pNext, pNode, std::memory_order_release, std::memory_order_relaxed ) )
+                ;
+
+            return pNode->pNext == nullptr;
+        }
+
+        // Consumer only.
+        // Calls fnConsume( T &value ) for everything pushed so far, in push order.
+        // Returns how many there were.
+        template <typename TFunc>
+        size_t Drain( TFunc fnConsume )
+        {
+            Node_t *pNode = m_pHead.exchange( nullptr, std::memory_order_acquire );
+            if ( !pNode )
+                return 0;
+
+            // The stack is newest first, flip it.
+            Node_t *pOldest = nullptr;
+            while ( pNode )
+            {
+                Node_t *pNext = pNode->pNext;
+                pNode->pNext = pOldest;
+                pOldest = pNode;
+                pNode = pNext;
+            }
+
+            size_t uCount = 0;
+            while ( pOldest )
+            {
+                Node_t *pNext = pOldest->pNext;
+                fnConsume( pOldest->value );
+                delete pOldest;
+                pOldest = pNext;
+                uCount++;
+            }
+            return uCount;
+        }
+
+        bool IsEmpty() const
+        {
+            return m_pHead.load( std::memory_order_relaxed ) == nullptr;
+        }
+
+    private:
+        struct Node_t
+        {
+            T value;
+            Node_t *pNext;
+        };
+
+        std::atomic<Node_t *> m_pHead = { nullptr };
+    };
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // Single threaded open addressing hash map with linear probing, for small
+    // keys (XIDs, pointers) that get looked up on every event.
+    //
+    // Erase shifts the following entries back rather than leaving tombstones,
+    // so lookups never slow down from churn.
+    // Pointers returned by Find are invalidated by Set and Erase.
+    template <typename TKey, typename TValue, typename THash = std::hash<TKey>>
+    class COpenHashMap : public NonCopyable
+    {
+    public:
+        COpenHashMap( size_t uInitialCapacity = 64 )
+        {
+            size_t uCapacity = 16;
+            while ( uCapacity < uInitialCapacity )
+                uCapacity *= 2;
+
+            Allocate( uCapacity );
+        }
+
+        TValue *Find( const TKey &key )
+        {
+            for ( size_t uIndex = HomeSlot( key ); ; uIndex = ( uIndex + 1 ) & m_uMask )
+            {
+                Slot_t &slot = m_pSlots[ uIndex ];
+                if ( !slot.bUsed )
+                    return nullptr;
+
+                if ( slot.key == key )
+                    return &slot.value;
+            }
+        }
+
+        const TValue *Find( const TKey &key ) const
+        {
+            return const_cast<COpenHashMap *>( this )->Find( key );
+        }
+
+        // Inserts, or overwrites the existing value.
+        void Set( const TKey &key, const TValue &value )
+        {
+            if ( TValue *pValue = Find( key ) )
+            {
+                *pValue = value;
+                return;
+            }
+
+            // Keep the load factor under 1/2 so probe sequences stay short.
+            if ( ( m_uCount + 1 ) * 2 > m_uMask + 1 )
+                Grow();
+
+            InsertNew( key, value );
+        }
+
+        bool Erase( const TKey &key )
+        {
+            size_t uIndex = HomeSlot( key );
+            for ( ; ; uIndex = ( uIndex + 1 ) & m_uMask )
+            {
+                Slot_t &slot = m_pSlots[ uIndex ];
+                if ( !slot.bUsed )
+                    return false;
+
+                if ( slot.key == key )
+                    break;
+            }
+
+            EraseSlot( uIndex );
+            return true;
+        }
+
+        template <typename TFunc>
+        void EraseIf( TFunc fnPredicate )
+        {
+            for ( size_t uIndex = 0; uIndex <= m_uMask; )
+            {
+                Slot_t &slot = m_pSlots[ uIndex ];
+
+                // Erasing can shift another entry into this slot, look at it again.
+                if ( slot.bUsed && fnPredicate( slot.key, slot.value ) )
+                    EraseSlot( uIndex );
+                else
+                    uIndex++;
+            }
+        }
+
+        void Clear()
+        {
+            for ( size_t i = 0; i <= m_uMask; i++ )
+                m_pSlots[ i ] = Slot_t{};
+            m_uCount = 0;
+        }
+
+        size_t Size() const { return m_uCount; }
+
+    private:
+        struct Slot_t
+        {
+            bool bUsed = false;
+            TKey key{};
+            TValue value{};
+        };
+
+        size_t HomeSlot( const TKey &key ) const
+        {
+            // XIDs are sequential and pointers are aligned, mix the bits
+            // so neither piles up in a few slots.
+            uint64_t ulHash = uint64_t( THash{}( key ) );
+            ulHash ^= ulHash >> 33;
+            ulHash *= 0xff51afd7ed558ccdull;
+            ulHash ^= ulHash >> 33;
+            return size_t( ulHash ) & m_uMask;
+        }
+
+        void Allocate( size_t uCapacity )
+        {
+            m_uMask = uCapacity - 1;
+            m_pSlots = std::make_unique<Slot_t[]>( uCapacity );
+            m_uCount = 0;
+        }
+
+        void Grow()
+        {
+            std::unique_ptr<Slot_t[]> pOldSlots = std::move( m_pSlots );
+            size_t uOldCapacity = m_uMask + 1;
+
+            Allocate( uOldCapacity * 2 );
+            for ( size_t i = 0; i < uOldCapacity; i++ )
+            {
+                if ( pOldSlots[ i ].bUsed )
+                    InsertNew( pOldSlots[ i ].key, pOldSlots[ i ].value );
+            }
+        }
+
+        void InsertNew( const TKey &key, const TValue &value )
+        {
+            size_t uIndex = HomeSlot( key );
+            while ( m_pSlots[ uIndex ].bUsed )
+                uIndex = ( uIndex + 1 ) & m_uMask;
+
+            m_pSlots[ uIndex ] = Slot_t{ true, key, value };
+            m_uCount++;
+        }
+
+        void EraseSlot( size_t uHole )
+        {
+            // Pull back anything later in the run that would no longer
+            // be reachable from its home slot across the hole.
+            for ( size_t uIndex = ( uHole + 1 ) & m_uMask; m_pSlots[ uIndex ].bUsed; uIndex = ( uIndex + 1 ) & m_uMask )
+            {
+                size_t uHome = HomeSlot( m_pSlots[ uIndex ].key );
+                size_t uDistance = ( uIndex - uHome ) & m_uMask;
+                size_t uHoleDistance = ( uIndex - uHole ) & m_uMask;
+                if ( uDistance >= uHoleDistance )
+                {
+                    m_pSlots[ uHole ] = m_pSlots[ uIndex ];
+                    uHole = uIndex;
+                }
+            }
+
+            m_pSlots[ uHole ] = Slot_t{};
+            m_uCount--;
+        }
+
+        std::unique_ptr<Slot_t[]> m_pSlots;
+        size_t m_uMask = 0;
+        size_t m_uCount = 0;
+    };
+}
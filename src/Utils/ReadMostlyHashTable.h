@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // Insert-only open addressing hash table for data that is looked up
+    // constantly and written rarely (eg. the pipeline table).
+    //
+    // Find never takes a lock and can run concurrently with Insert.
+    // Inserts must be serialized by the caller.
+    // Entries can never be removed, and pointers returned by Find stay
+    // valid for the lifetime of the table (old storage is kept around
+    // after growing as readers may still be looking at it).
+    template <typename TKey, typename TValue, typename THash = std::hash<TKey>>
+    class CReadMostlyHashTable : public NonCopyable
+    {
+    public:
+        CReadMostlyHashTable( size_t uInitialCapacity = 256 )
+        {
+            size_t uCapacity = 16;
+            while ( uCapacity < uInitialCapacity )
+                uCapacity *= 2;
+
+            m_pTable.store( AllocTable( uCapacity ), std::memory_order_release );
+        }
+
+        const TValue *Find( const TKey &key ) const
+        {
+            const Table_t *pTable = m_pTable.load( std::memory_order_acquire );
+
+            const size_t uHash = THash{}( key );
+            for ( size_t i = 0; i <= pTable->uMask; i++ )
+            {
+                const Slot_t &slot = pTable->pSlots[ ( uHash + i ) & pTable->uMask ];
+                if ( !slot.bValid.load( std::memory_order_acquire ) )
+                    return nullptr;
+
+                if ( slot.uHash == uHash && slot.key == key )
+                    return &slot.value;
+            }
+
+            return nullptr;
+        }
+
+        bool Contains( const TKey &key ) const
+        {
+            return Find( key ) != nullptr;
+        }
+
+        // Returns false and leaves the table untouched if the key already exists.
+        bool Insert( const TKey &key, const TValue &value )
+        {
+            if ( Find( key ) )
+                return false;
+
+            Table_t *pTable = m_pTable.load( std::memory_order_relaxed );
+
+            // Keep the load factor under 1/2 so probe sequences stay short.
+            if ( ( m_uCount + 1 ) * 2 > pTable->uMask + 1 )
+            {
+                Table_t *pNewTable = AllocTable( ( pTable->uMask + 1 ) * 2 );
+                for ( size_t i = 0; i <= pTable->uMask; i++ )
+                {
+                    const Slot_t &slot = pTable->pSlots[ i ];
+                    if ( slot.bValid.load( std::memory_order_relaxed ) )
+                        InsertIntoTable( pNewTable, slot.uHash, slot.key, slot.value );
+                }
+
+                m_pTable.store( pNewTable, std::memory_order_release );
+                pTable = pNewTable;
+            }
+
+            InsertIntoTable( pTable, THash{}( key ), key, value );
+            m_uCount++;
+            return true;
+        }
+
+        size_t Size() const { return m_uCount; }
+
+        // Not safe against concurrent Find/Insert.
+        template <typename TFunc>
+        void ForEach( TFunc fnFunc ) const
+        {
+            const Table_t *pTable = m_pTable.load( std::memory_order_acquire );
+            for ( size_t i = 0; i <= pTable->uMask; i++ )
+            {
+                const Slot_t &slot = pTable->pSlots[ i ];
+                if ( slot.bValid.load( std::memory_order_acquire ) )
+                    fnFunc( slot.key, slot.value );
+            }
+        }
+
+    private:
+        struct Slot_t
+        {
+            std::atomic<bool> bValid = { false };
+            size_t uHash = 0;
+            TKey key{};
+            TValue value{};
+        };
+
+        struct Table_t
+        {
+            size_t uMask = 0;
+            std::unique_ptr<Slot_t[]> pSlots;
+        };
+
+        Table_t *AllocTable( size_t uCapacity )
+        {
+            auto pTable = std::make_unique<Table_t>();
+            pTable->uMask = uCapacity - 1;
+            pTable->pSlots = std::make_unique<Slot_t[]>( uCapacity );
+
+            Table_t *pRawTable = pTable.get();
+            m_Tables.emplace_back( std::move( pTable ) );
+            return pRawTable;
+        }
+
+        static void InsertIntoTable( Table_t *pTable, size_t uHash, const TKey &key, const TValue &value )
+        {
+            for ( size_t i = 0; ; i++ )
+            {
+                Slot_t &slot = pTable->pSlots[ ( uHash + i ) & pTable->uMask ];
+                if ( slot.bValid.load( std::memory_order_relaxed ) )
+                    continue;
+
+                slot.uHash = uHash;
+                slot.key = key;
+                slot.value = value;
+                // Publish the slot only once the key and value are written.
+                slot.bValid.store( true, std::memory_order_release );
+                return;
+            }
+        }
+
+        std::atomic<Table_t *> m_pTable = { nullptr };
+        // Every table we ever allocated, the last one is current.
+        std::vector<std::unique_ptr<Table_t>> m_Tables;
+        size_t m_uCount = 0;
+    };
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // Fixed-capacity single-producer/single-consumer ring buffer.
+    //
+    // Slots are preallocated and written/read in place, so pushing and
+    // popping never allocate or take a lock.
+    // Exactly one thread may push and exactly one thread may pop.
+    template <typename T, size_t uCapacity>
+    class CSPSCRing : public NonCopyable
+    {
+        static_assert( uCapacity && ( uCapacity & ( uCapacity - 1 ) ) == 0, "Capacity must be a power of two." );
+    public:
+        // Producer only.
+        // fnWrite( T &slot ) fills in the next slot.
+        // Returns false (and doesn't call fnWrite) if the ring is full.
+        template <typename TFunc>
+        bool TryPush( TFunc fnWrite )
+        {
+            const size_t uHead = m_uHead.load( std::memory_order_relaxed );
+            if ( uHead - m_uCachedTail == uCapacity )
+            {
+                m_uCachedTail = m_uTail.load( std::memory_order_acquire );
+                if ( uHead - m_uCachedTail == uCapacity )
+                    return false;
+            }
+
+            fnWrite( m_Slots[ uHead & kMask ] );
+            m_uHead.store( uHead + 1, std::memory_order_release );
+            return true;
+        }
+
+        bool TryPush( const T &value )
+        {
+            return TryPush( [&]( T &slot ) { slot = value; } );
+        }
+
+        // Consumer only.
+        // fnRead( const T &slot ) is handed the oldest slot, which is
+        // released once it returns.
+        // Returns false if the ring is empty.
+        template <typename TFunc>
+        bool TryPop( TFunc fnRead )
+        {
+            const size_t uTail = m_uTail.load( std::memory_order_relaxed );
+            if ( uTail == m_uCachedHead )
+            {
+                m_uCachedHead = m_uHead.load( std::memory_order_acquire );
+                if ( uTail == m_uCachedHead )
+                    return false;
+            }
+
+            fnRead( const_cast<const T &>( m_Slots[ uTail & kMask ] ) );
+            m_uTail.store( uTail + 1, std::memory_order_release );
+            return true;
+        }
+
+        // Approximate from any thread other than the producer/consumer.
+        size_t Size() const
+        {
+            return m_uHead.load( std::memory_order_acquire ) - m_uTail.load( std::memory_order_acquire );
+        }
+
+        static constexpr size_t Capacity() { return uCapacity; }
+    private:
+        static constexpr size_t kMask = uCapacity - 1;
+
+        // Keep the producer and consumer sides on separate cache lines
+        // so they don't bounce between cores.
+        alignas( 64 ) std::atomic<size_t> m_uHead = { 0 };
+        size_t m_uCachedTail = 0;
+
+        alignas( 64 ) std::atomic<size_t> m_uTail = { 0 };
+        size_t m_uCachedHead = 0;
+
+        alignas( 64 ) T m_Slots[ uCapacity ]{};
+    };
+}
@@ -0,0 +1,147 @@
+#include "SpanProfiler.h"
+#include "../convar.h"
+#include "../log.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static LogScope s_SpanProfilerLog( "span_profiler" );
+
+namespace gamescope
+{
+    std::atomic<bool> CSpanProfiler::s_bEnabled = { false };
+
+    static ConVar<bool> cv_trace_spans( "trace_spans", false, "Record CPU spans for the main loop stages, see trace_spans_dump.",
+    []( ConVar<bool> &cvar )
+    {
+        CSpanProfiler::SetEnabled( cvar );
+    });
+
+    static ConCommand cc_trace_spans_dump( "trace_spans_dump", "Write the recorded spans out as Chrome trace JSON. Defaults to /tmp/gamescope-trace.json.",
+    []( std::span<std::string_view> args )
+    {
+        std::string sPath = "/tmp/gamescope-trace.json";
+        if ( args.size() > 1 )
+            sPath = std::string( args[1] );
+
+        if ( !cv_trace_spans )
+            s_SpanProfilerLog.warnf( "trace_spans is off, only old spans (if any) will be written." );
+
+        if ( CSpanProfiler::Get().WriteChromeTrace( sPath.c_str() ) )
+            s_SpanProfilerLog.infof( "Wrote trace to %s", sPath.c_str() );
+    });
+
+    CSpanProfiler &CSpanProfiler::Get()
+    {
+        static CSpanProfiler s_Instance;
+        return s_Instance;
+    }
+
+    uint64_t CSpanProfiler::Now()
+    {
+        timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return uint64_t( ts.tv_sec ) * 1'000'000'000ul + uint64_t( ts.tv_nsec );
+    }
+
+    uint32_t CSpanProfiler::CurrentThreadId()
+    {
+        static thread_local uint32_t s_uThreadId = uint32_t( syscall( SYS_gettid ) );
+        return s_uThreadId;
+    }
+
+    void CSpanProfiler::Record( const char *pszName, uint64_t ulBeginNanos, uint64_t ulEndNanos )
+    {
+        const uint64_t ulSpan = m_ulNextSpan.fetch_add( 1, std::memory_order_relaxed );
+        Slot_t &slot = m_Slots[ ulSpan & ( k_uCapacity - 1 ) ];
+
+        slot.ulSequence.store( ulSpan * 2 + 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        slot.pszName.store( pszName, std::memory_order_relaxed );
+        slot.ulBeginNanos.store( ulBeginNanos, std::memory_order_relaxed );
+        slot.ulEndNanos.store( ulEndNanos, std::memory_order_relaxed );
+        slot.uThreadId.store( CurrentThreadId(), std::memory_order_relaxed );
+
+        slot.ulSequence.store( ulSpan * 2 + 2, std::memory_order_release );
+    }
+
+    std::vector<CSpanProfiler::Span_t> CSpanProfiler::Snapshot( uint64_t ulSinceNanos, uint32_t uThreadId ) const
+    {
+        const uint64_t ulNextSpan = m_ulNextSpan.load( std::memory_order_acquire );
+        const uint64_t ulFirstSpan = ulNextSpan > k_uCapacity ? ulNextSpan - k_uCapacity : 0;
+
+        std::vector<Span_t> spans;
+        spans.reserve( ulNextSpan - ulFirstSpan );
+
+        for ( uint64_t ulSpan = ulFirstSpan; ulSpan < ulNextSpan; ulSpan++ )
+        {
+            const Slot_t &slot = m_Slots[ ulSpan & ( k_uCapacity - 1 ) ];
+
+            // Skip anything still being written, or already lapped by a newer span.
+            const uint64_t ulSequence = slot.ulSequence.load( std::memory_order_acquire );
+            if ( ulSequence != ulSpan * 2 + 2 )
+                continue;
+
+            Span_t span =
+            {
+                .pszName      = slot.pszName.load( std::memory_order_relaxed ),
+                .ulBeginNanos = slot.ulBeginNanos.load( std::memory_order_relaxed ),
+                .ulEndNanos   = slot.ulEndNanos.load( std::memory_order_relaxed ),
+                .uThreadId    = slot.uThreadId.load( std::memory_order_relaxed ),
+            };
+
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if ( slot.ulSequence.load( std::memory_order_relaxed ) != ulSequence )
+                continue;
+
+            if ( span.ulBeginNanos < ulSinceNanos )
+                continue;
+            if ( uThreadId && span.uThreadId != uThreadId )
+                continue;
+
+            spans.push_back( span );
+        }
+
+        // Spans are recorded when they end, put them back in the order they began.
+        std::stable_sort( spans.begin(), spans.end(), []( const Span_t &a, const Span_t &b ) { return a.ulBeginNanos < b.ulBeginNanos; } );
+        return spans;
+    }
+
+    bool CSpanProfiler::WriteChromeTrace( const char *pszPath ) const
+    {
+        std::vector<Span_t> spans = Snapshot();
+
+        FILE *pFile = fopen( pszPath, "w" );
+        if ( !pFile )
+        {
+            s_SpanProfilerLog.errorf_errno( "Failed to open %s", pszPath );
+            return false;
+        }
+
+        const int nPid = int( getpid() );
+
+        fprintf( pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+        for ( size_t i = 0; i < spans.size(); i++ )
+        {
+            const Span_t &span = spans[i];
+
+            // Complete events, in microseconds.
+            fprintf( pFile, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                span.pszName, nPid, span.uThreadId,
+                span.ulBeginNanos / 1'000.0,
+                ( span.ulEndNanos - span.ulBeginNanos ) / 1'000.0,
+                i + 1 < spans.size() ? "," : "" );
+        }
+        fprintf( pFile, "]}\n" );
+
+        const bool bSuccess = !ferror( pFile );
+        fclose( pFile );
+        return bSuccess;
+    }
+}
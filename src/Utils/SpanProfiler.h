@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // Lightweight always-on-capable CPU span profiler.
+    //
+    // Completed spans go into a fixed ring that any thread can write to
+    // without locking, the oldest get overwritten once it's full.
+    // It's off unless the trace_spans convar is set, and then a CSpanScope
+    // costs a single relaxed load.
+    //
+    // trace_spans_dump writes the ring out as Chrome trace JSON, for
+    // chrome://tracing or Perfetto.
+    class CSpanProfiler : public NonCopyable
+    {
+    public:
+        struct Span_t
+        {
+            // Must be a string literal (or otherwise live forever).
+            const char *pszName = nullptr;
+            uint64_t ulBeginNanos = 0;
+            uint64_t ulEndNanos = 0;
+            uint32_t uThreadId = 0;
+        };
+
+        static CSpanProfiler &Get();
+
+        static bool IsEnabled() { return s_bEnabled.load( std::memory_order_relaxed ); }
+        static void SetEnabled( bool bEnabled ) { s_bEnabled.store( bEnabled, std::memory_order_relaxed ); }
+
+        // CLOCK_MONOTONIC, same as get_time_in_nanos.
+        static uint64_t Now();
+        static uint32_t CurrentThreadId();
+
+        void Record( const char *pszName, uint64_t ulBeginNanos, uint64_t ulEndNanos );
+
+        // Spans still in the ring, oldest first.
+        // Only ones that began at or after ulSinceNanos, and from uThreadId if it's not 0.
+        std::vector<Span_t> Snapshot( uint64_t ulSinceNanos = 0, uint32_t uThreadId = 0 ) const;
+
+        bool WriteChromeTrace( const char *pszPath ) const;
+    private:
+        static constexpr size_t k_uCapacity = 16384;
+        static_assert( ( k_uCapacity & ( k_uCapacity - 1 ) ) == 0 );
+
+        // A seqlock per slot: odd while it's being written.
+        struct Slot_t
+        {
+            std::atomic<uint64_t> ulSequence = { 0 };
+            std::atomic<const char *> pszName = { nullptr };
+            std::atomic<uint64_t> ulBeginNanos = { 0 };
+            std::atomic<uint64_t> ulEndNanos = { 0 };
+            std::atomic<uint32_t> uThreadId = { 0 };
+        };
+
+        static std::atomic<bool> s_bEnabled;
+
+        std::atomic<uint64_t> m_ulNextSpan = { 0 };
+        Slot_t m_Slots[ k_uCapacity ];
+    };
+
+    // Records the time from construction until End (or destruction) as a span.
+    class CSpanScope : public NonCopyable
+    {
+    public:
+        CSpanScope( const char *pszName )
+        {
+            if ( CSpanProfiler::IsEnabled() )
+            {
+                m_pszName = pszName;
+                m_ulBeginNanos = CSpanProfiler::Now();
+            }
+        }
+
+        ~CSpanScope()
+        {
+            End();
+        }
+
+        // Returns how long the span was, 0 if we're not profiling.
+        uint64_t End()
+        {
+            if ( !m_pszName )
+                return 0;
+
+            uint64_t ulEndNanos = CSpanProfiler::Now();
+            CSpanProfiler::Get().Record( m_pszName, m_ulBeginNanos, ulEndNanos );
+            m_pszName = nullptr;
+            return ulEndNanos - m_ulBeginNanos;
+        }
+
+        bool IsRecording() const { return m_pszName != nullptr; }
+        uint64_t GetBeginNanos() const { return m_ulBeginNanos; }
+    private:
+        const char *m_pszName = nullptr;
+        uint64_t m_ulBeginNanos = 0;
+    };
+}
@@ -0,0 +1,95 @@
+#include "WorkQueue.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <pthread.h>
+
+namespace gamescope
+{
+    CWorkQueue::CWorkQueue( const char *pszThreadName, uint32_t uThreadCount, uint32_t uMaxQueuedJobs )
+        : m_uMaxQueuedJobs{ std::max( uMaxQueuedJobs, 1u ) }
+    {
+        m_Threads.reserve( uThreadCount );
+        for ( uint32_t i = 0; i < std::max( uThreadCount, 1u ); i++ )
+            m_Threads.emplace_back( [this, pszThreadName](){ WorkerThreadFunc( pszThreadName ); } );
+    }
+
+    CWorkQueue::~CWorkQueue()
+    {
+        {
+            std::unique_lock lock( m_Mutex );
+            m_bShutdown = true;
+        }
+        m_WakeCV.notify_all();
+
+        for ( std::thread &thread : m_Threads )
+        {
+            if ( thread.joinable() )
+                thread.join();
+        }
+    }
+
+    bool CWorkQueue::TrySubmit( JobFunc fnJob )
+    {
+        {
+            std::unique_lock lock( m_Mutex );
+            if ( m_Jobs.size() >= m_uMaxQueuedJobs )
+            {
+                m_Stats.ulRejected++;
+                return false;
+            }
+
+            m_Jobs.emplace_back( std::move( fnJob ) );
+            m_Stats.uQueued = uint32_t( m_Jobs.size() );
+            m_Stats.uPeakQueued = std::max( m_Stats.uPeakQueued, m_Stats.uQueued );
+        }
+        m_WakeCV.notify_one();
+        return true;
+    }
+
+    bool CWorkQueue::HasCapacity() const
+    {
+        std::unique_lock lock( m_Mutex );
+        return m_Jobs.size() < m_uMaxQueuedJobs;
+    }
+
+    CWorkQueue::Stats_t CWorkQueue::GetStats() const
+    {
+        std::unique_lock lock( m_Mutex );
+        return m_Stats;
+    }
+
+    void CWorkQueue::WorkerThreadFunc( const char *pszThreadName )
+    {
+        pthread_setname_np( pthread_self(), pszThreadName );
+
+        std::unique_lock lock( m_Mutex );
+        for ( ;; )
+        {
+            m_WakeCV.wait( lock, [this](){ return m_bShutdown || !m_Jobs.empty(); } );
+
+            // Finish whatever was queued before shutting down.
+            if ( m_Jobs.empty() )
+                return;
+
+            JobFunc fnJob = std::move( m_Jobs.front() );
+            m_Jobs.pop_front();
+            m_Stats.uQueued = uint32_t( m_Jobs.size() );
+            m_Stats.uRunning++;
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            fnJob();
+            // Destroy whatever the job captured outside of the lock too.
+            fnJob = nullptr;
+            const uint64_t ulJobNanos = uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count() );
+
+            lock.lock();
+            m_Stats.uRunning--;
+            m_Stats.ulCompleted++;
+            m_Stats.ulTotalJobNanos += ulJobNanos;
+            m_Stats.ulMaxJobNanos = std::max( m_Stats.ulMaxJobNanos, ulJobNanos );
+        }
+    }
+}
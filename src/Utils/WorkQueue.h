@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // A fixed set of threads chewing through a bounded FIFO of
+    // independent jobs (eg. encoding screenshots).
+    //
+    // Unlike CWorkerPool, Submit doesn't wait for anything, and when
+    // the queue is full the job is rejected rather than piling up.
+    class CWorkQueue : public NonCopyable
+    {
+    public:
+        using JobFunc = std::function<void()>;
+
+        struct Stats_t
+        {
+            // Waiting for a thread.
+            uint32_t uQueued = 0;
+            // Currently being run.
+            uint32_t uRunning = 0;
+            uint32_t uPeakQueued = 0;
+            uint64_t ulCompleted = 0;
+            uint64_t ulRejected = 0;
+            // Summed over all completed jobs.
+            uint64_t ulTotalJobNanos = 0;
+            uint64_t ulMaxJobNanos = 0;
+        };
+
+        CWorkQueue( const char *pszThreadName, uint32_t uThreadCount, uint32_t uMaxQueuedJobs );
+        ~CWorkQueue();
+
+        // Returns false (and drops fnJob) if uMaxQueuedJobs jobs are already waiting.
+        bool TrySubmit( JobFunc fnJob );
+        // Whether TrySubmit would currently succeed.
+        bool HasCapacity() const;
+
+        Stats_t GetStats() const;
+    private:
+        void WorkerThreadFunc( const char *pszThreadName );
+
+        const uint32_t m_uMaxQueuedJobs;
+        std::vector<std::thread> m_Threads;
+
+        mutable std::mutex m_Mutex;
+        std::condition_variable m_WakeCV;
+        std::deque<JobFunc> m_Jobs;
+        bool m_bShutdown = false;
+
+        Stats_t m_Stats;
+    };
+}
@@ -0,0 +1,127 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+#include <pthread.h>
+
+namespace gamescope
+{
+    static thread_local bool s_bInsideWorkerJob = false;
+
+    CWorkerPool::CWorkerPool( const char *pszThreadName, uint32_t uThreadCount )
+    {
+        m_Threads.reserve( uThreadCount );
+        for ( uint32_t i = 0; i < uThreadCount; i++ )
+            m_Threads.emplace_back( [this, pszThreadName](){ WorkerThreadFunc( pszThreadName ); } );
+    }
+
+    CWorkerPool::~CWorkerPool()
+    {
+        {
+            std::unique_lock lock( m_Mutex );
+            m_bShutdown = true;
+        }
+        m_WakeCV.notify_all();
+
+        for ( std::thread &thread : m_Threads )
+        {
+            if ( thread.joinable() )
+                thread.join();
+        }
+    }
+
+    void CWorkerPool::ParallelFor( uint32_t uCount, const JobFunc &fnJob )
+    {
+        if ( uCount == 0 )
+            return;
+
+        if ( uCount == 1 || m_Threads.empty() || s_bInsideWorkerJob )
+        {
+            for ( uint32_t i = 0; i < uCount; i++ )
+                fnJob( i );
+            return;
+        }
+
+        std::unique_lock dispatchLock( m_DispatchMutex );
+
+        {
+            std::unique_lock lock( m_Mutex );
+            m_pfnJob = &fnJob;
+            m_uJobCount = uCount;
+            m_uNextIndex = 0;
+            m_uFinishedCount = 0;
+            m_ulGeneration++;
+        }
+        m_WakeCV.notify_all();
+
+        s_bInsideWorkerJob = true;
+        RunJobs();
+        s_bInsideWorkerJob = false;
+
+        std::unique_lock lock( m_Mutex );
+        m_DoneCV.wait( lock, [this](){ return m_uFinishedCount == m_uJobCount && m_uActiveWorkers == 0; } );
+        m_pfnJob = nullptr;
+        m_uJobCount = 0;
+    }
+
+    void CWorkerPool::RunJobs()
+    {
+        for ( ;; )
+        {
+            uint32_t uIndex = m_uNextIndex.fetch_add( 1, std::memory_order_relaxed );
+            if ( uIndex >= m_uJobCount )
+                break;
+
+            ( *m_pfnJob )( uIndex );
+
+            m_uFinishedCount.fetch_add( 1, std::memory_order_release );
+        }
+    }
+
+    void CWorkerPool::WorkerThreadFunc( const char *pszThreadName )
+    {
+        pthread_setname_np( pthread_self(), pszThreadName );
+
+        s_bInsideWorkerJob = true;
+
+        uint64_t ulSeenGeneration = 0;
+
+        std::unique_lock lock( m_Mutex );
+        for ( ;; )
+        {
+            m_WakeCV.wait( lock, [&](){ return m_bShutdown || ulSeenGeneration != m_ulGeneration; } );
+
+            if ( m_bShutdown )
+                return;
+
+            ulSeenGeneration = m_ulGeneration;
+
+            // Woke up after this dispatch already finished.
+            if ( !m_pfnJob )
+                continue;
+
+            m_uActiveWorkers++;
+            lock.unlock();
+
+            RunJobs();
+
+            lock.lock();
+            m_uActiveWorkers--;
+            m_DoneCV.notify_all();
+        }
+    }
+
+    CWorkerPool &CWorkerPool::Get()
+    {
+        // The caller of ParallelFor also does work, so leave one CPU for it.
+        static CWorkerPool s_Pool( "gamescope-work", std::max( std::thread::hardware_concurrency(), 2u ) - 1 );
+        return s_Pool;
+    }
+
+    CWorkerPool &CWorkerPool::GetBackground()
+    {
+        // Only started on first use. Half the CPUs, it shouldn't crowd out the compositor.
+        static CWorkerPool s_Pool( "gamescope-bgwork", std::max( std::thread::hardware_concurrency() / 2, 1u ) );
+        return s_Pool;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // A small fixed pool of worker threads for splitting up
+    // embarrassingly parallel work (eg. LUT generation, pixel conversion).
+    //
+    // ParallelFor blocks until every index has been processed,
+    // the calling thread participates in the work too.
+    class CWorkerPool : public NonCopyable
+    {
+    public:
+        using JobFunc = std::function<void( uint32_t uIndex )>;
+
+        CWorkerPool( const char *pszThreadName, uint32_t uThreadCount );
+        ~CWorkerPool();
+
+        // Runs fnJob( i ) for every i in [0, uCount).
+        // Safe to call from multiple threads, dispatches are serialized.
+        // Calling it from inside a job runs the nested work inline.
+        void ParallelFor( uint32_t uCount, const JobFunc &fnJob );
+
+        uint32_t GetThreadCount() const { return uint32_t( m_Threads.size() ); }
+
+        // Shared pool, sized to the number of online CPUs.
+        // For work the compositor thread waits on (eg. color LUT generation).
+        static CWorkerPool &Get();
+        // Separate pool for background work like screenshot conversion and
+        // encoding, so a long dispatch there never holds up one on Get().
+        static CWorkerPool &GetBackground();
+    private:
+        void WorkerThreadFunc( const char *pszThreadName );
+        void RunJobs();
+
+        std::vector<std::thread> m_Threads;
+
+        std::mutex m_DispatchMutex;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_WakeCV;
+        std::condition_variable m_DoneCV;
+        uint64_t m_ulGeneration = 0;
+        bool m_bShutdown = false;
+
+        const JobFunc *m_pfnJob = nullptr;
+        uint32_t m_uJobCount = 0;
+        std::atomic<uint32_t> m_uNextIndex = { 0 };
+        std::atomic<uint32_t> m_uFinishedCount = { 0 };
+        uint32_t m_uActiveWorkers = 0;
+    };
+}
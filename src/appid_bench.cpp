@@ -0,0 +1,150 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include "appid_cache.hpp"
+
+// The old ifstream walk from steamcompmgr.
+static uint32_t get_appid_from_pid_ifstream( pid_t pid )
+{
+    uint32_t unFoundAppId = 0;
+
+    char filename[256];
+    pid_t next_pid = pid;
+
+    while ( 1 )
+    {
+        snprintf( filename, sizeof( filename ), "/proc/%i/stat", next_pid );
+        std::ifstream proc_stat_file( filename );
+
+        if (!proc_stat_file.is_open() || proc_stat_file.bad())
+            break;
+
+        std::string proc_stat;
+
+        std::getline( proc_stat_file, proc_stat );
+
+        char *procName = nullptr;
+        char *lastParens = nullptr;
+
+        for ( uint32_t i = 0; i < proc_stat.length(); i++ )
+        {
+            if ( procName == nullptr && proc_stat[ i ] == '(' )
+            {
+                procName = &proc_stat[ i + 1 ];
+            }
+
+            if ( proc_stat[ i ] == ')' )
+            {
+                lastParens = &proc_stat[ i ];
+            }
+        }
+
+        if (!lastParens)
+            break;
+
+        *lastParens = '\0';
+        char state;
+        int parent_pid = -1;
+
+        sscanf( lastParens + 1, " %c %d", &state, &parent_pid );
+
+        if ( strcmp( "reaper", procName ) == 0 )
+        {
+            snprintf( filename, sizeof( filename ), "/proc/%i/cmdline", next_pid );
+            std::ifstream proc_cmdline_file( filename );
+            std::string proc_cmdline;
+
+            bool bSteamLaunch = false;
+            uint32_t unAppId = 0;
+
+            std::getline( proc_cmdline_file, proc_cmdline );
+
+            for ( uint32_t j = 0; j < proc_cmdline.length(); j++ )
+            {
+                if ( proc_cmdline[ j ] == '\0' && j + 1 < proc_cmdline.length() )
+                {
+                    if ( strcmp( "SteamLaunch", &proc_cmdline[ j + 1 ] ) == 0 )
+                    {
+                        bSteamLaunch = true;
+                    }
+                    else if ( sscanf( &proc_cmdline[ j + 1 ], "AppId=%u", &unAppId ) == 1 && unAppId != 0 )
+                    {
+                        if ( bSteamLaunch == true )
+                        {
+                            unFoundAppId = unAppId;
+                        }
+                    }
+                    else if ( strcmp( "--", &proc_cmdline[ j + 1 ] ) == 0 )
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if ( parent_pid == -1 || parent_pid == 0 )
+        {
+            break;
+        }
+        else
+        {
+            next_pid = parent_pid;
+        }
+    }
+
+    return unFoundAppId;
+}
+
+// Our own process tree stands in for a game's: a handful of ancestors up to init.
+static void Benchmark_AppId_IfStream( benchmark::State &state )
+{
+    const pid_t nPid = getpid();
+    for ( auto _ : state )
+        benchmark::DoNotOptimize( get_appid_from_pid_ifstream( nPid ) );
+}
+BENCHMARK( Benchmark_AppId_IfStream );
+
+static void Benchmark_AppId_Uncached( benchmark::State &state )
+{
+    const pid_t nPid = getpid();
+    for ( auto _ : state )
+        benchmark::DoNotOptimize( gamescope::CAppIdCache::LookupUncached( nPid ) );
+}
+BENCHMARK( Benchmark_AppId_Uncached );
+
+// Another window from a process we've already seen.
+static void Benchmark_AppId_Cached( benchmark::State &state )
+{
+    gamescope::CAppIdCache cache;
+    const pid_t nPid = getpid();
+    for ( auto _ : state )
+        benchmark::DoNotOptimize( cache.GetAppIdForPid( nPid ) );
+}
+BENCHMARK( Benchmark_AppId_Cached );
+
+// A new process under a launcher we've already seen,
+// only the leaf has to come from /proc.
+static void Benchmark_AppId_CachedParent( benchmark::State &state )
+{
+    gamescope::CAppIdCache cache;
+    const pid_t nPid = getpid();
+    for ( auto _ : state )
+    {
+        state.PauseTiming();
+        cache.Clear();
+        cache.GetAppIdForPid( getppid() );
+        state.ResumeTiming();
+
+        benchmark::DoNotOptimize( cache.GetAppIdForPid( nPid ) );
+    }
+}
+BENCHMARK( Benchmark_AppId_CachedParent );
+
+BENCHMARK_MAIN();
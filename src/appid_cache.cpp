@@ -0,0 +1,294 @@
+#include "appid_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace gamescope
+{
+    // Keeps pidfds for live processes only, but don't let a burst of
+    // launches eat too many fds.
+    static constexpr size_t k_uMaxCachedPids = 128;
+    // Deeper than any real process tree, just guards against loops from pid reuse.
+    static constexpr uint32_t k_uMaxAncestorDepth = 64;
+
+    static ssize_t ReadProcFile( pid_t nPid, const char *pszFile, char *pBuffer, size_t uBufferSize )
+    {
+        char szPath[64];
+        snprintf( szPath, sizeof( szPath ), "/proc/%d/%s", int( nPid ), pszFile );
+
+        int nFd = open( szPath, O_RDONLY | O_CLOEXEC );
+        if ( nFd < 0 )
+            return -1;
+
+        // Leave room for a terminator.
+        size_t uTotal = 0;
+        while ( uTotal < uBufferSize - 1 )
+        {
+            ssize_t nRead = read( nFd, pBuffer + uTotal, uBufferSize - 1 - uTotal );
+            if ( nRead < 0 && errno == EINTR )
+                continue;
+            if ( nRead <= 0 )
+                break;
+            uTotal += size_t( nRead );
+        }
+        close( nFd );
+
+        pBuffer[ uTotal ] = '\0';
+        return ssize_t( uTotal );
+    }
+
+    bool ReadProcStat( pid_t nPid, ProcStat_t *pOutStat )
+    {
+        char szStat[1024];
+        if ( ReadProcFile( nPid, "stat", szStat, sizeof( szStat ) ) <= 0 )
+            return false;
+
+        // The name can contain anything, including spaces and parens,
+        // so it's from the first '(' to the last ')'.
+        char *pszNameStart = strchr( szStat, '(' );
+        char *pszNameEnd = strrchr( szStat, ')' );
+        if ( !pszNameStart || !pszNameEnd || pszNameEnd < pszNameStart )
+            return false;
+
+        pszNameStart++;
+        size_t uNameLength = std::min<size_t>( pszNameEnd - pszNameStart, sizeof( pOutStat->szName ) - 1 );
+        memcpy( pOutStat->szName, pszNameStart, uNameLength );
+        pOutStat->szName[ uNameLength ] = '\0';
+
+        // Fields after the name, starting at 3 (state).
+        // We want 4 (ppid) and 22 (starttime).
+        char *pszField = pszNameEnd + 1;
+        for ( uint32_t uField = 3; uField <= 22; uField++ )
+        {
+            while ( *pszField == ' ' )
+                pszField++;
+            if ( *pszField == '\0' )
+                return false;
+
+            if ( uField == 4 )
+                pOutStat->nParentPid = pid_t( strtol( pszField, nullptr, 10 ) );
+            else if ( uField == 22 )
+                pOutStat->ulStartTime = strtoull( pszField, nullptr, 10 );
+
+            while ( *pszField != ' ' && *pszField != '\0' )
+                pszField++;
+        }
+
+        return true;
+    }
+
+    uint32_t ReadReaperAppId( pid_t nPid )
+    {
+        // The bits we care about come before the "--" and the game's own arguments.
+        char szCmdline[4096];
+        ssize_t nLength = ReadProcFile( nPid, "cmdline", szCmdline, sizeof( szCmdline ) );
+        if ( nLength <= 0 )
+            return 0;
+
+        uint32_t uFoundAppId = 0;
+        bool bSteamLaunch = false;
+
+        // Skip argv[0].
+        const char *pszArg = szCmdline + strlen( szCmdline ) + 1;
+        const char *pszEnd = szCmdline + nLength;
+        for ( ; pszArg < pszEnd; pszArg += strlen( pszArg ) + 1 )
+        {
+            if ( strcmp( pszArg, "SteamLaunch" ) == 0 )
+            {
+                bSteamLaunch = true;
+            }
+            else if ( strncmp( pszArg, "AppId=", 6 ) == 0 )
+            {
+                uint32_t uAppId = uint32_t( strtoul( pszArg + 6, nullptr, 10 ) );
+                if ( uAppId != 0 && bSteamLaunch )
+                    uFoundAppId = uAppId;
+            }
+            else if ( strcmp( pszArg, "--" ) == 0 )
+            {
+                break;
+            }
+        }
+
+        return uFoundAppId;
+    }
+
+    static bool HasExited( int nPidFd )
+    {
+        // A pidfd polls readable once the process is gone.
+        pollfd pfd = { .fd = nPidFd, .events = POLLIN, .revents = 0 };
+        return poll( &pfd, 1, 0 ) != 0;
+    }
+
+    CAppIdCache &CAppIdCache::Get()
+    {
+        static CAppIdCache s_Instance;
+        return s_Instance;
+    }
+
+    CAppIdCache::CAppIdCache()
+    {
+    }
+
+    CAppIdCache::~CAppIdCache()
+    {
+        ClearLocked();
+    }
+
+    uint32_t CAppIdCache::GetAppIdForPid( pid_t nPid )
+    {
+        std::unique_lock lock( m_Mutex );
+        return LookupLocked( nPid, 0 );
+    }
+
+    uint32_t CAppIdCache::LookupUncached( pid_t nPid )
+    {
+        uint32_t uFoundAppId = 0;
+
+        // The outermost reaper wins.
+        for ( uint32_t uDepth = 0; nPid > 0 && uDepth < k_uMaxAncestorDepth; uDepth++ )
+        {
+            ProcStat_t stat;
+            if ( !ReadProcStat( nPid, &stat ) )
+                break;
+
+            if ( strcmp( stat.szName, "reaper" ) == 0 )
+            {
+                if ( uint32_t uAppId = ReadReaperAppId( nPid ) )
+                    uFoundAppId = uAppId;
+            }
+
+            nPid = stat.nParentPid;
+        }
+
+        return uFoundAppId;
+    }
+
+    void CAppIdCache::Clear()
+    {
+        std::unique_lock lock( m_Mutex );
+        ClearLocked();
+    }
+
+    size_t CAppIdCache::Size() const
+    {
+        std::unique_lock lock( m_Mutex );
+        return m_Entries.size();
+    }
+
+    uint32_t CAppIdCache::LookupLocked( pid_t nPid, uint32_t uDepth )
+    {
+        if ( nPid <= 0 || uDepth >= k_uMaxAncestorDepth )
+            return 0;
+
+        auto iter = m_Entries.find( nPid );
+        if ( iter != m_Entries.end() )
+        {
+            if ( IsSameProcess( nPid, iter->second ) )
+                return iter->second.uAppId;
+
+            if ( iter->second.nPidFd >= 0 )
+                close( iter->second.nPidFd );
+            m_Entries.erase( iter );
+        }
+
+        // Open the pidfd before reading /proc, if the process is still
+        // alive afterwards, everything we read belonged to it and not
+        // something that reused its pid.
+        Entry_t entry;
+        entry.nPidFd = OpenPidFd( nPid );
+
+        ProcStat_t stat;
+        if ( !ReadProcStat( nPid, &stat ) )
+        {
+            if ( entry.nPidFd >= 0 )
+                close( entry.nPidFd );
+            return 0;
+        }
+        entry.ulStartTime = stat.ulStartTime;
+
+        uint32_t uOwnAppId = 0;
+        if ( strcmp( stat.szName, "reaper" ) == 0 )
+            uOwnAppId = ReadReaperAppId( nPid );
+
+        uint32_t uParentAppId = LookupLocked( stat.nParentPid, uDepth + 1 );
+        entry.uAppId = uParentAppId ? uParentAppId : uOwnAppId;
+
+        if ( entry.nPidFd >= 0 && HasExited( entry.nPidFd ) )
+        {
+            close( entry.nPidFd );
+            return entry.uAppId;
+        }
+
+        InsertLocked( nPid, entry );
+        return entry.uAppId;
+    }
+
+    bool CAppIdCache::IsSameProcess( pid_t nPid, const Entry_t &entry ) const
+    {
+        if ( entry.nPidFd >= 0 )
+            return !HasExited( entry.nPidFd );
+
+        ProcStat_t stat;
+        return ReadProcStat( nPid, &stat ) && stat.ulStartTime == entry.ulStartTime;
+    }
+
+    int CAppIdCache::OpenPidFd( pid_t nPid )
+    {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+        if ( !m_bHasPidFd )
+            return -1;
+
+        // pidfds are always close-on-exec.
+        int nPidFd = int( syscall( SYS_pidfd_open, nPid, 0 ) );
+        if ( nPidFd < 0 && errno == ENOSYS )
+            m_bHasPidFd = false;
+        return nPidFd;
+#else
+        return -1;
+#endif
+    }
+
+    void CAppIdCache::InsertLocked( pid_t nPid, const Entry_t &entry )
+    {
+        if ( m_Entries.size() >= k_uMaxCachedPids )
+        {
+            for ( auto iter = m_Entries.begin(); iter != m_Entries.end(); )
+            {
+                if ( !IsSameProcess( iter->first, iter->second ) )
+                {
+                    if ( iter->second.nPidFd >= 0 )
+                        close( iter->second.nPidFd );
+                    iter = m_Entries.erase( iter );
+                }
+                else
+                {
+                    iter++;
+                }
+            }
+
+            // Everything is still alive, start over rather than grow.
+            if ( m_Entries.size() >= k_uMaxCachedPids )
+                ClearLocked();
+        }
+
+        m_Entries.emplace( nPid, entry );
+    }
+
+    void CAppIdCache::ClearLocked()
+    {
+        for ( auto &[ nPid, entry ] : m_Entries )
+        {
+            if ( entry.nPidFd >= 0 )
+                close( entry.nPidFd );
+        }
+        m_Entries.clear();
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+#include "Utils/NonCopyable.h"
+
+namespace gamescope
+{
+    struct ProcStat_t
+    {
+        pid_t nParentPid = 0;
+        // In clock ticks since boot, (pid, start time) uniquely names a process.
+        uint64_t ulStartTime = 0;
+        char szName[64] = {};
+    };
+
+    // Parses /proc/<pid>/stat with a single read().
+    bool ReadProcStat( pid_t nPid, ProcStat_t *pOutStat );
+
+    // AppId from a `reaper SteamLaunch AppId=<n> -- ...` command line, 0 if there isn't one.
+    uint32_t ReadReaperAppId( pid_t nPid );
+
+    // Maps a pid to the Steam AppId of the reaper it was launched under.
+    //
+    // Every process we look at (including the ancestors) is remembered along
+    // with its start time and a pidfd, so a new window from a known process,
+    // or a new process under a known launcher, costs at most one /proc read.
+    // Entries are dropped once their pidfd says the process has exited, or,
+    // without pidfd support, when the start time no longer matches.
+    class CAppIdCache : public NonCopyable
+    {
+    public:
+        static CAppIdCache &Get();
+
+        CAppIdCache();
+        ~CAppIdCache();
+
+        uint32_t GetAppIdForPid( pid_t nPid );
+
+        // Walks /proc from scratch every time.
+        static uint32_t LookupUncached( pid_t nPid );
+
+        void Clear();
+        size_t Size() const;
+    private:
+        struct Entry_t
+        {
+            uint64_t ulStartTime = 0;
+            // -1 if we don't have one, then we fall back to checking the start time.
+            int nPidFd = -1;
+            uint32_t uAppId = 0;
+        };
+
+        uint32_t LookupLocked( pid_t nPid, uint32_t uDepth );
+        bool IsSameProcess( pid_t nPid, const Entry_t &entry ) const;
+        int OpenPidFd( pid_t nPid );
+        void InsertLocked( pid_t nPid, const Entry_t &entry );
+        void ClearLocked();
+
+        mutable std::mutex m_Mutex;
+        std::unordered_map<pid_t, Entry_t> m_Entries;
+        bool m_bHasPidFd = true;
+    };
+}
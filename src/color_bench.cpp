@@ -15,8 +15,10 @@ uint16_t lut3d[nLutEdgeSize3d*nLutEdgeSize3d*nLutEdgeSize3d*4];
 lut1d_t lut1d_float;
 lut3d_t lut3d_float;
 
-static void BenchmarkCalcColorTransform(EOTF inputEOTF, benchmark::State &state)
+static void BenchmarkCalcColorTransform(EOTF inputEOTF, benchmark::State &state, bool bMultithreaded = true)
 {
+    g_bColorTransformMultithreaded = bMultithreaded;
+
     const primaries_t primaries = { { 0.602f, 0.355f }, { 0.340f, 0.574f }, { 0.164f, 0.121f } };
     const glm::vec2 white = { 0.3070f, 0.3220f };
     const glm::vec2 destVirtualWhite = { 0.f, 0.f };
@@ -78,6 +80,18 @@ static void BenchmarkCalcColorTransforms(benchmark::State &state)
 }
 BENCHMARK(BenchmarkCalcColorTransforms);
 
+static void BenchmarkCalcColorTransforms_G22_SingleThreaded(benchmark::State &state)
+{
+    BenchmarkCalcColorTransform(EOTF_Gamma22, state, false);
+}
+BENCHMARK(BenchmarkCalcColorTransforms_G22_SingleThreaded);
+
+static void BenchmarkCalcColorTransforms_PQ_SingleThreaded(benchmark::State &state)
+{
+    BenchmarkCalcColorTransform(EOTF_PQ, state, false);
+}
+BENCHMARK(BenchmarkCalcColorTransforms_PQ_SingleThreaded);
+
 static constexpr uint32_t k_uFindTestValueCountLarge = 524288;
 static constexpr uint32_t k_uFindTestValueCountMedium = 16;
 static constexpr uint32_t k_uFindTestValueCountSmall = 5;
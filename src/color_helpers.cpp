@@ -13,6 +13,8 @@
 #include <glm/gtx/matrix_operation.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#include "Utils/WorkerPool.h"
+
 
 glm::vec3 xyY_to_XYZ( const glm::vec2 & xy, float Y )
 {
@@ -670,6 +672,24 @@ inline T applyShaper( const T & input, EOTF source, EOTF dest, const tonemapping
 
 bool g_bHuePreservationWhenClipping = false;
 
+bool g_bColorTransformMultithreaded = true;
+
+// Enough shaper entries per job to amortize the dispatch.
+static constexpr int k_nShaperChunkSize = 256;
+
+template <typename Func>
+static void ColorTransformParallelFor( uint32_t uCount, Func fnJob )
+{
+    if ( !g_bColorTransformMultithreaded )
+    {
+        for ( uint32_t i = 0; i < uCount; i++ )
+            fnJob( i );
+        return;
+    }
+
+    gamescope::CWorkerPool::Get().ParallelFor( uCount, fnJob );
+}
+
 template <uint32_t lutEdgeSize3d>
 void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
 	lut3d_t * pLut3d,
@@ -691,14 +711,20 @@ void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
         float flScale = 1.f / ( (float) nLutSize1d - 1.f );
         pShaper->resize( nLutSize1d );
 
-        for ( int nVal=0; nVal<nLutSize1d; ++nVal )
+        const int nChunkCount = ( nLutSize1d + k_nShaperChunkSize - 1 ) / k_nShaperChunkSize;
+        ColorTransformParallelFor( nChunkCount, [&]( uint32_t nChunk )
         {
-            glm::vec3 sourceColorEOTFEncoded = { nVal * flScale, nVal * flScale, nVal * flScale };
-            glm::vec3 shapedSourceColor = applyShaper( sourceColorEOTFEncoded, sourceEOTF, destEOTF, tonemapping, flGain );
-            pShaper->dataR[nVal] = shapedSourceColor.r;
-            pShaper->dataG[nVal] = shapedSourceColor.g;
-            pShaper->dataB[nVal] = shapedSourceColor.b;
-        }
+            const int nBegin = nChunk * k_nShaperChunkSize;
+            const int nEnd = std::min( nBegin + k_nShaperChunkSize, nLutSize1d );
+            for ( int nVal=nBegin; nVal<nEnd; ++nVal )
+            {
+                glm::vec3 sourceColorEOTFEncoded = { nVal * flScale, nVal * flScale, nVal * flScale };
+                glm::vec3 shapedSourceColor = applyShaper( sourceColorEOTFEncoded, sourceEOTF, destEOTF, tonemapping, flGain );
+                pShaper->dataR[nVal] = shapedSourceColor.r;
+                pShaper->dataG[nVal] = shapedSourceColor.g;
+                pShaper->dataB[nVal] = shapedSourceColor.b;
+            }
+        });
 
         pShaper->finalize();
     }
@@ -753,16 +779,20 @@ void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
         }
 
         pLut3d->resize( nLutEdgeSize3d );
-    
-        for ( int nBlue=0; nBlue<nLutEdgeSize3d; ++nBlue )
+
+        const bool bHasLook = pLook && !pLook->data.empty();
+
+        // Every blue slice is independent, hand them out to the worker pool.
+        ColorTransformParallelFor( nLutEdgeSize3d, [&]( uint32_t nSlice )
         {
+            const int nBlue = static_cast<int>( nSlice );
             for ( int nGreen=0; nGreen<nLutEdgeSize3d; ++nGreen )
             {
                 for ( int nRed=0; nRed<nLutEdgeSize3d; ++nRed )
                 {
                     glm::vec3 sourceColorEOTFEncoded = glm::vec3( vSourceColorEOTFEncodedEdge[nRed].r, vSourceColorEOTFEncodedEdge[nGreen].g, vSourceColorEOTFEncodedEdge[nBlue].b );
 
-                    if ( pLook && !pLook->data.empty() )
+                    if ( bHasLook )
                     {
                         sourceColorEOTFEncoded = ApplyLut3D_Tetrahedral( *pLook, sourceColorEOTFEncoded );
                     }
@@ -808,7 +838,7 @@ void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
                     pLut3d->data[GetLut3DIndexRedFastRGB( nRed, nGreen, nBlue, nLutEdgeSize3d )] = destColorEOTFEncoded;
                 }
             }
-        }
+        });
     }
 }
 
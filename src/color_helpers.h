@@ -354,6 +354,10 @@ struct lut3d_t
 
 bool LoadCubeLut( lut3d_t * lut3d, const char * filename );
 
+// Whether calcColorTransform splits its work across the shared worker pool.
+// The output is identical either way.
+extern bool g_bColorTransformMultithreaded;
+
 // Generate a color transform from the source colorspace, to the dest colorspace,
 // nLutSize1d is the number of color entries in the shaper lut
 // I.e., for a shaper lut with 256 input colors  nLutSize1d = 256, countof(pRgbxData1d) = 1024
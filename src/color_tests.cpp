@@ -1,5 +1,6 @@
-#include "color_helpers.h"
+#include "color_helpers_impl.h"
 #include <cstdio>
+#include <cstring>
 
 //#include <glm/ext.hpp>
 #include <glm/gtx/string_cast.hpp>
@@ -230,10 +231,94 @@ void test_eetf2390_mono()
     }
 }
 
+static void quantize_luts( const lut1d_t & lut1d_float, const lut3d_t & lut3d_float, std::vector<uint16_t> *pLut1d, std::vector<uint16_t> *pLut3d )
+{
+    pLut1d->resize( lut1d_float.dataR.size() * 4 );
+    for ( size_t i=0, end = lut1d_float.dataR.size(); i<end; ++i )
+    {
+        (*pLut1d)[4*i+0] = quantize_lut_value_16bit( lut1d_float.dataR[i] );
+        (*pLut1d)[4*i+1] = quantize_lut_value_16bit( lut1d_float.dataG[i] );
+        (*pLut1d)[4*i+2] = quantize_lut_value_16bit( lut1d_float.dataB[i] );
+        (*pLut1d)[4*i+3] = 0;
+    }
+
+    pLut3d->resize( lut3d_float.data.size() * 4 );
+    for ( size_t i=0, end = lut3d_float.data.size(); i<end; ++i )
+    {
+        (*pLut3d)[4*i+0] = quantize_lut_value_16bit( lut3d_float.data[i].r );
+        (*pLut3d)[4*i+1] = quantize_lut_value_16bit( lut3d_float.data[i].g );
+        (*pLut3d)[4*i+2] = quantize_lut_value_16bit( lut3d_float.data[i].b );
+        (*pLut3d)[4*i+3] = 0;
+    }
+}
+
+// The multithreaded LUT generation must match the single threaded path exactly.
+int test_color_transform_multithreaded()
+{
+    using ns_color_tests::nLutEdgeSize3d;
+    const int nLutSize1d = 4096;
+
+    printf("%s\n", __func__ );
+
+    displaycolorimetry_t inputColorimetry = displaycolorimetry_steamdeck_spec;
+    displaycolorimetry_t outputEncodingColorimetry = displaycolorimetry_steamdeck_measured;
+
+    colormapping_t colorMapping{};
+    buildSDRColorimetry( &inputColorimetry, &colorMapping, 0.5f, displaycolorimetry_steamdeck_measured );
+
+    nightmode_t nightmode{};
+    nightmode.amount = 0.5f;
+    nightmode.hue = 0.05f;
+    nightmode.saturation = 0.8f;
+
+    const glm::vec2 destVirtualWhite = { 0.3127f, 0.3290f };
+
+    int nFailures = 0;
+    for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+    {
+        tonemapping_t tonemapping{};
+        tonemapping.bUseShaper = true;
+        if ( nInputEOTF == EOTF_PQ )
+        {
+            tonemapping.g22_luminance = 500.f;
+            tonemapping.eOperator = ETonemapOperator_EETF2390_Luma;
+            tonemapping.eetf2390.init( tonemap_info_t{ 0.01f, 5000.f }, tonemap_info_t{ 0.1f, 500.f } );
+        }
+
+        std::vector<uint16_t> lut1d[2];
+        std::vector<uint16_t> lut3d[2];
+        for ( int nPass = 0; nPass < 2; nPass++ )
+        {
+            g_bColorTransformMultithreaded = nPass != 0;
+
+            lut1d_t lut1d_float;
+            lut3d_t lut3d_float;
+            calcColorTransform<nLutEdgeSize3d>( &lut1d_float, nLutSize1d, &lut3d_float, inputColorimetry, (EOTF)nInputEOTF,
+                outputEncodingColorimetry, EOTF_Gamma22,
+                destVirtualWhite, k_EChromaticAdapatationMethod_Bradford,
+                colorMapping, nightmode, tonemapping, nullptr, 1.2f );
+            quantize_luts( lut1d_float, lut3d_float, &lut1d[nPass], &lut3d[nPass] );
+        }
+        g_bColorTransformMultithreaded = true;
+
+        bool bMatch1d = lut1d[0] == lut1d[1];
+        bool bMatch3d = lut3d[0] == lut3d[1];
+        printf("EOTF %u: 1d %s, 3d %s\n", nInputEOTF, bMatch1d ? "match" : "MISMATCH", bMatch3d ? "match" : "MISMATCH" );
+        if ( !bMatch1d || !bMatch3d )
+            nFailures++;
+    }
+
+    return nFailures;
+}
+
 int main(int argc, char* argv[])
 {
     printf("color_tests\n");
     // test_eetf2390_mono();
     color_tests();
+
+    if ( test_color_transform_multithreaded() != 0 )
+        return 1;
+
     return 0;
 }
\ No newline at end of file
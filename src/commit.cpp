@@ -22,14 +22,16 @@ commit_t::~commit_t()
     if ( vulkanTex != nullptr )
         vulkanTex = nullptr;
 
-    wlserver_lock();
     if (!presentation_feedbacks.empty())
     {
+        wlserver_lock();
         wlserver_presentation_feedback_discard(surf, presentation_feedbacks);
         // presentation_feedbacks cleared by wlserver_presentation_feedback_discard
+        wlserver_unlock();
     }
-    wlr_buffer_unlock( buf );
-    wlserver_unlock();
+
+    // Don't wait on the Wayland thread just to drop the buffer.
+    wlserver_release_buffer_deferred( buf );
 }
 
 GamescopeAppTextureColorspace commit_t::colorspace() const
@@ -65,6 +65,7 @@ struct commit_t final : public gamescope::RcObject, public gamescope::IWaitable,
 
 	std::optional<uint32_t> present_id = std::nullopt;
 	uint64_t desired_present_time = 0;
+	uint64_t commit_time = 0;
 	uint64_t earliest_present_time = 0;
 	uint64_t present_margin = 0;
 
@@ -46,6 +46,13 @@ using namespace std::literals;
 EStreamColorspace g_ForcedNV12ColorSpace = k_EStreamColorspace_Unknown;
 extern gamescope::ConVar<bool> cv_adaptive_sync;
 
+namespace gamescope
+{
+	extern ConVar<bool> cv_headless_composite;
+	extern ConVar<std::string> cv_headless_timing_path;
+	extern ConVar<uint32_t> cv_headless_dump_frames;
+}
+
 const char *gamescope_optstring = nullptr;
 const char *g_pOriginalDisplay = nullptr;
 const char *g_pOriginalWaylandDisplay = nullptr;
@@ -74,6 +81,11 @@ const struct option *gamescope_options = (struct option[]){
 
 	{ "backend", required_argument, nullptr, 0 },
 
+	// headless options
+	{ "headless-composite", no_argument, nullptr, 0 },
+	{ "headless-timing-path", required_argument, nullptr, 0 },
+	{ "headless-dump-frames", required_argument, nullptr, 0 },
+
 	// nested mode options
 	{ "nested-unfocused-refresh", required_argument, nullptr, 'o' },
 	{ "borderless", no_argument, nullptr, 'b' },
@@ -185,6 +197,9 @@ const char usage[] =
 #endif
 	"                                     headless => use headless backend (no window, no DRM output)\n"
 	"                                     wayland => use Wayland backend\n"
+	"  --headless-composite           headless backend: run the full composite every frame (for load-testing)\n"
+	"  --headless-timing-path         headless backend: write per-frame wake-up/submit/GPU done/vblank timestamps to path\n"
+	"  --headless-dump-frames         headless backend: copy composited frames into a ring of N memfds\n"
 	"  --cursor                       path to default cursor image\n"
 	"  -R, --ready-fd                 notify FD when ready\n"
 	"  --rt                           Use realtime scheduling\n"
@@ -778,6 +793,12 @@ int main(int argc, char **argv)
 					g_bExposeWayland = true;
 				} else if (strcmp(opt_name, "backend") == 0) {
 					eCurrentBackend = parse_backend_name( optarg );
+				} else if (strcmp(opt_name, "headless-composite") == 0) {
+					gamescope::cv_headless_composite = true;
+				} else if (strcmp(opt_name, "headless-timing-path") == 0) {
+					gamescope::cv_headless_timing_path = std::string( optarg );
+				} else if (strcmp(opt_name, "headless-dump-frames") == 0) {
+					gamescope::cv_headless_dump_frames = uint32_t( atoi( optarg ) );
 				} else if (strcmp(opt_name, "cursor-scale-height") == 0) {
 					g_nCursorScaleHeight = atoi(optarg);
 				} else if (strcmp(opt_name, "mangoapp") == 0) {
@@ -0,0 +1,132 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils/ReadMostlyHashTable.h"
+
+// Mirrors PipelineInfo_t from rendervulkan.hpp, without dragging in Vulkan.
+struct BenchPipelineKey_t
+{
+    uint32_t shaderType;
+    uint32_t layerCount;
+    uint32_t ycbcrMask;
+    uint32_t blurLayerCount;
+    uint32_t compositeDebug;
+    uint32_t colorspaceMask;
+    uint32_t outputEOTF;
+    bool itmEnable;
+
+    bool operator==( const BenchPipelineKey_t &o ) const = default;
+};
+
+static inline uint32_t hash_combine( uint32_t old_hash, uint32_t new_hash )
+{
+    return old_hash ^ ( new_hash + 0x9e3779b9 + ( old_hash << 6 ) + ( old_hash >> 2 ) );
+}
+
+struct BenchPipelineKeyHash
+{
+    size_t operator()( const BenchPipelineKey_t &k ) const
+    {
+        uint32_t hash = k.shaderType;
+        hash = hash_combine( hash, k.layerCount );
+        hash = hash_combine( hash, k.ycbcrMask );
+        hash = hash_combine( hash, k.blurLayerCount );
+        hash = hash_combine( hash, k.compositeDebug );
+        hash = hash_combine( hash, k.colorspaceMask );
+        hash = hash_combine( hash, k.outputEOTF );
+        hash = hash_combine( hash, k.itmEnable );
+        return hash;
+    }
+};
+
+using BenchPipeline = uintptr_t;
+
+// Roughly the set compileAllPipelines and the predictor end up with.
+static std::vector<BenchPipelineKey_t> GetBenchKeys()
+{
+    std::vector<BenchPipelineKey_t> keys;
+    for ( uint32_t uShaderType = 0; uShaderType < 8; uShaderType++ )
+    {
+        for ( uint32_t uLayerCount = 1; uLayerCount <= 6; uLayerCount++ )
+        {
+            for ( uint32_t uYcbcrMask = 0; uYcbcrMask < 3; uYcbcrMask++ )
+            {
+                for ( uint32_t uEOTF = 0; uEOTF < 3; uEOTF++ )
+                {
+                    uint32_t uColorspaceMask = 0;
+                    for ( uint32_t i = 0; i < uLayerCount; i++ )
+                        uColorspaceMask |= 1u << ( i * 3 );
+
+                    keys.push_back( BenchPipelineKey_t{ uShaderType, uLayerCount, uYcbcrMask, 0, 0, uColorspaceMask, uEOTF, false } );
+                }
+            }
+        }
+    }
+    return keys;
+}
+
+static const std::vector<BenchPipelineKey_t> s_BenchKeys = GetBenchKeys();
+
+static std::unordered_map<BenchPipelineKey_t, BenchPipeline, BenchPipelineKeyHash> s_MutexMap = []()
+{
+    std::unordered_map<BenchPipelineKey_t, BenchPipeline, BenchPipelineKeyHash> map;
+    for ( size_t i = 0; i < s_BenchKeys.size(); i++ )
+        map[ s_BenchKeys[ i ] ] = BenchPipeline( i + 1 );
+    return map;
+}();
+static std::mutex s_MutexMapMutex;
+
+static gamescope::CReadMostlyHashTable<BenchPipelineKey_t, BenchPipeline, BenchPipelineKeyHash> s_ReadMostlyTable;
+static bool s_bReadMostlyTableInit = []()
+{
+    for ( size_t i = 0; i < s_BenchKeys.size(); i++ )
+        s_ReadMostlyTable.Insert( s_BenchKeys[ i ], BenchPipeline( i + 1 ) );
+    return true;
+}();
+
+static void Benchmark_PipelineLookup_MutexMap( benchmark::State &state )
+{
+    size_t uIndex = state.thread_index() * 17;
+    for ( auto _ : state )
+    {
+        const BenchPipelineKey_t &key = s_BenchKeys[ uIndex++ % s_BenchKeys.size() ];
+
+        std::lock_guard<std::mutex> lock( s_MutexMapMutex );
+        auto search = s_MutexMap.find( key );
+        benchmark::DoNotOptimize( search->second );
+    }
+}
+BENCHMARK( Benchmark_PipelineLookup_MutexMap )->ThreadRange( 1, 4 );
+
+static void Benchmark_PipelineLookup_ReadMostly( benchmark::State &state )
+{
+    size_t uIndex = state.thread_index() * 17;
+    for ( auto _ : state )
+    {
+        const BenchPipelineKey_t &key = s_BenchKeys[ uIndex++ % s_BenchKeys.size() ];
+
+        const BenchPipeline *pPipeline = s_ReadMostlyTable.Find( key );
+        benchmark::DoNotOptimize( *pPipeline );
+    }
+}
+BENCHMARK( Benchmark_PipelineLookup_ReadMostly )->ThreadRange( 1, 4 );
+
+// A miss, eg. a permutation that hasn't been compiled yet.
+static void Benchmark_PipelineLookup_ReadMostly_Miss( benchmark::State &state )
+{
+    BenchPipelineKey_t key = s_BenchKeys[ 0 ];
+    key.compositeDebug = 1;
+
+    for ( auto _ : state )
+    {
+        const BenchPipeline *pPipeline = s_ReadMostlyTable.Find( key );
+        benchmark::DoNotOptimize( pPipeline );
+    }
+}
+BENCHMARK( Benchmark_PipelineLookup_ReadMostly_Miss );
+
+BENCHMARK_MAIN();
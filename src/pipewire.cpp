@@ -1,18 +1,24 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <map>
 #include <thread>
 #include <vector>
 
 #include "main.hpp"
 #include "pipewire.hpp"
+#include "steamcompmgr.hpp"
 #include "log.hpp"
+#include "convar.h"
+#include "Utils/SPSCRing.h"
 
 #include <spa/debug/format.h>
 
@@ -21,10 +27,15 @@ static LogScope pwr_log("pipewire");
 static struct pipewire_state pipewire_state = { .stream_node_id = SPA_ID_INVALID };
 static int nudgePipe[2] = { -1, -1 };
 
-// Pending buffer for PipeWire → steamcompmgr
-static std::atomic<struct pipewire_buffer *> out_buffer;
-// Pending buffer for steamcompmgr → PipeWire
-static std::atomic<struct pipewire_buffer *> in_buffer;
+static constexpr int k_nMaxPipewireBuffers = 8;
+
+gamescope::ConVar<int> cv_pipewire_buffers{ "pipewire_buffers", 4, "How many capture buffers to ask PipeWire for (2-8). More lets us keep capturing at full rate through a consumer that's late now and then. Applies on the next format change." };
+gamescope::ConVar<uint64_t> cv_pipewire_frames_without_buffer{ "pipewire_frames_without_buffer", 0, "Number of times we went to capture for PipeWire and every buffer was still with the consumer. (Read-only)" };
+
+// Free buffers for PipeWire → steamcompmgr
+static gamescope::CSPSCRing<struct pipewire_buffer *, k_nMaxPipewireBuffers> s_FreeBuffers;
+// Rendered buffers for steamcompmgr → PipeWire, in order
+static gamescope::CSPSCRing<struct pipewire_buffer *, k_nMaxPipewireBuffers> s_FilledBuffers;
 
 // Requested capture size
 static uint32_t s_nRequestedWidth;
@@ -34,16 +45,43 @@ static uint32_t s_nCaptureHeight;
 static uint32_t s_nOutputWidth;
 static uint32_t s_nOutputHeight;
 
+static bool is_ycbcr_format(uint32_t spa_format)
+{
+	return spa_format == SPA_VIDEO_FORMAT_NV12 || spa_format == SPA_VIDEO_FORMAT_P010_10LE;
+}
+
+// Bytes per pixel of the first plane.
+static int spa_format_bpp(uint32_t spa_format)
+{
+	switch (spa_format) {
+	case SPA_VIDEO_FORMAT_NV12: return 1;
+	case SPA_VIDEO_FORMAT_P010_10LE: return 2;
+	default: return 4;
+	}
+}
+
+// Chroma is interleaved at half height, so it has the same stride as luma.
+static uint32_t plane_height(uint32_t spa_format, uint32_t plane, uint32_t height)
+{
+	return is_ycbcr_format(spa_format) && plane == 1 ? (height + 1) / 2 : height;
+}
+
+static off_t shm_buffer_size(uint32_t spa_format, int stride, uint32_t height)
+{
+	off_t size = off_t(stride) * plane_height(spa_format, 0, height);
+	if (is_ycbcr_format(spa_format)) {
+		size += off_t(stride) * plane_height(spa_format, 1, height);
+	}
+	return size;
+}
+
 static void destroy_buffer(struct pipewire_buffer *buffer) {
 	assert(buffer->buffer == nullptr);
 
 	switch (buffer->type) {
 	case SPA_DATA_MemFd:
 	{
-		off_t size = buffer->shm.stride * buffer->video_info.size.height;
-		if (buffer->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-			size += buffer->shm.stride * ((buffer->video_info.size.height + 1) / 2);
-		}
+		off_t size = shm_buffer_size(buffer->video_info.format, buffer->shm.stride, buffer->video_info.size.height);
 		munmap(buffer->shm.data, size);
 		close(buffer->shm.fd);
 		break;
@@ -54,13 +92,6 @@ static void destroy_buffer(struct pipewire_buffer *buffer) {
 		assert(false); // unreachable
 	}	
 
-	// If out_buffer == buffer, then set it to nullptr.
-	// We don't care about the result.
-	struct pipewire_buffer *buffer1 = buffer;
-	out_buffer.compare_exchange_strong(buffer1, nullptr);
-	struct pipewire_buffer *buffer2 = buffer;
-	in_buffer.compare_exchange_strong(buffer2, nullptr);
-
 	delete buffer;
 }
 
@@ -89,12 +120,49 @@ static void calculate_capture_size()
 	}
 }
 
+uint32_t spa_format_to_drm(uint32_t spa_format)
+{
+	switch (spa_format)
+	{
+		case SPA_VIDEO_FORMAT_NV12: return DRM_FORMAT_NV12;
+		case SPA_VIDEO_FORMAT_P010_10LE: return DRM_FORMAT_P010;
+		default:
+		case SPA_VIDEO_FORMAT_BGR: return DRM_FORMAT_XRGB8888;
+	}
+}
+
+// DMA-BUF modifiers we offer for a format, most preferred first.
+// Empty if we can't capture to the format at all.
+static const std::vector<uint64_t> &get_capture_modifiers(spa_video_format format)
+{
+	// Only used from the PipeWire thread (and before it starts).
+	static std::map<spa_video_format, std::vector<uint64_t>> s_CaptureModifiers;
+
+	auto iter = s_CaptureModifiers.find(format);
+	if (iter != s_CaptureModifiers.end())
+		return iter->second;
+
+	std::vector<uint64_t> modifiers = vulkan_get_capture_modifiers(spa_format_to_drm(format));
+
+	// BGRx and NV12 have always worked through a linear image, even without
+	// modifier support. P010 needs the driver to tell us it can do it.
+	if (format != SPA_VIDEO_FORMAT_P010_10LE || !modifiers.empty()) {
+		std::erase(modifiers, DRM_FORMAT_MOD_LINEAR);
+		modifiers.push_back(DRM_FORMAT_MOD_LINEAR);
+	}
+
+	return s_CaptureModifiers.emplace(format, std::move(modifiers)).first->second;
+}
+
 static void build_format_params(struct spa_pod_builder *builder, spa_video_format format, std::vector<const struct spa_pod *> &params) {
+	const std::vector<uint64_t> &modifiers = get_capture_modifiers(format);
+	if (modifiers.empty())
+		return;
+
 	struct spa_rectangle size = SPA_RECTANGLE(s_nCaptureWidth, s_nCaptureHeight);
 	struct spa_rectangle min_requested_size = { 0, 0 };
 	struct spa_rectangle max_requested_size = { UINT32_MAX, UINT32_MAX };
 	struct spa_fraction framerate = SPA_FRACTION(0, 1);
-	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
 
 	struct spa_pod_frame obj_frame, choice_frame;
 	spa_pod_builder_push_object(builder, &obj_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
@@ -107,7 +175,7 @@ static void build_format_params(struct spa_pod_builder *builder, spa_video_forma
 		SPA_FORMAT_VIDEO_requested_size, SPA_POD_CHOICE_RANGE_Rectangle( &min_requested_size, &min_requested_size, &max_requested_size ),
 		SPA_FORMAT_VIDEO_gamescope_focus_appid, SPA_POD_CHOICE_RANGE_Long( 0ll, INT64_MIN, INT64_MAX ),
 		0);
-	if (format == SPA_VIDEO_FORMAT_NV12) {
+	if (is_ycbcr_format(format)) {
 		spa_pod_builder_add(builder,
 			SPA_FORMAT_VIDEO_colorMatrix, SPA_POD_CHOICE_ENUM_Id(3,
 							SPA_VIDEO_COLOR_MATRIX_BT601,
@@ -121,8 +189,9 @@ static void build_format_params(struct spa_pod_builder *builder, spa_video_forma
 	}
 	spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
 	spa_pod_builder_push_choice(builder, &choice_frame, SPA_CHOICE_Enum, 0);
-	spa_pod_builder_long(builder, modifier); // default
-	spa_pod_builder_long(builder, modifier);
+	spa_pod_builder_long(builder, modifiers[0]); // default
+	for (uint64_t modifier : modifiers)
+		spa_pod_builder_long(builder, modifier);
 	spa_pod_builder_pop(builder, &choice_frame);
 	params.push_back((const struct spa_pod *) spa_pod_builder_pop(builder, &obj_frame));
 
@@ -136,7 +205,7 @@ static void build_format_params(struct spa_pod_builder *builder, spa_video_forma
 		SPA_FORMAT_VIDEO_requested_size, SPA_POD_CHOICE_RANGE_Rectangle( &min_requested_size, &min_requested_size, &max_requested_size ),
 		SPA_FORMAT_VIDEO_gamescope_focus_appid, SPA_POD_CHOICE_RANGE_Long( 0ll, INT64_MIN, INT64_MAX ),
 		0);
-	if (format == SPA_VIDEO_FORMAT_NV12) {
+	if (is_ycbcr_format(format)) {
 		spa_pod_builder_add(builder,
 			SPA_FORMAT_VIDEO_colorMatrix, SPA_POD_CHOICE_ENUM_Id(3,
 							SPA_VIDEO_COLOR_MATRIX_BT601,
@@ -161,25 +230,47 @@ static std::vector<const struct spa_pod *> build_format_params(struct spa_pod_bu
 
 	build_format_params(builder, SPA_VIDEO_FORMAT_BGRx, params);
 	build_format_params(builder, SPA_VIDEO_FORMAT_NV12, params);
+	build_format_params(builder, SPA_VIDEO_FORMAT_P010_10LE, params);
 
 	return params;
 }
 
-static void request_buffer(struct pipewire_state *state)
+static void fill_damage_meta(struct spa_buffer *spa_buffer, const struct pipewire_buffer *buffer, bool full_damage)
 {
-	struct pw_buffer *pw_buffer = pw_stream_dequeue_buffer(state->stream);
-	if (!pw_buffer) {
-		pwr_log.errorf("warning: out of buffers");
+	struct spa_meta *meta = spa_buffer_find_meta(spa_buffer, SPA_META_VideoDamage);
+	if (meta == nullptr)
 		return;
-	}
 
-	struct pipewire_buffer *buffer = (struct pipewire_buffer *) pw_buffer->user_data;
-	buffer->copying = true;
+	const uint32_t max_regions = meta->size / sizeof(struct spa_meta_region);
+	if (max_regions == 0)
+		return;
+
+	struct spa_meta_region *region = (struct spa_meta_region *) spa_meta_first(meta);
+
+	if (full_damage || buffer->full_damage || buffer->damage.empty()) {
+		region->region = SPA_REGION(0, 0, buffer->texture->width(), buffer->texture->height());
+		region++;
+	} else if (buffer->damage.size() > max_regions) {
+		// Doesn't fit, send the bounds instead.
+		int32_t x1 = INT32_MAX, y1 = INT32_MAX, x2 = 0, y2 = 0;
+		for (const VkRect2D &rect : buffer->damage) {
+			x1 = std::min<int32_t>(x1, rect.offset.x);
+			y1 = std::min<int32_t>(y1, rect.offset.y);
+			x2 = std::max<int32_t>(x2, rect.offset.x + rect.extent.width);
+			y2 = std::max<int32_t>(y2, rect.offset.y + rect.extent.height);
+		}
+		region->region = SPA_REGION(x1, y1, uint32_t(x2 - x1), uint32_t(y2 - y1));
+		region++;
+	} else {
+		for (const VkRect2D &rect : buffer->damage) {
+			region->region = SPA_REGION(rect.offset.x, rect.offset.y, rect.extent.width, rect.extent.height);
+			region++;
+		}
+	}
 
-	// Past this exchange, the PipeWire thread shares the buffer with the
-	// steamcompmgr thread
-	struct pipewire_buffer *old = out_buffer.exchange(buffer);
-	assert(old == nullptr);
+	// A zero-sized region ends the list if we didn't fill it.
+	if (spa_meta_check(region, meta))
+		region->region = SPA_REGION(0, 0, 0, 0);
 }
 
 static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *buffer)
@@ -192,9 +283,16 @@ static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *bu
 
 	bool needs_reneg = buffer->video_info.size.width != tex->width() || buffer->video_info.size.height != tex->height();
 
+	// We've just finished waiting on the render.
+	uint64_t capture_time = get_time_in_nanos();
+
+	// Two captures could end up on the same vblank, keep the pts going forward.
+	int64_t pts = std::max<int64_t>(buffer->vblank_time, state->last_pts + 1);
+	state->last_pts = pts;
+
 	struct spa_meta_header *header = (struct spa_meta_header *) spa_buffer_find_meta_data(spa_buffer, SPA_META_Header, sizeof(*header));
 	if (header != nullptr) {
-		header->pts = -1;
+		header->pts = pts;
 		header->flags = needs_reneg ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
 		header->seq = state->seq++;
 		header->dts_offset = 0;
@@ -205,23 +303,28 @@ static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *bu
 		*requested_size_scale = ((float)tex->width() / g_nOutputWidth);
 	}
 
+	struct spa_meta_gamescope_latency *latency = (struct spa_meta_gamescope_latency *) spa_buffer_find_meta_data(spa_buffer, SPA_META_gamescope_latency, sizeof(*latency));
+	if (latency != nullptr) {
+		latency->composite_time = buffer->composite_time;
+		latency->commit_to_composite = buffer->commit_time != 0 ? buffer->composite_time - std::min(buffer->commit_time, buffer->composite_time) : 0;
+		latency->composite_to_capture = capture_time - std::min(buffer->composite_time, capture_time);
+	}
+
+	fill_damage_meta(spa_buffer, buffer, needs_reneg);
+
 	struct spa_chunk *chunk = spa_buffer->datas[0].chunk;
 	chunk->flags = needs_reneg ? SPA_CHUNK_FLAG_CORRUPTED : 0;
 
-	struct wlr_dmabuf_attributes dmabuf;
 	switch (buffer->type) {
 	case SPA_DATA_MemFd:
 		chunk->offset = 0;
-		chunk->size = state->video_info.size.height * buffer->shm.stride;
-		if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-			chunk->size += ((state->video_info.size.height + 1)/2 * buffer->shm.stride);
-		}
+		chunk->size = shm_buffer_size(state->video_info.format, buffer->shm.stride, state->video_info.size.height);
 		chunk->stride = buffer->shm.stride;
 
 		if (!needs_reneg) {
 			uint8_t *pMappedData = tex->mappedData();
 
-			if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
+			if (is_ycbcr_format(state->video_info.format)) {
 				for (uint32_t i = 0; i < tex->height(); i++) {
 					const uint32_t lumaPwOffset = 0;
 					memcpy(
@@ -250,17 +353,78 @@ static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *bu
 		}
 		break;
 	case SPA_DATA_DmaBuf:
-		dmabuf = tex->dmabuf();
-		assert(dmabuf.n_planes == 1);
-		chunk->offset = dmabuf.offset[0];
-		chunk->stride = dmabuf.stride[0];
-		chunk->size = 0; // TODO
+	{
+		// Nothing to copy, the consumer reads what we rendered straight out of the texture.
+		const struct wlr_dmabuf_attributes &dmabuf = tex->dmabuf();
+		assert(uint32_t(dmabuf.n_planes) <= spa_buffer->n_datas);
+		for (int i = 0; i < dmabuf.n_planes; i++) {
+			struct spa_chunk *plane_chunk = spa_buffer->datas[i].chunk;
+			plane_chunk->flags = needs_reneg ? SPA_CHUNK_FLAG_CORRUPTED : 0;
+			plane_chunk->offset = dmabuf.offset[i];
+			plane_chunk->stride = dmabuf.stride[i];
+			// Meaningless for tiled modifiers, but it's what a linear plane would be.
+			plane_chunk->size = dmabuf.stride[i] * plane_height(state->video_info.format, i, tex->height());
+		}
 		break;
+	}
 	default:
 		assert(false); // unreachable
 	}
 }
 
+// Hand every buffer the consumer is done with over to steamcompmgr.
+static void refill_free_buffers(struct pipewire_state *state)
+{
+	if (!state->streaming)
+		return;
+
+	while (s_FreeBuffers.Size() < s_FreeBuffers.Capacity()) {
+		struct pw_buffer *pw_buffer = pw_stream_dequeue_buffer(state->stream);
+		if (!pw_buffer)
+			break;
+
+		struct pipewire_buffer *buffer = (struct pipewire_buffer *) pw_buffer->user_data;
+		if (!buffer) {
+			// We failed to set this one up, give it straight back.
+			pw_buffer->buffer->datas[0].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+			pw_stream_queue_buffer(state->stream, pw_buffer);
+			break;
+		}
+
+		// Past this push, the PipeWire thread shares the buffer with the
+		// steamcompmgr thread
+		buffer->copying = true;
+		s_FreeBuffers.TryPush(buffer);
+	}
+}
+
+static void queue_filled_buffers(struct pipewire_state *state)
+{
+	struct pipewire_buffer *buffer = nullptr;
+	while (s_FilledBuffers.TryPop([&](struct pipewire_buffer *const &filled) { buffer = filled; })) {
+		// We now completely own the buffer, it's no longer shared with the
+		// steamcompmgr thread.
+
+		// This is the only place anything waits for the capture to finish
+		// rendering, steamcompmgr gets on with the next frame meanwhile.
+		// Even a stale buffer has to wait, the GPU may still be writing to its texture.
+		vulkan_wait_for_sequence(buffer->render_sequence, UINT64_MAX);
+
+		buffer->copying = false;
+
+		if (buffer->buffer != nullptr) {
+			copy_buffer(state, buffer);
+
+			int ret = pw_stream_queue_buffer(state->stream, buffer->buffer);
+			if (ret < 0) {
+				pwr_log.errorf("pw_stream_queue_buffer failed");
+			}
+		} else {
+			destroy_buffer(buffer);
+		}
+	}
+}
+
 static void dispatch_nudge(struct pipewire_state *state, int fd)
 {
 	while (true) {
@@ -280,7 +444,7 @@ static void dispatch_nudge(struct pipewire_state *state, int fd)
 	if (s_nCaptureWidth != state->video_info.size.width || s_nCaptureHeight != state->video_info.size.height) {
 		pwr_log.debugf("renegotiating stream params (size: %dx%d)", s_nCaptureWidth, s_nCaptureHeight);
 
-		uint8_t buf[4096];
+		uint8_t buf[8192];
 		struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
 		std::vector<const struct spa_pod *> format_params = build_format_params(&builder);
 		int ret = pw_stream_update_params(state->stream, format_params.data(), format_params.size());
@@ -289,24 +453,8 @@ static void dispatch_nudge(struct pipewire_state *state, int fd)
 		}
 	}
 
-	struct pipewire_buffer *buffer = in_buffer.exchange(nullptr);
-	if (buffer != nullptr) {
-		// We now completely own the buffer, it's no longer shared with the
-		// steamcompmgr thread.
-
-		buffer->copying = false;
-
-		if (buffer->buffer != nullptr) {
-			copy_buffer(state, buffer);
-
-			int ret = pw_stream_queue_buffer(state->stream, buffer->buffer);
-			if (ret < 0) {
-				pwr_log.errorf("pw_stream_queue_buffer failed");
-			}
-		} else {
-			destroy_buffer(buffer);
-		}
-	}
+	queue_filled_buffers(state);
+	refill_free_buffers(state);
 }
 
 static void stream_handle_state_changed(void *data, enum pw_stream_state old_stream_state, enum pw_stream_state stream_state, const char *error)
@@ -355,12 +503,7 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 
 	state->gamescope_info = gamescope_info;
 
-	int bpp = 4;
-	if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-		bpp = 1;
-	}
-
-	state->shm_stride = SPA_ROUND_UP_N(state->video_info.size.width * bpp, 4);
+	state->shm_stride = SPA_ROUND_UP_N(state->video_info.size.width * spa_format_bpp(state->video_info.format), 4);
 
 	const struct spa_pod_prop *modifier_prop = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
 	state->dmabuf = modifier_prop != nullptr;
@@ -368,18 +511,17 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 	uint8_t buf[1024];
 	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
 
-	int buffers = 4;
-	int shm_size = state->shm_stride * state->video_info.size.height;
-	if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-		shm_size += ((state->video_info.size.height + 1) / 2) * state->shm_stride;
-	}
+	int buffers = std::clamp<int>(cv_pipewire_buffers, 2, k_nMaxPipewireBuffers);
+	int shm_size = shm_buffer_size(state->video_info.format, state->shm_stride, state->video_info.size.height);
 	int data_type = state->dmabuf ? (1 << SPA_DATA_DmaBuf) : (1 << SPA_DATA_MemFd);
+	// DMA-BUFs get one data per plane, SHM has them back to back in one.
+	int blocks = state->dmabuf && is_ycbcr_format(state->video_info.format) ? 2 : 1;
 
 	const struct spa_pod *buffers_param =
 		(const struct spa_pod *) spa_pod_builder_add_object(&builder,
 		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(buffers, 1, 8),
-		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(buffers, 1, k_nMaxPipewireBuffers),
+		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks),
 		SPA_PARAM_BUFFERS_size, SPA_POD_Int(shm_size),
 		SPA_PARAM_BUFFERS_stride, SPA_POD_Int(state->shm_stride),
 		SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_type));
@@ -393,17 +535,31 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
 		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_requested_size_scale),
 		SPA_PARAM_META_size, SPA_POD_Int(sizeof(float)));
-	const struct spa_pod *params[] = { buffers_param, meta_param, scale_param };
+	const struct spa_pod *damage_param =
+		(const struct spa_pod *) spa_pod_builder_add_object(&builder,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+		SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+			sizeof(struct spa_meta_region) * k_nMaxPipewireDamageRects,
+			sizeof(struct spa_meta_region),
+			sizeof(struct spa_meta_region) * k_nMaxPipewireDamageRects));
+	const struct spa_pod *latency_param =
+		(const struct spa_pod *) spa_pod_builder_add_object(&builder,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_gamescope_latency),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_gamescope_latency)));
+	const struct spa_pod *params[] = { buffers_param, meta_param, scale_param, damage_param, latency_param };
 
 	ret = pw_stream_update_params(state->stream, params, sizeof(params) / sizeof(params[0]));
 	if (ret != 0) {
 		pwr_log.errorf("pw_stream_update_params failed");
 	}
 
-	pwr_log.debugf("format changed (size: %dx%d, requested %dx%d, format %d, stride %d, size: %d, dmabuf: %d)",
+	pwr_log.debugf("format changed (size: %dx%d, requested %dx%d, format %d, stride %d, size: %d, dmabuf: %d, modifier: 0x%" PRIx64 ")",
 		state->video_info.size.width, state->video_info.size.height,
 		s_nRequestedWidth, s_nRequestedHeight,
-		state->video_info.format, state->shm_stride, shm_size, state->dmabuf);
+		state->video_info.format, state->shm_stride, shm_size, state->dmabuf,
+		state->dmabuf ? uint64_t(state->video_info.modifier) : DRM_FORMAT_MOD_INVALID);
 }
 
 static void randname(char *buf)
@@ -437,16 +593,6 @@ static int anonymous_shm_open(void)
 	return -1;
 }
 
-uint32_t spa_format_to_drm(uint32_t spa_format)
-{
-	switch (spa_format)
-	{
-		case SPA_VIDEO_FORMAT_NV12: return DRM_FORMAT_NV12;
-		default:
-		case SPA_VIDEO_FORMAT_BGR: return DRM_FORMAT_XRGB8888;
-	}
-}
-
 static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffer)
 {
 	struct pipewire_state *state = (struct pipewire_state *) user_data;
@@ -496,13 +642,25 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 
 	buffer->texture = new CVulkanTexture();
 	CVulkanTexture::createFlags screenshotImageFlags;
-	screenshotImageFlags.bMappable = true;
 	screenshotImageFlags.bTransferDst = true;
 	screenshotImageFlags.bStorage = true;
-	if (is_dmabuf || drmFormat == DRM_FORMAT_NV12)
+	if (is_dmabuf)
 	{
+		// Rendered into and handed straight to the consumer, never touched by the CPU.
 		screenshotImageFlags.bExportable = true;
-		screenshotImageFlags.bLinear = true; // TODO: support multi-planar DMA-BUF export via PipeWire
+		if (state->video_info.modifier == DRM_FORMAT_MOD_LINEAR)
+			screenshotImageFlags.bLinear = true;
+		else
+			screenshotImageFlags.exportModifier = state->video_info.modifier;
+	}
+	else
+	{
+		screenshotImageFlags.bMappable = true;
+		if (is_ycbcr_format(state->video_info.format))
+		{
+			screenshotImageFlags.bExportable = true;
+			screenshotImageFlags.bLinear = true;
+		}
 	}
 	bool bImageInitSuccess = buffer->texture->BInit( s_nCaptureWidth, s_nCaptureHeight, 1u, drmFormat, screenshotImageFlags );
 	if ( !bImageInitSuccess )
@@ -514,26 +672,29 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 
 	if (is_dmabuf) {
 		const struct wlr_dmabuf_attributes dmabuf = buffer->texture->dmabuf();
-		if (dmabuf.n_planes != 1)
+		if (uint32_t(dmabuf.n_planes) > spa_buffer->n_datas)
 		{
-			pwr_log.errorf("dmabuf.n_planes != 1");
-			goto error;
-		}
-
-		off_t size = lseek(dmabuf.fd[0], 0, SEEK_END);
-		if (size < 0) {
-			pwr_log.errorf_errno("lseek failed");
+			pwr_log.errorf("dmabuf has %d planes, but the buffer only has %u datas", dmabuf.n_planes, spa_buffer->n_datas);
 			goto error;
 		}
 
 		buffer->type = SPA_DATA_DmaBuf;
 
-		spa_data->type = SPA_DATA_DmaBuf;
-		spa_data->flags = SPA_DATA_FLAG_READABLE;
-		spa_data->fd = dmabuf.fd[0];
-		spa_data->mapoffset = dmabuf.offset[0];
-		spa_data->maxsize = size;
-		spa_data->data = nullptr;
+		for (int i = 0; i < dmabuf.n_planes; i++) {
+			off_t size = lseek(dmabuf.fd[i], 0, SEEK_END);
+			if (size < 0) {
+				pwr_log.errorf_errno("lseek failed");
+				goto error;
+			}
+
+			struct spa_data *plane_data = &spa_buffer->datas[i];
+			plane_data->type = SPA_DATA_DmaBuf;
+			plane_data->flags = SPA_DATA_FLAG_READABLE;
+			plane_data->fd = dmabuf.fd[i];
+			plane_data->mapoffset = dmabuf.offset[i];
+			plane_data->maxsize = size - dmabuf.offset[i];
+			plane_data->data = nullptr;
+		}
 	} else if (is_memfd) {
 		int fd = anonymous_shm_open();
 		if (fd < 0) {
@@ -541,10 +702,7 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 			goto error;
 		}
 
-		off_t size = state->shm_stride * state->video_info.size.height;
-		if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-			size += state->shm_stride * ((state->video_info.size.height + 1) / 2);
-		}
+		off_t size = shm_buffer_size(state->video_info.format, state->shm_stride, state->video_info.size.height);
 		if (ftruncate(fd, size) != 0) {
 			pwr_log.errorf_errno("ftruncate failed");
 			close(fd);
@@ -644,6 +802,9 @@ static void run_pipewire(struct pipewire_state *state)
 				pwr_log.errorf("pw_loop_iterate failed");
 				break;
 			}
+
+			// The consumer may have given some back.
+			refill_free_buffers(state);
 		}
 
 		if (pollfds[EVENT_NUDGE].revents & POLLIN) {
@@ -705,7 +866,7 @@ bool init_pipewire(void)
 	s_nOutputHeight = g_nOutputHeight;
 	calculate_capture_size();
 
-	uint8_t buf[4096];
+	uint8_t buf[8192];
 	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
 	std::vector<const struct spa_pod *> format_params = build_format_params(&builder);
 
@@ -746,20 +907,27 @@ bool pipewire_is_streaming()
 
 struct pipewire_buffer *dequeue_pipewire_buffer(void)
 {
-	struct pipewire_state *state = &pipewire_state;
-	if (state->streaming) {
-		request_buffer(state);
+	struct pipewire_buffer *buffer = nullptr;
+	if (!s_FreeBuffers.TryPop([&](struct pipewire_buffer *const &free) { buffer = free; })) {
+		if (pipewire_is_streaming())
+			cv_pipewire_frames_without_buffer = cv_pipewire_frames_without_buffer.Get() + 1;
+		return nullptr;
 	}
-	return out_buffer.exchange(nullptr);
+
+	// Let the PipeWire thread top the free ring back up.
+	nudge_pipewire();
+	return buffer;
 }
 
-void push_pipewire_buffer(struct pipewire_buffer *buffer)
+void push_pipewire_buffer(struct pipewire_buffer *buffer, uint64_t ulRenderSequence)
 {
-	struct pipewire_buffer *old = in_buffer.exchange(buffer);
-	if ( old != nullptr )
-	{
-		pwr_log.errorf_errno("push_pipewire_buffer: Already had a buffer?!");
-	}
+	buffer->render_sequence = ulRenderSequence;
+
+	// Can't be full, every buffer fits at once.
+	bool bPushed = s_FilledBuffers.TryPush(buffer);
+	assert(bPushed);
+	(void) bPushed;
+
 	nudge_pipewire();
 }
 
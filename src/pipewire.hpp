@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <pipewire/pipewire.h>
 #include <spa/param/video/format-utils.h>
 
@@ -22,12 +23,19 @@ struct pipewire_state {
 	bool dmabuf;
 	int shm_stride;
 	uint64_t seq;
+	int64_t last_pts;
 };
 
+// Most damage rects we put on a buffer, past that they get merged.
+static constexpr uint32_t k_nMaxPipewireDamageRects = 16;
+
 /**
  * PipeWire buffers are allocated by the PipeWire thread, and are temporarily
  * shared with the steamcompmgr thread (via dequeue_pipewire_buffer and
- * push_pipewire_buffer) for copying.
+ * push_pipewire_buffer) for rendering into.
+ *
+ * Several can be in flight at once: free ones waiting to be rendered into,
+ * and rendered ones waiting on the GPU before they get queued on the stream.
  */
 struct pipewire_buffer {
 	enum spa_data_type type; // SPA_DATA_MemFd or SPA_DATA_DmaBuf
@@ -50,9 +58,29 @@ struct pipewire_buffer {
 	{
 		return buffer == nullptr;
 	}
-	// We pass the buffer to the steamcompmgr thread for copying. This is set
-	// to true if the buffer is currently owned by the steamcompmgr thread.
+	// We pass the buffer to the steamcompmgr thread for rendering. This is set
+	// to true from when it's handed over until it's queued on the stream again.
+	// Only touched by the PipeWire thread.
 	bool copying;
+
+	// Timeline point of the render into texture, the PipeWire thread waits
+	// on it before the buffer goes out.
+	uint64_t render_sequence;
+
+	// Set by the steamcompmgr thread along with the render.
+	// What changed since the previous buffer on the stream, in texture
+	// coordinates, for SPA_META_VideoDamage. Ignored if full_damage.
+	bool full_damage;
+	std::vector<VkRect2D> damage;
+	// Capture the texture holds the contents of, 0 if they're undefined.
+	uint64_t damage_frame;
+
+	// Also set with the render, CLOCK_MONOTONIC.
+	// The vblank the capture was composited for, this is the pts.
+	uint64_t vblank_time;
+	// When the newest app commit in it landed, and when we composited it.
+	uint64_t commit_time;
+	uint64_t composite_time;
 };
 
 bool init_pipewire(void);
@@ -60,5 +88,5 @@ uint32_t get_pipewire_stream_node_id(void);
 struct pipewire_buffer *dequeue_pipewire_buffer(void);
 bool pipewire_is_streaming();
 void pipewire_destroy_buffer(struct pipewire_buffer *buffer);
-void push_pipewire_buffer(struct pipewire_buffer *buffer);
+void push_pipewire_buffer(struct pipewire_buffer *buffer, uint64_t ulRenderSequence);
 void nudge_pipewire(void);
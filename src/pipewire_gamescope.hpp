@@ -9,7 +9,20 @@ enum {
 };
 
 enum {
-    SPA_META_requested_size_scale = 0x70000
+    SPA_META_requested_size_scale = 0x70000,
+    SPA_META_gamescope_latency = 0x70001,
+};
+
+// Where the time went for a captured frame.
+// Times are CLOCK_MONOTONIC nanoseconds, like the header's pts.
+struct spa_meta_gamescope_latency
+{
+    // When we composited the capture.
+    uint64_t composite_time;
+    // From the newest app commit in the frame landing to it being composited.
+    uint64_t commit_to_composite;
+    // From compositing to the capture having finished rendering.
+    uint64_t composite_to_capture;
 };
 
 struct spa_gamescope
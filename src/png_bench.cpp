@@ -0,0 +1,145 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "png_writer.hpp"
+#include "yuv_convert.hpp"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+static constexpr uint32_t kWidth = 3840;
+static constexpr uint32_t kHeight = 2160;
+// Mapped screenshot images are usually padded.
+static constexpr size_t kSrcPitch = kWidth * 4 + 256;
+static constexpr size_t kDstPitch = kWidth * 4;
+
+// Something that compresses roughly like a game screenshot:
+// smooth gradients, flat UI panels and some noise.
+static std::vector<uint8_t> MakeScreenshotBGRA()
+{
+    std::vector<uint8_t> data( kSrcPitch * kHeight );
+
+    uint32_t uSeed = 1;
+    for ( uint32_t y = 0; y < kHeight; y++ )
+    {
+        for ( uint32_t x = 0; x < kWidth; x++ )
+        {
+            uint8_t *pPixel = &data[ y * kSrcPitch + x * 4 ];
+            uSeed = uSeed * 1103515245 + 12345;
+
+            const bool bPanel = ( x / 200 + y / 150 ) % 5 == 0;
+            pPixel[0] = bPanel ? 40 : uint8_t( x * 255 / kWidth );
+            pPixel[1] = bPanel ? 40 : uint8_t( y * 255 / kHeight );
+            pPixel[2] = bPanel ? 200 : uint8_t( x ^ y );
+            if ( !bPanel && x % 97 < 3 )
+                pPixel[1] ^= ( uSeed >> 16 ) & 0x3f;
+            pPixel[3] = 0;
+        }
+    }
+
+    return data;
+}
+
+static const std::vector<uint8_t> s_ScreenshotBGRA = MakeScreenshotBGRA();
+
+static std::vector<uint8_t> MakeScreenshotRGBA()
+{
+    std::vector<uint8_t> data( kDstPitch * kHeight );
+    gamescope::SwizzleBGRAToRGBA( s_ScreenshotBGRA.data(), kSrcPitch, data.data(), kDstPitch, kWidth, kHeight );
+    return data;
+}
+
+static const std::vector<uint8_t> s_ScreenshotRGBA = MakeScreenshotRGBA();
+
+// The old per-pixel loop from the screenshot thread.
+static void Benchmark_Swizzle_Scalar( benchmark::State &state )
+{
+    std::vector<uint8_t> imageData( kDstPitch * kHeight );
+    const uint8_t *mappedData = s_ScreenshotBGRA.data();
+
+    for ( auto _ : state )
+    {
+        const uint32_t comp = 4;
+        const uint32_t pitch = kWidth * comp;
+        for (uint32_t y = 0; y < kHeight; y++)
+        {
+            for (uint32_t x = 0; x < kWidth; x++)
+            {
+                imageData[y * pitch + x * comp + 0] = mappedData[y * kSrcPitch + x * comp + 2];
+                imageData[y * pitch + x * comp + 1] = mappedData[y * kSrcPitch + x * comp + 1];
+                imageData[y * pitch + x * comp + 2] = mappedData[y * kSrcPitch + x * comp + 0];
+                imageData[y * pitch + x * comp + 3] = 255;
+            }
+        }
+        benchmark::DoNotOptimize( imageData.data() );
+    }
+}
+BENCHMARK( Benchmark_Swizzle_Scalar )->Unit( benchmark::kMillisecond );
+
+static void Benchmark_Swizzle_Parallel( benchmark::State &state )
+{
+    std::vector<uint8_t> imageData( kDstPitch * kHeight );
+
+    for ( auto _ : state )
+    {
+        gamescope::SwizzleBGRAToRGBA( s_ScreenshotBGRA.data(), kSrcPitch, imageData.data(), kDstPitch, kWidth, kHeight );
+        benchmark::DoNotOptimize( imageData.data() );
+    }
+}
+BENCHMARK( Benchmark_Swizzle_Parallel )->Unit( benchmark::kMillisecond );
+
+static void WriteToVector( void *pContext, void *pData, int nSize )
+{
+    std::vector<uint8_t> *pOut = reinterpret_cast<std::vector<uint8_t> *>( pContext );
+    const uint8_t *pBytes = reinterpret_cast<const uint8_t *>( pData );
+    pOut->insert( pOut->end(), pBytes, pBytes + nSize );
+}
+
+static void Benchmark_EncodePNG_stb( benchmark::State &state )
+{
+    stbi_write_png_compression_level = int( state.range( 0 ) );
+
+    std::vector<uint8_t> out;
+    for ( auto _ : state )
+    {
+        out.clear();
+        stbi_write_png_to_func( WriteToVector, &out, kWidth, kHeight, 4, s_ScreenshotRGBA.data(), kDstPitch );
+        benchmark::DoNotOptimize( out.data() );
+    }
+    state.counters[ "bytes" ] = double( out.size() );
+}
+// stb's default level.
+BENCHMARK( Benchmark_EncodePNG_stb )->Arg( 8 )->Unit( benchmark::kMillisecond );
+
+static void Benchmark_EncodePNG_Parallel( benchmark::State &state )
+{
+    const int nLevel = int( state.range( 0 ) );
+
+    std::vector<uint8_t> out;
+    for ( auto _ : state )
+    {
+        gamescope::EncodePNG( &out, s_ScreenshotRGBA.data(), kDstPitch, kWidth, kHeight, nLevel );
+        benchmark::DoNotOptimize( out.data() );
+    }
+    state.counters[ "bytes" ] = double( out.size() );
+}
+BENCHMARK( Benchmark_EncodePNG_Parallel )->Arg( 1 )->Arg( 3 )->Arg( 6 )->Arg( 9 )->Unit( benchmark::kMillisecond );
+
+// NV12 screenshots, this used to be a trip through ffmpeg.
+static void Benchmark_ConvertNV12( benchmark::State &state )
+{
+    std::vector<uint8_t> luma( size_t( kWidth ) * kHeight, 0x80 );
+    std::vector<uint8_t> chroma( size_t( kWidth ) * kHeight / 2, 0x70 );
+    std::vector<uint8_t> imageData( kDstPitch * kHeight );
+
+    for ( auto _ : state )
+    {
+        gamescope::ConvertNV12ToRGBA( luma.data(), kWidth, chroma.data(), kWidth, imageData.data(), kDstPitch, kWidth, kHeight, gamescope::YCBCR_MATRIX_BT709, false );
+        benchmark::DoNotOptimize( imageData.data() );
+    }
+}
+BENCHMARK( Benchmark_ConvertNV12 )->Unit( benchmark::kMillisecond );
+
+BENCHMARK_MAIN();
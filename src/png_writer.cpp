@@ -0,0 +1,394 @@
+#include "png_writer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Utils/WorkerPool.h"
+
+namespace gamescope
+{
+    // Small enough to spread a 1080p frame over a handful of threads,
+    // big enough that each job isn't dominated by dispatch.
+    static constexpr uint32_t kRowsPerJob = 64;
+    // Minimum rows per deflate strip, smaller strips cost compression ratio.
+    static constexpr uint32_t kMinRowsPerStrip = 64;
+    // Deflate's window size, the most dictionary a strip can use.
+    static constexpr size_t kDeflateWindowSize = 32768;
+
+    static inline uint32_t SwizzlePixel( uint32_t uPixel )
+    {
+        // 0xAARRGGBB -> 0xFFBBGGRR
+        return 0xff000000u | ( uPixel & 0x0000ff00u ) | ( ( uPixel & 0x00ff0000u ) >> 16 ) | ( ( uPixel & 0x000000ffu ) << 16 );
+    }
+
+    static void SwizzleRow( const uint8_t *pSrc, uint8_t *pDst, uint32_t uWidth )
+    {
+        uint32_t x = 0;
+#ifdef __SSE2__
+        const __m128i vGreen = _mm_set1_epi32( 0x0000ff00 );
+        const __m128i vRedBlue = _mm_set1_epi32( 0x00ff00ff );
+        const __m128i vAlpha = _mm_set1_epi32( int( 0xff000000u ) );
+        for ( ; x + 4 <= uWidth; x += 4 )
+        {
+            __m128i vPixels = _mm_loadu_si128( reinterpret_cast<const __m128i *>( pSrc + x * 4 ) );
+            __m128i vRB = _mm_and_si128( vPixels, vRedBlue );
+            __m128i vSwapped = _mm_or_si128( _mm_slli_epi32( vRB, 16 ), _mm_srli_epi32( vRB, 16 ) );
+            __m128i vOut = _mm_or_si128( _mm_or_si128( vSwapped, _mm_and_si128( vPixels, vGreen ) ), vAlpha );
+            _mm_storeu_si128( reinterpret_cast<__m128i *>( pDst + x * 4 ), vOut );
+        }
+#endif
+        for ( ; x < uWidth; x++ )
+        {
+            uint32_t uPixel;
+            memcpy( &uPixel, pSrc + x * 4, sizeof( uPixel ) );
+            uPixel = SwizzlePixel( uPixel );
+            memcpy( pDst + x * 4, &uPixel, sizeof( uPixel ) );
+        }
+    }
+
+    void SwizzleBGRAToRGBA( const uint8_t *pSrc, size_t uSrcPitch, uint8_t *pDst, size_t uDstPitch, uint32_t uWidth, uint32_t uHeight )
+    {
+        const uint32_t uJobCount = ( uHeight + kRowsPerJob - 1 ) / kRowsPerJob;
+        CWorkerPool::GetBackground().ParallelFor( uJobCount, [&]( uint32_t uJob )
+        {
+            const uint32_t uStartRow = uJob * kRowsPerJob;
+            const uint32_t uEndRow = std::min( uStartRow + kRowsPerJob, uHeight );
+            for ( uint32_t y = uStartRow; y < uEndRow; y++ )
+                SwizzleRow( pSrc + y * uSrcPitch, pDst + y * uDstPitch, uWidth );
+        });
+    }
+
+    ////////////////
+    // PNG encoding
+    ////////////////
+
+    enum PNGFilter : uint8_t
+    {
+        PNG_FILTER_NONE = 0,
+        PNG_FILTER_SUB = 1,
+        PNG_FILTER_UP = 2,
+        PNG_FILTER_AVERAGE = 3,
+        PNG_FILTER_PAETH = 4,
+    };
+
+    static inline uint8_t Paeth( uint8_t a, uint8_t b, uint8_t c )
+    {
+        // Branchless so the loop below vectorizes.
+        const int16_t p = int16_t( a ) + int16_t( b ) - int16_t( c );
+        const int16_t pa = int16_t( std::abs( p - int16_t( a ) ) );
+        const int16_t pb = int16_t( std::abs( p - int16_t( b ) ) );
+        const int16_t pc = int16_t( std::abs( p - int16_t( c ) ) );
+        const uint8_t bc = pb <= pc ? b : c;
+        return ( pa <= pb && pa <= pc ) ? a : bc;
+    }
+
+    // Filters a row and returns the sum of the filtered bytes as signed values,
+    // the usual "minimum sum of absolute differences" heuristic libpng and stb use.
+    //
+    // The first pixel has no left neighbour and is handled on its own,
+    // which keeps the main loops free of branches for the autovectorizer.
+    // pPrevRow is all zeroes for the first row.
+    static uint32_t FilterRow( PNGFilter eFilter, const uint8_t *__restrict pRow, const uint8_t *__restrict pPrevRow, uint8_t *__restrict pOut, size_t uRowSize )
+    {
+        constexpr size_t kBpp = 4;
+        switch ( eFilter )
+        {
+            case PNG_FILTER_NONE:
+                memcpy( pOut, pRow, uRowSize );
+                break;
+            case PNG_FILTER_SUB:
+                for ( size_t i = 0; i < kBpp; i++ )
+                    pOut[i] = pRow[i];
+                for ( size_t i = kBpp; i < uRowSize; i++ )
+                    pOut[i] = pRow[i] - pRow[i - kBpp];
+                break;
+            case PNG_FILTER_UP:
+                for ( size_t i = 0; i < uRowSize; i++ )
+                    pOut[i] = pRow[i] - pPrevRow[i];
+                break;
+            case PNG_FILTER_AVERAGE:
+                for ( size_t i = 0; i < kBpp; i++ )
+                    pOut[i] = pRow[i] - ( pPrevRow[i] >> 1 );
+                for ( size_t i = kBpp; i < uRowSize; i++ )
+                    pOut[i] = pRow[i] - uint8_t( ( uint16_t( pRow[i - kBpp] ) + uint16_t( pPrevRow[i] ) ) >> 1 );
+                break;
+            case PNG_FILTER_PAETH:
+                // With no left or up-left neighbour, Paeth picks up.
+                for ( size_t i = 0; i < kBpp; i++ )
+                    pOut[i] = pRow[i] - pPrevRow[i];
+                for ( size_t i = kBpp; i < uRowSize; i++ )
+                    pOut[i] = pRow[i] - Paeth( pRow[i - kBpp], pPrevRow[i], pPrevRow[i - kBpp] );
+                break;
+        }
+
+        uint32_t uCost = 0;
+        for ( size_t i = 0; i < uRowSize; i++ )
+            uCost += uint32_t( std::abs( int32_t( int8_t( pOut[i] ) ) ) );
+        return uCost;
+    }
+
+    // Picks the cheapest-looking filter for the row and writes
+    // the filter byte followed by the filtered row to pOut.
+    static void FilterRowAdaptive( const uint8_t *pRow, const uint8_t *pPrevRow, uint8_t *pOut, uint8_t *pScratch, size_t uRowSize )
+    {
+        static constexpr PNGFilter kFilters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVERAGE, PNG_FILTER_PAETH };
+
+        // Ping-pong between the output and the scratch row so
+        // the best candidate never needs copying until the end.
+        uint8_t *pBest = pOut + 1;
+        uint8_t *pCandidate = pScratch;
+
+        PNGFilter eBestFilter = PNG_FILTER_NONE;
+        uint32_t uBestCost = UINT32_MAX;
+        for ( PNGFilter eFilter : kFilters )
+        {
+            uint32_t uCost = FilterRow( eFilter, pRow, pPrevRow, pCandidate, uRowSize );
+            if ( uCost < uBestCost )
+            {
+                uBestCost = uCost;
+                eBestFilter = eFilter;
+                std::swap( pBest, pCandidate );
+            }
+        }
+
+        if ( pBest != pOut + 1 )
+            memcpy( pOut + 1, pBest, uRowSize );
+        pOut[0] = eBestFilter;
+    }
+
+    static void WriteU32BE( uint8_t *pOut, uint32_t uValue )
+    {
+        pOut[0] = uint8_t( uValue >> 24 );
+        pOut[1] = uint8_t( uValue >> 16 );
+        pOut[2] = uint8_t( uValue >> 8 );
+        pOut[3] = uint8_t( uValue );
+    }
+
+    static void AppendChunk( std::vector<uint8_t> *pOut, const char *pszType, const uint8_t *pData, uint32_t uSize )
+    {
+        const size_t uOffset = pOut->size();
+        pOut->resize( uOffset + 12 + uSize );
+
+        uint8_t *pChunk = pOut->data() + uOffset;
+        WriteU32BE( pChunk, uSize );
+        memcpy( pChunk + 4, pszType, 4 );
+        if ( uSize )
+            memcpy( pChunk + 8, pData, uSize );
+        WriteU32BE( pChunk + 8 + uSize, uint32_t( crc32( 0, pChunk + 4, 4 + uSize ) ) );
+    }
+
+    struct PNGStrip_t
+    {
+        uint32_t uStartRow = 0;
+        uint32_t uEndRow = 0;
+        uLong ulAdler = 0;
+        size_t uUncompressedSize = 0;
+        // A complete IDAT chunk.
+        std::vector<uint8_t> chunk;
+        bool bSuccess = false;
+    };
+
+    static bool EncodePNGChunks( const uint8_t *pRGBA, size_t uPitch, uint32_t uWidth, uint32_t uHeight, int nCompressionLevel, std::vector<uint8_t> *pHeader, std::vector<PNGStrip_t> *pStrips, std::vector<uint8_t> *pFooter )
+    {
+        if ( !uWidth || !uHeight )
+            return false;
+
+        nCompressionLevel = std::clamp( nCompressionLevel, -1, 9 );
+
+        CWorkerPool &pool = CWorkerPool::GetBackground();
+
+        const size_t uRowSize = size_t( uWidth ) * 4;
+        const size_t uFilteredRowSize = uRowSize + 1;
+        std::vector<uint8_t> filtered( uFilteredRowSize * uHeight );
+
+        // Filter everything up front, the strips need to see the
+        // tail of the previous strip's filtered data as their dictionary.
+        {
+            const uint32_t uJobCount = ( uHeight + kRowsPerJob - 1 ) / kRowsPerJob;
+            const std::vector<uint8_t> zeroRow( uRowSize );
+            pool.ParallelFor( uJobCount, [&]( uint32_t uJob )
+            {
+                std::vector<uint8_t> scratch( uRowSize );
+
+                const uint32_t uStartRow = uJob * kRowsPerJob;
+                const uint32_t uEndRow = std::min( uStartRow + kRowsPerJob, uHeight );
+                for ( uint32_t y = uStartRow; y < uEndRow; y++ )
+                {
+                    const uint8_t *pRow = pRGBA + y * uPitch;
+                    const uint8_t *pPrevRow = y ? pRGBA + ( y - 1 ) * uPitch : zeroRow.data();
+                    FilterRowAdaptive( pRow, pPrevRow, &filtered[ y * uFilteredRowSize ], scratch.data(), uRowSize );
+                }
+            });
+        }
+
+        const uint32_t uMaxStrips = std::max<uint32_t>( 1, pool.GetThreadCount() + 1 );
+        const uint32_t uStripCount = std::clamp<uint32_t>( uHeight / kMinRowsPerStrip, 1, uMaxStrips );
+        const uint32_t uRowsPerStrip = ( uHeight + uStripCount - 1 ) / uStripCount;
+
+        pStrips->clear();
+        for ( uint32_t uStartRow = 0; uStartRow < uHeight; uStartRow += uRowsPerStrip )
+        {
+            PNGStrip_t &strip = pStrips->emplace_back();
+            strip.uStartRow = uStartRow;
+            strip.uEndRow = std::min( uStartRow + uRowsPerStrip, uHeight );
+        }
+
+        pool.ParallelFor( uint32_t( pStrips->size() ), [&]( uint32_t uStrip )
+        {
+            PNGStrip_t &strip = ( *pStrips )[ uStrip ];
+            const bool bFirst = uStrip == 0;
+            const bool bLast = uStrip == pStrips->size() - 1;
+
+            const size_t uOffset = strip.uStartRow * uFilteredRowSize;
+            const uint8_t *pData = &filtered[ uOffset ];
+            strip.uUncompressedSize = ( strip.uEndRow - strip.uStartRow ) * uFilteredRowSize;
+            strip.ulAdler = adler32( adler32( 0, nullptr, 0 ), pData, uInt( strip.uUncompressedSize ) );
+
+            z_stream stream{};
+            // Raw deflate, we write the zlib header and trailer ourselves.
+            if ( deflateInit2( &stream, nCompressionLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+                return;
+
+            if ( !bFirst )
+            {
+                const size_t uDictSize = std::min( uOffset, kDeflateWindowSize );
+                deflateSetDictionary( &stream, pData - uDictSize, uInt( uDictSize ) );
+            }
+
+            // Chunk length + type, zlib header on the first strip, the deflate data,
+            // room for the sync flush marker, adler32 on the last strip and the chunk crc.
+            const size_t uHeaderSize = 8 + ( bFirst ? 2 : 0 );
+            const size_t uBound = deflateBound( &stream, uLong( strip.uUncompressedSize ) ) + 16;
+            strip.chunk.resize( uHeaderSize + uBound + 4 + 4 );
+
+            uint8_t *pChunk = strip.chunk.data();
+            memcpy( pChunk + 4, "IDAT", 4 );
+            if ( bFirst )
+            {
+                const uint8_t uFlevel = nCompressionLevel == -1 ? 2
+                    : nCompressionLevel < 2 ? 0
+                    : nCompressionLevel < 6 ? 1
+                    : nCompressionLevel == 6 ? 2 : 3;
+                const uint8_t uCMF = 0x78;
+                uint8_t uFLG = uint8_t( uFlevel << 6 );
+                uFLG |= uint8_t( 31 - ( ( uCMF * 256 + uFLG ) % 31 ) );
+                pChunk[8] = uCMF;
+                pChunk[9] = uFLG;
+            }
+
+            stream.next_in = const_cast<Bytef *>( pData );
+            stream.avail_in = uInt( strip.uUncompressedSize );
+            stream.next_out = pChunk + uHeaderSize;
+            stream.avail_out = uInt( uBound );
+
+            // Every strip but the last ends on a byte boundary without
+            // setting BFINAL, so the next one can follow on directly.
+            int nRet = deflate( &stream, bLast ? Z_FINISH : Z_SYNC_FLUSH );
+            const size_t uCompressedSize = uBound - stream.avail_out;
+            deflateEnd( &stream );
+
+            if ( bLast ? nRet != Z_STREAM_END : ( nRet != Z_OK || stream.avail_in != 0 ) )
+                return;
+
+            size_t uDataSize = uHeaderSize - 8 + uCompressedSize;
+            // The adler32 of the whole image is patched in later
+            // once all the strips are done, just reserve it here.
+            if ( bLast )
+                uDataSize += 4;
+
+            strip.chunk.resize( 8 + uDataSize + 4 );
+            WriteU32BE( pChunk, uint32_t( uDataSize ) );
+            strip.bSuccess = true;
+        });
+
+        for ( const PNGStrip_t &strip : *pStrips )
+        {
+            if ( !strip.bSuccess )
+                return false;
+        }
+
+        uLong ulAdler = pStrips->front().ulAdler;
+        for ( size_t i = 1; i < pStrips->size(); i++ )
+            ulAdler = adler32_combine( ulAdler, ( *pStrips )[i].ulAdler, z_off_t( ( *pStrips )[i].uUncompressedSize ) );
+
+        PNGStrip_t &lastStrip = pStrips->back();
+        uint8_t *pLastChunk = lastStrip.chunk.data();
+        const size_t uLastDataSize = lastStrip.chunk.size() - 12;
+        WriteU32BE( pLastChunk + 8 + uLastDataSize - 4, uint32_t( ulAdler ) );
+
+        pool.ParallelFor( uint32_t( pStrips->size() ), [&]( uint32_t uStrip )
+        {
+            std::vector<uint8_t> &chunk = ( *pStrips )[ uStrip ].chunk;
+            const size_t uDataSize = chunk.size() - 12;
+            WriteU32BE( chunk.data() + 8 + uDataSize, uint32_t( crc32( 0, chunk.data() + 4, uInt( 4 + uDataSize ) ) ) );
+        });
+
+        static constexpr uint8_t kPNGSignature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        pHeader->assign( std::begin( kPNGSignature ), std::end( kPNGSignature ) );
+
+        uint8_t IHDR[13];
+        WriteU32BE( &IHDR[0], uWidth );
+        WriteU32BE( &IHDR[4], uHeight );
+        IHDR[8] = 8;  // Bit depth
+        IHDR[9] = 6;  // Color type: RGBA
+        IHDR[10] = 0; // Compression: deflate
+        IHDR[11] = 0; // Filter method: adaptive
+        IHDR[12] = 0; // Interlace: none
+        AppendChunk( pHeader, "IHDR", IHDR, sizeof( IHDR ) );
+
+        pFooter->clear();
+        AppendChunk( pFooter, "IEND", nullptr, 0 );
+
+        return true;
+    }
+
+    bool EncodePNG( std::vector<uint8_t> *pOutData, const uint8_t *pRGBA, size_t uPitch, uint32_t uWidth, uint32_t uHeight, int nCompressionLevel )
+    {
+        std::vector<uint8_t> header;
+        std::vector<PNGStrip_t> strips;
+        std::vector<uint8_t> footer;
+        if ( !EncodePNGChunks( pRGBA, uPitch, uWidth, uHeight, nCompressionLevel, &header, &strips, &footer ) )
+            return false;
+
+        size_t uTotalSize = header.size() + footer.size();
+        for ( const PNGStrip_t &strip : strips )
+            uTotalSize += strip.chunk.size();
+
+        pOutData->clear();
+        pOutData->reserve( uTotalSize );
+        pOutData->insert( pOutData->end(), header.begin(), header.end() );
+        for ( const PNGStrip_t &strip : strips )
+            pOutData->insert( pOutData->end(), strip.chunk.begin(), strip.chunk.end() );
+        pOutData->insert( pOutData->end(), footer.begin(), footer.end() );
+        return true;
+    }
+
+    bool WritePNG( const char *pszPath, const uint8_t *pRGBA, size_t uPitch, uint32_t uWidth, uint32_t uHeight, int nCompressionLevel )
+    {
+        std::vector<uint8_t> header;
+        std::vector<PNGStrip_t> strips;
+        std::vector<uint8_t> footer;
+        if ( !EncodePNGChunks( pRGBA, uPitch, uWidth, uHeight, nCompressionLevel, &header, &strips, &footer ) )
+            return false;
+
+        FILE *pFile = fopen( pszPath, "wb" );
+        if ( !pFile )
+            return false;
+
+        bool bSuccess = fwrite( header.data(), 1, header.size(), pFile ) == header.size();
+        for ( const PNGStrip_t &strip : strips )
+            bSuccess = bSuccess && fwrite( strip.chunk.data(), 1, strip.chunk.size(), pFile ) == strip.chunk.size();
+        bSuccess = bSuccess && fwrite( footer.data(), 1, footer.size(), pFile ) == footer.size();
+
+        bSuccess = fclose( pFile ) == 0 && bSuccess;
+        return bSuccess;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gamescope
+{
+    // BGRA/BGRX -> RGBA with alpha forced to opaque.
+    // Rows are split across the shared worker pool, SSE2 where available.
+    void SwizzleBGRAToRGBA( const uint8_t *pSrc, size_t uSrcPitch, uint8_t *pDst, size_t uDstPitch, uint32_t uWidth, uint32_t uHeight );
+
+    // 8-bit RGBA PNG encoder.
+    //
+    // Rows are filtered and deflated in independent strips on the shared
+    // worker pool (each strip primed with the tail of the previous one as
+    // its dictionary), then stitched into a single zlib stream.
+    //
+    // nCompressionLevel is a zlib level, 0-9 (-1 for zlib's default).
+    bool EncodePNG( std::vector<uint8_t> *pOutData, const uint8_t *pRGBA, size_t uPitch, uint32_t uWidth, uint32_t uHeight, int nCompressionLevel );
+    bool WritePNG( const char *pszPath, const uint8_t *pRGBA, size_t uPitch, uint32_t uWidth, uint32_t uHeight, int nCompressionLevel );
+}
@@ -1,6 +1,7 @@
 // Initialize Vulkan and composite stuff with a compute queue
 
 #include <cassert>
+#include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -10,6 +11,7 @@
 #include <array>
 #include <bitset>
 #include <thread>
+#include <vector>
 #include <dlfcn.h>
 #include "vulkan_include.h"
 #include "Utils/Algorithm.h"
@@ -39,6 +41,7 @@
 #include "Utils/Process.h"
 
 #include "cs_composite_blit.h"
+#include "cs_composite_blit_nv12.h"
 #include "cs_composite_blur.h"
 #include "cs_composite_blur_cond.h"
 #include "cs_composite_rcas.h"
@@ -200,6 +203,8 @@ struct {
 	{ DRM_FORMAT_XBGR8888, VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R8G8B8A8_SRGB, 4, false, false },
 	{ DRM_FORMAT_RGB565, VK_FORMAT_R5G6B5_UNORM_PACK16, VK_FORMAT_R5G6B5_UNORM_PACK16, 1, false, false },
 	{ DRM_FORMAT_NV12, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, 0, false, false },
+	// Only produced by capture, we don't sample it.
+	{ DRM_FORMAT_P010, VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16, VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16, 0, false, true },
 	{ DRM_FORMAT_ABGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT, 8, true, false },
 	{ DRM_FORMAT_XBGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT, 8, false, false },
 	{ DRM_FORMAT_ABGR16161616, VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_UNORM, 8, true, false },
@@ -298,7 +303,7 @@ bool CVulkanDevice::BInit(VkInstance instance, VkSurfaceKHR surface)
 
 	m_bInitialized = true;
 
-	std::thread piplelineThread([this](){compileAllPipelines();});
+	std::thread piplelineThread([this](){pipelineCompileThread();});
 	piplelineThread.detach();
 
 	g_reshadeManager.init(this);
@@ -904,8 +909,22 @@ bool CVulkanDevice::createShaders()
 		SHADER(NIS, cs_nis);
 	}
 	SHADER(RGB_TO_NV12, cs_rgb_to_nv12);
+	SHADER(BLIT_NV12, cs_composite_blit_nv12);
 #undef SHADER
 
+	// FNV-1a over all of the SPIR-V we are going to use, so the on-disk
+	// pipeline cache gets thrown away whenever the shaders change.
+	uint32_t shaderHash = 2166136261u;
+	for (uint32_t i = 0; i < shaderInfos.size(); i++)
+	{
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(shaderInfos[i].spirv);
+		for (uint32_t j = 0; j < shaderInfos[i].size; j++)
+		{
+			shaderHash ^= bytes[j];
+			shaderHash *= 16777619u;
+		}
+	}
+
 	for (uint32_t i = 0; i < shaderInfos.size(); i++)
 	{
 		VkShaderModuleCreateInfo shaderCreateInfo = {
@@ -922,9 +941,187 @@ bool CVulkanDevice::createShaders()
 		}
 	}
 
+	createPipelineCache(shaderHash);
+
 	return true;
 }
 
+static constexpr uint32_t k_pipelineCacheMagic = 0x43505347; // 'GSPC'
+static constexpr uint32_t k_pipelineCacheVersion = 1;
+
+struct PipelineCacheFileHeader_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint32_t shaderHash;
+	uint32_t dataSize;
+};
+
+std::string_view GetHomeDir();
+
+static std::string GetPipelineCacheDir()
+{
+	const char *pszCacheHome = getenv( "XDG_CACHE_HOME" );
+	if ( pszCacheHome && *pszCacheHome )
+		return std::string{ pszCacheHome } + "/gamescope";
+
+	return std::string{ GetHomeDir() } + "/.cache/gamescope";
+}
+
+static bool MakeDirs( const std::string &path )
+{
+	for ( size_t pos = path.find( '/', 1 ); ; pos = path.find( '/', pos + 1 ) )
+	{
+		std::string subPath = path.substr( 0, pos );
+		if ( mkdir( subPath.c_str(), 0755 ) != 0 && errno != EEXIST )
+			return false;
+		if ( pos == std::string::npos )
+			return true;
+	}
+}
+
+static PipelineCacheFileHeader_t MakePipelineCacheHeader( const VkPhysicalDeviceProperties &props, uint32_t shaderHash, uint32_t dataSize )
+{
+	PipelineCacheFileHeader_t header = {
+		.magic = k_pipelineCacheMagic,
+		.version = k_pipelineCacheVersion,
+		.vendorID = props.vendorID,
+		.deviceID = props.deviceID,
+		.driverVersion = props.driverVersion,
+		.shaderHash = shaderHash,
+		.dataSize = dataSize,
+	};
+	memcpy( header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE );
+	return header;
+}
+
+void CVulkanDevice::createPipelineCache(uint32_t shaderHash)
+{
+	VkPhysicalDeviceProperties props;
+	vk.GetPhysicalDeviceProperties( physDev(), &props );
+
+	char fileName[64];
+	snprintf( fileName, sizeof( fileName ), "/pipelines_%04x_%04x.bin", props.vendorID, props.deviceID );
+	m_pipelineCachePath = GetPipelineCacheDir() + fileName;
+	m_pipelineCacheShaderHash = shaderHash;
+
+	// The driver validates its own blob header too, but check ours first
+	// so a driver or shader update just starts from an empty cache.
+	std::vector<uint8_t> initialData;
+	FILE *file = fopen( m_pipelineCachePath.c_str(), "rb" );
+	if ( file )
+	{
+		PipelineCacheFileHeader_t expected = MakePipelineCacheHeader( props, shaderHash, 0 );
+		PipelineCacheFileHeader_t header;
+		struct stat fileStat;
+		if ( fstat( fileno( file ), &fileStat ) == 0 && fileStat.st_size >= off_t( sizeof( header ) ) &&
+			fread( &header, sizeof( header ), 1, file ) == 1 )
+		{
+			expected.dataSize = header.dataSize;
+			if ( memcmp( &header, &expected, sizeof( header ) ) != 0 )
+			{
+				vk_log.infof( "pipeline cache %s is stale, ignoring it", m_pipelineCachePath.c_str() );
+			}
+			else if ( header.dataSize > uint64_t( fileStat.st_size ) - sizeof( header ) )
+			{
+				// Don't trust a truncated or corrupt file to size our allocation.
+				vk_log.infof( "pipeline cache %s is truncated, ignoring it", m_pipelineCachePath.c_str() );
+			}
+			else
+			{
+				initialData.resize( header.dataSize );
+				if ( fread( initialData.data(), 1, initialData.size(), file ) != initialData.size() )
+					initialData.clear();
+			}
+		}
+		fclose( file );
+	}
+
+	VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = initialData.size(),
+		.pInitialData = initialData.empty() ? nullptr : initialData.data(),
+	};
+
+	VkResult res = vk.CreatePipelineCache( device(), &pipelineCacheCreateInfo, nullptr, &m_pipelineCache );
+	if ( res != VK_SUCCESS && !initialData.empty() )
+	{
+		// Bad blob, try again without it.
+		pipelineCacheCreateInfo.initialDataSize = 0;
+		pipelineCacheCreateInfo.pInitialData = nullptr;
+		res = vk.CreatePipelineCache( device(), &pipelineCacheCreateInfo, nullptr, &m_pipelineCache );
+		initialData.clear();
+	}
+
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreatePipelineCache failed" );
+		m_pipelineCache = VK_NULL_HANDLE;
+		return;
+	}
+
+	vk_log.infof( "loaded %zu bytes of pipeline cache from %s", initialData.size(), m_pipelineCachePath.c_str() );
+}
+
+void CVulkanDevice::savePipelineCache()
+{
+	if ( m_pipelineCache == VK_NULL_HANDLE )
+		return;
+
+	std::lock_guard<std::mutex> lock( m_pipelineCacheSaveMutex );
+
+	size_t dataSize = 0;
+	VkResult res = vk.GetPipelineCacheData( device(), m_pipelineCache, &dataSize, nullptr );
+	if ( res != VK_SUCCESS || dataSize == 0 )
+		return;
+
+	std::vector<uint8_t> data( dataSize );
+	res = vk.GetPipelineCacheData( device(), m_pipelineCache, &dataSize, data.data() );
+	if ( res != VK_SUCCESS && res != VK_INCOMPLETE )
+	{
+		vk_errorf( res, "vkGetPipelineCacheData failed" );
+		return;
+	}
+
+	std::string dir = GetPipelineCacheDir();
+	if ( !MakeDirs( dir ) )
+	{
+		vk_log.errorf_errno( "failed to create pipeline cache directory %s", dir.c_str() );
+		return;
+	}
+
+	VkPhysicalDeviceProperties props;
+	vk.GetPhysicalDeviceProperties( physDev(), &props );
+	PipelineCacheFileHeader_t header = MakePipelineCacheHeader( props, m_pipelineCacheShaderHash, uint32_t( dataSize ) );
+
+	// Write to a temporary file and rename it over so that a crash
+	// mid-write never leaves a truncated cache behind.
+	std::string tmpPath = m_pipelineCachePath + ".tmp";
+	FILE *file = fopen( tmpPath.c_str(), "wb" );
+	if ( !file )
+	{
+		vk_log.errorf_errno( "failed to open %s", tmpPath.c_str() );
+		return;
+	}
+
+	bool bWritten = fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+		fwrite( data.data(), 1, dataSize, file ) == dataSize;
+	bWritten = fclose( file ) == 0 && bWritten;
+
+	if ( !bWritten || rename( tmpPath.c_str(), m_pipelineCachePath.c_str() ) != 0 )
+	{
+		vk_log.errorf_errno( "failed to write pipeline cache %s", m_pipelineCachePath.c_str() );
+		unlink( tmpPath.c_str() );
+		return;
+	}
+
+	vk_log.debugf( "saved %zu bytes of pipeline cache to %s", dataSize, m_pipelineCachePath.c_str() );
+}
+
 bool CVulkanDevice::createScratchResources()
 {
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts(m_descriptorSets.size(), m_descriptorSetLayout);
@@ -1111,7 +1308,7 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 
 	VkPipeline result;
 
-	VkResult res = vk.CreateComputePipelines(device(), VK_NULL_HANDLE, 1, &computePipelineCreateInfo, nullptr, &result);
+	VkResult res = vk.CreateComputePipelines(device(), m_pipelineCache, 1, &computePipelineCreateInfo, nullptr, &result);
 	if (res != VK_SUCCESS) {
 		vk_errorf( res, "vkCreateComputePipelines failed" );
 		return VK_NULL_HANDLE;
@@ -1120,10 +1317,24 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 	return result;
 }
 
-void CVulkanDevice::compileAllPipelines()
+static bool shader_type_uses_blur_layers(ShaderType type)
 {
-	pthread_setname_np( pthread_self(), "gamescope-shdr" );
+	return type == SHADER_TYPE_BLUR || type == SHADER_TYPE_BLUR_COND;
+}
+
+// What we draw with while the exact permutation is still compiling:
+// same layout, every layer sRGB and a Gamma 2.2 output.
+static PipelineInfo_t generic_pipeline_key(ShaderType type, uint32_t layerCount, uint32_t ycbcrMask, uint32_t blur_layers, uint32_t composite_debug)
+{
+	uint32_t colorspace_mask = 0;
+	for (uint32_t i = 0; i < layerCount; i++)
+		colorspace_mask |= GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB << (i * GamescopeAppTextureColorspace_Bits);
+
+	return PipelineInfo_t{type, layerCount, ycbcrMask, blur_layers, composite_debug, colorspace_mask, EOTF_Gamma22, false};
+}
 
+void CVulkanDevice::compileAllPipelines()
+{
 	std::array<PipelineInfo_t, SHADER_TYPE_COUNT> pipelineInfos;
 #define SHADER(type, layer_count, max_ycbcr, blur_layers) pipelineInfos[SHADER_TYPE_##type] = {SHADER_TYPE_##type, layer_count, max_ycbcr, blur_layers}
 	SHADER(BLIT, k_nMaxLayers, k_nMaxYcbcrMask_ToPreCompile, 1);
@@ -1134,6 +1345,8 @@ void CVulkanDevice::compileAllPipelines()
 	SHADER(EASU, 1, 1, 1);
 	SHADER(NIS, 1, 1, 1);
 	SHADER(RGB_TO_NV12, 1, 1, 1);
+	// Focus and override, PipeWire captures don't have more.
+	SHADER(BLIT_NV12, 2, 1, 1);
 #undef SHADER
 
 	for (auto& info : pipelineInfos) {
@@ -1145,41 +1358,219 @@ void CVulkanDevice::compileAllPipelines()
 					if (blur_layers > layerCount)
 						continue;
 
-					VkPipeline newPipeline = compilePipeline(layerCount, ycbcrMask, info.shaderType, blur_layers, info.compositeDebug, info.colorspaceMask, info.outputEOTF, info.itmEnable);
-					{
-						std::lock_guard<std::mutex> lock(m_pipelineMutex);
-						PipelineInfo_t key = {info.shaderType, layerCount, ycbcrMask, blur_layers, info.compositeDebug};
-						auto result = m_pipelineMap.emplace(std::make_pair(key, newPipeline));
-						if (!result.second)
-							vk.DestroyPipeline(device(), newPipeline, nullptr);
-					}
+					PipelineInfo_t key = {info.shaderType, layerCount, ycbcrMask, blur_layers, info.compositeDebug};
+					queuePipelineCompile(key, PIPELINE_COMPILE_PRIORITY_PRECOMPILE);
+
+					uint32_t generic_blur_layers = shader_type_uses_blur_layers(info.shaderType) ? blur_layers : 0;
+					queuePipelineCompile(generic_pipeline_key(info.shaderType, layerCount, ycbcrMask, generic_blur_layers, info.compositeDebug), PIPELINE_COMPILE_PRIORITY_PRECOMPILE);
 				}
 			}
 		}
 	}
 }
 
+void CVulkanDevice::queuePipelineCompile(const PipelineInfo_t &key, PipelineCompilePriority priority)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_pipelineCompileMutex);
+		auto queued = m_pipelinesQueued.find(key);
+		if (queued != m_pipelinesQueued.end())
+		{
+			if (queued->second >= priority)
+				return;
+			// Push it again with the higher priority, the stale entry
+			// is skipped once the pipeline exists.
+			queued->second = priority;
+		}
+		else
+		{
+			m_pipelinesQueued.emplace(key, priority);
+		}
+		m_pipelineCompileQueue.push(PipelineCompileJob_t{ key, priority, m_pipelineCompileOrder++ });
+	}
+	m_pipelineCompileCV.notify_one();
+}
+
+void CVulkanDevice::pipelineCompileThread()
+{
+	pthread_setname_np( pthread_self(), "gamescope-shdr" );
+
+	compileAllPipelines();
+
+	bool bCacheDirty = false;
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(m_pipelineCompileMutex);
+		if (m_pipelineCompileQueue.empty() && bCacheDirty)
+		{
+			// Flush whatever we compiled whenever we go idle.
+			lock.unlock();
+			savePipelineCache();
+			bCacheDirty = false;
+			continue;
+		}
+
+		m_pipelineCompileCV.wait(lock, [this](){ return !m_pipelineCompileQueue.empty(); });
+		PipelineCompileJob_t job = m_pipelineCompileQueue.top();
+		m_pipelineCompileQueue.pop();
+		lock.unlock();
+
+		if (m_pipelineMap.Contains(job.key))
+		{
+			// Compiled inline by the render path, or a stale lower priority entry.
+			std::lock_guard<std::mutex> compileLock(m_pipelineCompileMutex);
+			m_pipelinesQueued.erase(job.key);
+			continue;
+		}
+
+		const PipelineInfo_t &key = job.key;
+		VkPipeline newPipeline = compilePipeline(key.layerCount, key.ycbcrMask, key.shaderType, key.blurLayerCount, key.compositeDebug, key.colorspaceMask, key.outputEOTF, key.itmEnable);
+		{
+			std::lock_guard<std::mutex> pipelineLock(m_pipelineMutex);
+			if (!m_pipelineMap.Insert(key, newPipeline))
+				vk.DestroyPipeline(device(), newPipeline, nullptr);
+		}
+
+		// It may have been requested by the render path while we were compiling it.
+		PipelineCompilePriority priority = job.priority;
+		{
+			std::lock_guard<std::mutex> compileLock(m_pipelineCompileMutex);
+			auto queued = m_pipelinesQueued.find(key);
+			if (queued != m_pipelinesQueued.end())
+			{
+				priority = std::max(priority, queued->second);
+				m_pipelinesQueued.erase(queued);
+			}
+		}
+
+		bCacheDirty = true;
+
+		// Something was drawn with a fallback pipeline, redraw it properly.
+		if (priority == PIPELINE_COMPILE_PRIORITY_REQUESTED)
+			force_repaint();
+	}
+}
+
+gamescope::ConVar<bool> cv_pipeline_async_compile{ "pipeline_async_compile", true, "Draw with a fallback pipeline while a missing pipeline permutation compiles in the background, instead of stalling the frame." };
+
 extern bool g_bSteamIsActiveWindow;
 
-VkPipeline CVulkanDevice::pipeline(ShaderType type, uint32_t layerCount, uint32_t ycbcrMask, uint32_t blur_layers, uint32_t colorspace_mask, uint32_t output_eotf, bool itm_enable)
+static uint32_t get_effective_composite_debug()
 {
 	uint32_t effective_debug = g_uCompositeDebug;
 	if ( g_bSteamIsActiveWindow )
 		effective_debug &= ~(CompositeDebugFlag::Heatmap | CompositeDebugFlag::Heatmap_MSWCG | CompositeDebugFlag::Heatmap_Hard);
+	return effective_debug;
+}
+
+VkPipeline CVulkanDevice::pipeline(ShaderType type, uint32_t layerCount, uint32_t ycbcrMask, uint32_t blur_layers, uint32_t colorspace_mask, uint32_t output_eotf, bool itm_enable, bool allow_fallback)
+{
+	uint32_t effective_debug = get_effective_composite_debug();
 
-	std::lock_guard<std::mutex> lock(m_pipelineMutex);
 	PipelineInfo_t key = {type, layerCount, ycbcrMask, blur_layers, effective_debug, colorspace_mask, output_eotf, itm_enable};
-	auto search = m_pipelineMap.find(key);
-	if (search == m_pipelineMap.end())
+
+	// Lock-free, this is hit several times for every composite.
+	if (const VkPipeline *pPipeline = m_pipelineMap.Find(key))
+		return *pPipeline;
+
+	PipelineInfo_t fallbackKey = generic_pipeline_key(type, layerCount, ycbcrMask, blur_layers, effective_debug);
+	if (allow_fallback && cv_pipeline_async_compile && !(fallbackKey == key))
 	{
-		VkPipeline result = compilePipeline(layerCount, ycbcrMask, type, blur_layers, effective_debug, colorspace_mask, output_eotf, itm_enable);
-		m_pipelineMap[key] = result;
-		return result;
+		// Colors are only off until the real one is ready, which repaints.
+		if (const VkPipeline *pFallback = m_pipelineMap.Find(fallbackKey))
+		{
+			queuePipelineCompile(key, PIPELINE_COMPILE_PRIORITY_REQUESTED);
+			return *pFallback;
+		}
 	}
-	else
+
+	VkPipeline result = compilePipeline(layerCount, ycbcrMask, type, blur_layers, effective_debug, colorspace_mask, output_eotf, itm_enable);
+
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+	if (!m_pipelineMap.Insert(key, result))
 	{
-		return search->second;
+		// gamescope-shdr beat us to it.
+		vk.DestroyPipeline(device(), result, nullptr);
+		result = *m_pipelineMap.Find(key);
+	}
+	return result;
+}
+
+void CVulkanDevice::queuePipelinePredictions(uint32_t layerCount, uint32_t ycbcrMask, uint32_t colorspace_mask, uint32_t output_eotf, uint32_t composite_debug)
+{
+	const uint32_t srgbLayer = GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB;
+
+	// The same frame with an overlay or notification appearing or going away.
+	for (uint32_t count = std::max(layerCount, 2u) - 1; count <= std::min(layerCount + 1, uint32_t(k_nMaxLayers)); count++)
+	{
+		uint32_t layerMask = (1u << count) - 1;
+		uint32_t colorspaceBits = count * GamescopeAppTextureColorspace_Bits;
+		uint32_t countColorspaceMask = colorspace_mask & ((1u << colorspaceBits) - 1);
+		for (uint32_t i = layerCount; i < count; i++)
+			countColorspaceMask |= srgbLayer << (i * GamescopeAppTextureColorspace_Bits);
+
+		PipelineInfo_t key = {SHADER_TYPE_BLIT, count, ycbcrMask & layerMask, 0, composite_debug, countColorspaceMask, output_eotf, false};
+		queuePipelineCompile(key, PIPELINE_COMPILE_PRIORITY_PREDICTED);
+	}
+
+	// The other passes vulkan_composite may pick for the same layers.
+	PipelineInfo_t rcasKey = {SHADER_TYPE_RCAS, layerCount, ycbcrMask & ~1u, 0, composite_debug, colorspace_mask, output_eotf, false};
+	queuePipelineCompile(rcasKey, PIPELINE_COMPILE_PRIORITY_PREDICTED);
+
+	for (uint32_t blur_layers = 1; blur_layers <= std::min(layerCount, uint32_t(k_nMaxBlurLayers)); blur_layers++)
+	{
+		PipelineInfo_t blurKey = {SHADER_TYPE_BLUR, layerCount, ycbcrMask, blur_layers, composite_debug, colorspace_mask, output_eotf, false};
+		queuePipelineCompile(blurKey, PIPELINE_COMPILE_PRIORITY_PREDICTED);
+		blurKey.shaderType = SHADER_TYPE_BLUR_COND;
+		queuePipelineCompile(blurKey, PIPELINE_COMPILE_PRIORITY_PREDICTED);
+	}
+}
+
+void CVulkanDevice::predictPipelines(const FrameInfo_t *frameInfo, uint32_t output_eotf)
+{
+	uint32_t effective_debug = get_effective_composite_debug();
+
+	gamescope::IBackendConnector *pConnector = GetBackend()->GetCurrentConnector();
+	bool bHDR = pConnector && pConnector->GetHDRInfo().bExposeHDRSupport;
+	if (pConnector != m_pLastPredictedConnector || bHDR != m_bLastPredictedHDR)
+	{
+		m_pLastPredictedConnector = pConnector;
+		m_bLastPredictedHDR = bHDR;
+
+		// A game going fullscreen on this connector: an SDR, scRGB or HDR10
+		// base layer with SDR overlays on top, for every output EOTF we may use.
+		std::array<uint32_t, 3> outputEOTFs = { EOTF_Gamma22, EOTF_PQ, EOTF_Count };
+		for (uint32_t eotf : outputEOTFs)
+		{
+			if (eotf == EOTF_PQ && !bHDR)
+				continue;
+
+			std::array<uint32_t, 3> baseColorspaces = { GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB, GAMESCOPE_APP_TEXTURE_COLORSPACE_SCRGB, GAMESCOPE_APP_TEXTURE_COLORSPACE_HDR10_PQ };
+			for (uint32_t baseColorspace : baseColorspaces)
+			{
+				if (!bHDR && baseColorspace != GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB)
+					continue;
+
+				for (uint32_t layerCount = 1; layerCount <= k_nMaxLayers; layerCount++)
+				{
+					uint32_t colorspace_mask = baseColorspace;
+					for (uint32_t i = 1; i < layerCount; i++)
+						colorspace_mask |= GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB << (i * GamescopeAppTextureColorspace_Bits);
+
+					PipelineInfo_t key = {SHADER_TYPE_BLIT, layerCount, 0, 0, effective_debug, colorspace_mask, eotf, false};
+					queuePipelineCompile(key, PIPELINE_COMPILE_PRIORITY_PREDICTED);
+				}
+			}
+		}
 	}
+
+	// Recent frames: only look again when the layer setup changes.
+	PipelineInfo_t frameKey = {SHADER_TYPE_BLIT, uint32_t(frameInfo->layerCount), frameInfo->ycbcrMask(), 0, effective_debug, frameInfo->colorspaceMask(), output_eotf, false};
+	if (frameKey == m_lastPredictedFrame || frameInfo->layerCount <= 0)
+		return;
+	m_lastPredictedFrame = frameKey;
+
+	queuePipelinePredictions(frameKey.layerCount, frameKey.ycbcrMask, frameKey.colorspaceMask, output_eotf, effective_debug);
 }
 
 
@@ -1449,6 +1840,21 @@ void CVulkanDevice::wait(uint64_t sequence, bool reset)
 		resetCmdBuffers(sequence);
 }
 
+bool CVulkanDevice::waitForSequence(uint64_t sequence, uint64_t ulTimeoutNs)
+{
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &m_scratchTimelineSemaphore,
+		.pValues = &sequence,
+	};
+
+	VkResult res = vk.WaitSemaphores( device(), &waitInfo, ulTimeoutNs );
+	if ( res != VK_SUCCESS && res != VK_TIMEOUT )
+		vk_errorf( res, "vkWaitSemaphores failed" );
+	return res == VK_SUCCESS;
+}
+
 void CVulkanDevice::waitIdle(bool reset)
 {
 	wait(m_submissionSeqNo, reset);
@@ -1961,6 +2367,15 @@ static VkImageViewType VulkanImageTypeToViewType(VkImageType type)
 	}
 }
 
+// Single-channel views of each plane of a 4:2:0 image, for writing from compute.
+static VkFormat YcbcrPlaneViewFormat( VkFormat format, uint32_t uPlane )
+{
+	if ( format == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 )
+		return uPlane == 0 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R16G16_UNORM;
+
+	return uPlane == 0 ? VK_FORMAT_R8_UNORM : VK_FORMAT_R8G8_UNORM;
+}
+
 bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uint32_t drmFormat, createFlags flags, wlr_dmabuf_attributes *pDMA /* = nullptr */,  uint32_t contentWidth /* = 0 */, uint32_t contentHeight /* =  0 */, CVulkanTexture *pExistingImageToReuseMemory, gamescope::OwningRc<gamescope::IBackendFb> pBackendFb )
 {
 	m_pBackendFb = std::move( pBackendFb );
@@ -2060,6 +2475,13 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 		imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
 	}
 
+	// P010's planes are R10X6, which nobody supports storage on.
+	// We write them through R16 views, the padding bits end up as the low bits.
+	if ( imageInfo.format == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 && flags.bStorage )
+	{
+		imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+	}
+
 	if ( pDMA != nullptr )
 	{
 		assert( drmFormat == pDMA->format );
@@ -2160,6 +2582,28 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 		imageInfo.tiling = tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 	}
 
+	if ( flags.exportModifier != DRM_FORMAT_MOD_INVALID && g_device.supportsModifiers() && !pDMA )
+	{
+		assert( flags.bExportable && !flags.bMappable && !flags.bFlippable );
+
+		modifiers.push_back( flags.exportModifier );
+
+		modifierListInfo = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
+			.pNext = std::exchange(imageInfo.pNext, &modifierListInfo),
+			.drmFormatModifierCount = uint32_t(modifiers.size()),
+			.pDrmFormatModifiers = modifiers.data(),
+		};
+
+		externalImageCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+			.pNext = std::exchange(imageInfo.pNext, &externalImageCreateInfo),
+			.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		};
+
+		imageInfo.tiling = tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+	}
+
 	if ( flags.bFlippable == true && tiling != VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT )
 	{
 		// We want to scan-out the image
@@ -2406,6 +2850,33 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 				}
 			}
 		}
+		else if ( isYcbcr() )
+		{
+			// Linear, so the planes are just where the driver put them in the one allocation.
+			const VkImageAspectFlagBits planeAspects[] = {
+				VK_IMAGE_ASPECT_PLANE_0_BIT,
+				VK_IMAGE_ASPECT_PLANE_1_BIT,
+			};
+
+			dmabuf.n_planes = 2;
+			dmabuf.modifier = DRM_FORMAT_MOD_LINEAR;
+			for ( int i = 0; i < dmabuf.n_planes; i++ )
+			{
+				const VkImageSubresource subresource = {
+					.aspectMask = planeAspects[i],
+				};
+				VkSubresourceLayout subresourceLayout = {};
+				g_device.vk.GetImageSubresourceLayout( g_device.device(), m_vkImage, &subresource, &subresourceLayout );
+				dmabuf.offset[i] = subresourceLayout.offset;
+				dmabuf.stride[i] = subresourceLayout.rowPitch;
+			}
+
+			dmabuf.fd[1] = dup( dmabuf.fd[0] );
+			if ( dmabuf.fd[1] < 0 ) {
+				vk_log.errorf_errno( "dup failed" );
+				return false;
+			}
+		}
 		else
 		{
 			const VkImageSubresource subresource = {
@@ -2481,7 +2952,7 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 		if ( isYcbcr() )
 		{
 			createInfo.pNext = NULL;
-			createInfo.format = VK_FORMAT_R8_UNORM;
+			createInfo.format = YcbcrPlaneViewFormat( m_format, 0 );
 
 			createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT;
 			res = g_device.vk.CreateImageView(g_device.device(), &createInfo, nullptr, &m_lumaView);
@@ -2491,7 +2962,7 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 			}
 
 			createInfo.pNext = NULL;
-			createInfo.format = VK_FORMAT_R8G8_UNORM;
+			createInfo.format = YcbcrPlaneViewFormat( m_format, 1 );
 			createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT;
 			res = g_device.vk.CreateImageView(g_device.device(), &createInfo, nullptr, &m_chromaView);
 			if ( res != VK_SUCCESS ) {
@@ -2822,6 +3293,99 @@ bool vulkan_init_format(VkFormat format, uint32_t drmFormat)
 	}
 }
 
+// Formats we only ever render into for capture never go through vulkan_init_format,
+// but exporting them still needs their modifier properties.
+static void vulkan_init_capture_format( VkFormat format )
+{
+	if ( !g_device.supportsModifiers() )
+		return;
+
+	VkDrmFormatModifierPropertiesListEXT modifierPropList = {
+		.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT,
+	};
+	VkFormatProperties2 formatProps = {
+		.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+		.pNext = &modifierPropList,
+	};
+
+	g_device.vk.GetPhysicalDeviceFormatProperties2( g_device.physDev(), format, &formatProps );
+
+	std::vector<VkDrmFormatModifierPropertiesEXT> modifierProps(modifierPropList.drmFormatModifierCount);
+	modifierPropList.pDrmFormatModifierProperties = modifierProps.data();
+	g_device.vk.GetPhysicalDeviceFormatProperties2( g_device.physDev(), format, &formatProps );
+
+	std::map< uint64_t, VkDrmFormatModifierPropertiesEXT > map = {};
+	for ( size_t j = 0; j < modifierProps.size(); j++ )
+		map[ modifierProps[j].drmFormatModifier ] = modifierProps[j];
+
+	DRMModifierProps[ format ] = map;
+}
+
+std::vector<uint64_t> vulkan_get_capture_modifiers( uint32_t drmFormat )
+{
+	std::vector<uint64_t> modifiers;
+
+	if ( !g_device.supportsModifiers() )
+		return modifiers;
+
+	VkFormat format = DRMFormatToVulkan( drmFormat, false );
+	auto iter = DRMModifierProps.find( format );
+	if ( iter == DRMModifierProps.end() )
+		return modifiers;
+
+	// Matches what CVulkanTexture::BInit creates the PipeWire capture texture with.
+	VkImageCreateInfo imageInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = format,
+		.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	std::array<VkFormat, 2> formats = {
+		DRMFormatToVulkan( drmFormat, false ),
+		DRMFormatToVulkan( drmFormat, true ),
+	};
+
+	VkImageFormatListCreateInfo formatList = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO,
+		.viewFormatCount = (uint32_t)formats.size(),
+		.pViewFormats = formats.data(),
+	};
+
+	if ( formats[0] != formats[1] )
+	{
+		formatList.pNext = std::exchange( imageInfo.pNext, &formatList );
+		imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+	}
+
+	if ( format == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 )
+		imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+
+	// The PipeWire buffers only get a data per plane of the format, so leave
+	// out modifiers with extra planes (eg. CCS/DCC metadata).
+	const uint32_t uFormatPlanes = ( format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM || format == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 ) ? 2 : 1;
+
+	for ( auto &[ modifier, props ] : iter->second )
+	{
+		if ( props.drmFormatModifierPlaneCount != uFormatPlanes )
+			continue;
+
+		VkExternalImageFormatProperties externalFormatProps = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
+		};
+		if ( getModifierProps( &imageInfo, modifier, &externalFormatProps ) != VK_SUCCESS )
+			continue;
+
+		if ( !( externalFormatProps.externalMemoryProperties.externalMemoryFeatures & VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT ) )
+			continue;
+
+		modifiers.push_back( modifier );
+	}
+
+	return modifiers;
+}
+
 bool vulkan_init_formats()
 {
 	for ( size_t i = 0; s_DRMVKFormatTable[i].DRMFormat != DRM_FORMAT_INVALID; i++ )
@@ -2838,6 +3402,8 @@ bool vulkan_init_formats()
 			vulkan_init_format(srgbFormat, drmFormat);
 	}
 
+	vulkan_init_capture_format( VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 );
+
 	vk_log.infof( "supported DRM formats for sampling usage:" );
 	for ( size_t i = 0; i < sampledDRMFormats.len; i++ )
 	{
@@ -3006,19 +3572,29 @@ gamescope::Rc<CVulkanTexture> vulkan_create_3d_lut(uint32_t width, uint32_t heig
 
 void vulkan_update_luts(const gamescope::Rc<CVulkanTexture>& lut1d, const gamescope::Rc<CVulkanTexture>& lut3d, void* lut1d_data, void* lut3d_data)
 {
-	size_t lut1d_size = lut1d->width() * sizeof(uint16_t) * 4;
-	size_t lut3d_size = lut3d->width() * lut3d->height() * lut3d->depth() * sizeof(uint16_t) * 4;
-
-	void* base_dst = g_device.uploadBufferData(lut1d_size + lut3d_size);
+	vulkan_update_luts( std::vector<VulkanLutUpload_t>{ { lut1d, lut3d, lut1d_data, lut3d_data } } );
+}
 
-	void* lut1d_dst = base_dst;
-	void *lut3d_dst = ((uint8_t*)base_dst) + lut1d_size;
-	memcpy(lut1d_dst, lut1d_data, lut1d_size);
-	memcpy(lut3d_dst, lut3d_data, lut3d_size);
+void vulkan_update_luts(const std::vector<VulkanLutUpload_t> &uploads)
+{
+	if ( uploads.empty() )
+		return;
 
 	auto cmdBuffer = g_device.commandBuffer();
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), 0, 0, lut1d);
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), lut1d_size, 0, lut3d);
+	for ( const VulkanLutUpload_t &upload : uploads )
+	{
+		size_t lut1d_size = upload.lut1d->width() * sizeof(uint16_t) * 4;
+		size_t lut3d_size = upload.lut3d->width() * upload.lut3d->height() * upload.lut3d->depth() * sizeof(uint16_t) * 4;
+
+		uint8_t* base_dst = (uint8_t *)g_device.uploadBufferData(lut1d_size + lut3d_size);
+		uint32_t base_offset = g_device.uploadBufferOffset() - (lut1d_size + lut3d_size);
+
+		memcpy(base_dst, upload.lut1d_data, lut1d_size);
+		memcpy(base_dst + lut1d_size, upload.lut3d_data, lut3d_size);
+
+		cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), base_offset, 0, upload.lut1d);
+		cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), base_offset + lut1d_size, 0, upload.lut3d);
+	}
 	g_device.submit(std::move(cmdBuffer));
 	g_device.waitIdle(); // TODO: Sync this better
 }
@@ -3535,39 +4111,52 @@ void vulkan_garbage_collect( void )
 	g_device.garbageCollect();
 }
 
+void vulkan_save_pipeline_cache( void )
+{
+	g_device.savePipelineCache();
+}
+
 gamescope::Rc<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace)
 {
+	// Prefer an idle image that already fits.
 	for (auto& pScreenshotImage : g_output.pScreenshotImages)
 	{
-		if (pScreenshotImage == nullptr)
-		{
-			pScreenshotImage = new CVulkanTexture();
-
-			CVulkanTexture::createFlags screenshotImageFlags;
-			screenshotImageFlags.bMappable = true;
-			screenshotImageFlags.bTransferDst = true;
-			screenshotImageFlags.bStorage = true;
-			if (exportable || drmFormat == DRM_FORMAT_NV12) {
-				screenshotImageFlags.bExportable = true;
-				screenshotImageFlags.bLinear = true; // TODO: support multi-planar DMA-BUF export via PipeWire
-			}
+		if (pScreenshotImage != nullptr &&
+			pScreenshotImage->GetRefCount() == 0 &&
+			width == pScreenshotImage->width() &&
+			height == pScreenshotImage->height() &&
+			drmFormat == pScreenshotImage->drmFormat())
+			return pScreenshotImage.get();
+	}
+
+	// Otherwise (re)make an idle one, eg. for an AVIF/NV12 screenshot after
+	// PNG ones, or after the output size changed.
+	for (auto& pScreenshotImage : g_output.pScreenshotImages)
+	{
+		if (pScreenshotImage != nullptr && pScreenshotImage->GetRefCount() != 0)
+			continue;
 
-			bool bSuccess = pScreenshotImage->BInit( width, height, 1u, drmFormat, screenshotImageFlags );
-			pScreenshotImage->setStreamColorspace(colorspace);
+		pScreenshotImage = new CVulkanTexture();
 
-			assert( bSuccess );
+		CVulkanTexture::createFlags screenshotImageFlags;
+		screenshotImageFlags.bMappable = true;
+		screenshotImageFlags.bTransferDst = true;
+		screenshotImageFlags.bStorage = true;
+		if (exportable || drmFormat == DRM_FORMAT_NV12) {
+			screenshotImageFlags.bExportable = true;
+			screenshotImageFlags.bLinear = true; // TODO: support multi-planar DMA-BUF export via PipeWire
 		}
 
-		if (pScreenshotImage->GetRefCount() != 0 ||
-			width != pScreenshotImage->width() ||
-			height != pScreenshotImage->height() ||
-			drmFormat != pScreenshotImage->drmFormat())
-			continue;
+		bool bSuccess = pScreenshotImage->BInit( width, height, 1u, drmFormat, screenshotImageFlags );
+		pScreenshotImage->setStreamColorspace(colorspace);
+
+		assert( bSuccess );
 
 		return pScreenshotImage.get();
 	}
 
-	vk_log.errorf("Unable to acquire screenshot texture. Out of textures.");
+	// Every image is still held by a screenshot job, the caller can try again later.
+	vk_log.debugf("Unable to acquire screenshot texture, all of them are in use.");
 	return nullptr;
 }
 
@@ -3595,9 +4184,18 @@ struct BlitPushData_t
     float u_itmSdrNits; // unset
     float u_itmTargetNits; // unset
 
+	uint32_t u_dispatchOffset[2];
+
+	// NV12 captures only.
+	mat3x4 u_outputCTM;
+	uint32_t u_halfExtent[2];
+
 	explicit BlitPushData_t(const struct FrameInfo_t *frameInfo)
 	{
 		u_shaderFilter = 0;
+		u_dispatchOffset[0] = u_dispatchOffset[1] = 0;
+		u_outputCTM = {};
+		u_halfExtent[0] = u_halfExtent[1] = 0;
 
 		for (int i = 0; i < frameInfo->layerCount; i++) {
 			const FrameInfo_t::Layer_t *layer = &frameInfo->layers[i];
@@ -3639,6 +4237,9 @@ struct BlitPushData_t
 		offset[0] = { 0.5f, 0.5f };
 		opacity[0] = 1.0f;
         u_shaderFilter = (uint32_t)GamescopeUpscaleFilter::LINEAR;
+		u_dispatchOffset[0] = u_dispatchOffset[1] = 0;
+		u_outputCTM = {};
+		u_halfExtent[0] = u_halfExtent[1] = 0;
 		ctm[0] = glm::mat3x4
 		{
 			1, 0, 0, 0,
@@ -3813,7 +4414,7 @@ void bind_all_layers(CVulkanCmdBuffer* cmdBuffer, const struct FrameInfo_t *fram
 	}
 }
 
-std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, gamescope::Rc<CVulkanTexture> pYUVOutTexture )
+std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, gamescope::Rc<CVulkanTexture> pYUVOutTexture, const std::vector<VkRect2D> *pDamage )
 {
 	EOTF outputTF = frameInfo->outputEncodingEOTF;
 	if (!frameInfo->applyOutputColorMgmt)
@@ -3824,44 +4425,45 @@ std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo,
 	for (uint32_t i = 0; i < EOTF_Count; i++)
 		cmdBuffer->bindColorMgmtLuts(i, frameInfo->shaperLut[i], frameInfo->lut3D[i]);
 
-	cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, frameInfo->layerCount, frameInfo->ycbcrMask(), 0u, frameInfo->colorspaceMask(), outputTF ));
+	// Composite, scale and convert to NV12 in one pass, rather than going through an RGB image.
+	const bool bYUV = pYUVOutTexture != nullptr;
+	gamescope::Rc<CVulkanTexture> pTarget = bYUV ? pYUVOutTexture : pScreenshotTexture;
+
+	// Screenshots are one-shot, never take them with a fallback pipeline.
+	cmdBuffer->bindPipeline( g_device.pipeline(bYUV ? SHADER_TYPE_BLIT_NV12 : SHADER_TYPE_BLIT, frameInfo->layerCount, frameInfo->ycbcrMask(), 0u, frameInfo->colorspaceMask(), outputTF, false, false ));
 	bind_all_layers(cmdBuffer.get(), frameInfo);
-	cmdBuffer->bindTarget(pScreenshotTexture);
-	cmdBuffer->uploadConstants<BlitPushData_t>(frameInfo);
+	cmdBuffer->bindTarget(pTarget);
+
+	BlitPushData_t constants(frameInfo);
+	if ( bYUV )
+	{
+		constants.u_outputCTM = colorspace_to_conversion_from_srgb_matrix( pYUVOutTexture->streamColorspace() );
+		constants.u_halfExtent[0] = pYUVOutTexture->width() / 2;
+		constants.u_halfExtent[1] = pYUVOutTexture->height() / 2;
+	}
 
 	const int pixelsPerGroup = 8;
 
-	cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+	// For ycbcr, we operate on 2 pixels at a time.
+	const int dispatchSize = bYUV ? pixelsPerGroup * 2 : pixelsPerGroup;
 
-	if ( pYUVOutTexture != nullptr )
+	if ( pDamage )
 	{
-		float scale = (float)pScreenshotTexture->width() / pYUVOutTexture->width();
+		// Whatever's outside the damage has to keep its contents.
+		cmdBuffer->prepareSrcImage(pTarget.get());
 
-		CaptureConvertBlitData_t constants( scale, colorspace_to_conversion_from_srgb_matrix( pYUVOutTexture->streamColorspace() ) );
-		constants.halfExtent[0] = pYUVOutTexture->width() / 2.0f;
-		constants.halfExtent[1] = pYUVOutTexture->height() / 2.0f;
-		cmdBuffer->uploadConstants<CaptureConvertBlitData_t>(constants);
-
-		for (uint32_t i = 0; i < EOTF_Count; i++)
-			cmdBuffer->bindColorMgmtLuts(i, nullptr, nullptr);
-
-		cmdBuffer->bindPipeline(g_device.pipeline( SHADER_TYPE_RGB_TO_NV12, 1, 0, 0, GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB, EOTF_Count ));
-		cmdBuffer->bindTexture(0, pScreenshotTexture);
-		cmdBuffer->setTextureSrgb(0, true);
-		cmdBuffer->setSamplerNearest(0, false);
-		cmdBuffer->setSamplerUnnormalized(0, true);
-		for (uint32_t i = 1; i < VKR_SAMPLER_SLOTS; i++)
+		for ( const VkRect2D &rect : *pDamage )
 		{
-			cmdBuffer->bindTexture(i, nullptr);
+			constants.u_dispatchOffset[0] = rect.offset.x;
+			constants.u_dispatchOffset[1] = rect.offset.y;
+			cmdBuffer->uploadConstants<BlitPushData_t>(constants);
+			cmdBuffer->dispatch(div_roundup(rect.extent.width, dispatchSize), div_roundup(rect.extent.height, dispatchSize));
 		}
-		cmdBuffer->bindTarget(pYUVOutTexture);
-
-		const int pixelsPerGroup = 8;
-
-		// For ycbcr, we operate on 2 pixels at a time, so use the half-extent.
-		const int dispatchSize = pixelsPerGroup * 2;
-
-		cmdBuffer->dispatch(div_roundup(pYUVOutTexture->width(), dispatchSize), div_roundup(pYUVOutTexture->height(), dispatchSize));
+	}
+	else
+	{
+		cmdBuffer->uploadConstants<BlitPushData_t>(constants);
+		cmdBuffer->dispatch(div_roundup(currentOutputWidth, dispatchSize), div_roundup(currentOutputHeight, dispatchSize));
 	}
 
 	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
@@ -3879,6 +4481,8 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 	if (!frameInfo->applyOutputColorMgmt)
 		outputTF = EOTF_Count; //Disable blending stuff.
 
+	g_device.predictPipelines(frameInfo, outputTF);
+
 	g_pLastReshadeEffect = nullptr;
 	if (!g_reshade_effect.empty())
 	{
@@ -4111,6 +4715,11 @@ void vulkan_wait( uint64_t ulSeqNo, bool bReset )
 	return g_device.wait( ulSeqNo, bReset );
 }
 
+bool vulkan_wait_for_sequence( uint64_t ulSeqNo, uint64_t ulTimeoutNs )
+{
+	return g_device.waitForSequence( ulSeqNo, ulTimeoutNs );
+}
+
 gamescope::Rc<CVulkanTexture> vulkan_get_last_output_image( bool partial, bool defer )
 {
 	// Get previous image ( +2 )
@@ -10,12 +10,16 @@
 #include <array>
 #include <bitset>
 #include <mutex>
+#include <condition_variable>
 #include <optional>
+#include <queue>
+#include <string>
 
 #include "main.hpp"
 
 #include "gamescope_shared.h"
 #include "backend.h"
+#include "Utils/ReadMostlyHashTable.h"
 
 #include "shaders/descriptor_set_constants.h"
 
@@ -142,6 +146,7 @@ public:
 			bOutputImage = false;
 			bColorAttachment = false;
 			imageType = VK_IMAGE_TYPE_2D;
+			exportModifier = DRM_FORMAT_MOD_INVALID;
 		}
 
 		bool bFlippable : 1;
@@ -155,6 +160,9 @@ public:
 		bool bOutputImage : 1;
 		bool bColorAttachment : 1;
 		VkImageType imageType;
+		// Exportable with exactly this modifier (eg. one negotiated with a
+		// PipeWire consumer) rather than linear. Not mappable.
+		uint64_t exportModifier;
 	};
 
 	bool BInit( uint32_t width, uint32_t height, uint32_t depth, uint32_t drmFormat, createFlags flags, wlr_dmabuf_attributes *pDMA = nullptr, uint32_t contentWidth = 0, uint32_t contentHeight = 0, CVulkanTexture *pExistingImageToReuseMemory = nullptr, gamescope::OwningRc<gamescope::IBackendFb> pBackendFb = nullptr );
@@ -196,7 +204,7 @@ public:
 
 	inline bool isYcbcr() const
 	{
-		return format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+		return format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM || format() == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16;
 	}
 
 	int memoryFence();
@@ -396,26 +404,45 @@ gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struc
 
 std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, bool partial, gamescope::Rc<CVulkanTexture> pOutputOverride = nullptr, bool increment = true, std::unique_ptr<CVulkanCmdBuffer> pInCommandBuffer = nullptr );
 void vulkan_wait( uint64_t ulSeqNo, bool bReset );
+// For other threads (eg. PipeWire) to wait on work we submitted.
+// Returns false on timeout.
+bool vulkan_wait_for_sequence( uint64_t ulSeqNo, uint64_t ulTimeoutNs );
 gamescope::Rc<CVulkanTexture> vulkan_get_last_output_image( bool partial, bool defer );
 gamescope::Rc<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace = k_EStreamColorspace_Unknown);
 
 void vulkan_present_to_window( void );
 
 void vulkan_garbage_collect( void );
+void vulkan_save_pipeline_cache( void );
 bool vulkan_remake_swapchain( void );
 bool vulkan_remake_output_images( void );
 bool acquire_next_image( void );
 
 bool vulkan_primary_dev_id(dev_t *id);
 bool vulkan_supports_modifiers(void);
+// Modifiers we can render a capture into (storage + transfer dst) and export as DMA-BUF.
+std::vector<uint64_t> vulkan_get_capture_modifiers( uint32_t drmFormat );
 
 gamescope::Rc<CVulkanTexture> vulkan_create_1d_lut(uint32_t size);
 gamescope::Rc<CVulkanTexture> vulkan_create_3d_lut(uint32_t width, uint32_t height, uint32_t depth);
 void vulkan_update_luts(const gamescope::Rc<CVulkanTexture>& lut1d, const gamescope::Rc<CVulkanTexture>& lut3d, void* lut1d_data, void* lut3d_data);
 
+struct VulkanLutUpload_t
+{
+	gamescope::Rc<CVulkanTexture> lut1d;
+	gamescope::Rc<CVulkanTexture> lut3d;
+	void *lut1d_data;
+	void *lut3d_data;
+};
+// Uploads all of them with one submit, and only waits once.
+void vulkan_update_luts(const std::vector<VulkanLutUpload_t> &uploads);
+
 gamescope::Rc<CVulkanTexture> vulkan_get_hacky_blank_texture();
 
-std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, gamescope::Rc<CVulkanTexture> pYUVOutTexture );
+// With pYUVOutTexture, the layers are composited straight into it and pScreenshotTexture is unused.
+// pDamage limits the update to those rects of the output, which must be aligned to 16 pixels,
+// everything else in it is left as it was. nullptr redraws all of it.
+std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, gamescope::Rc<CVulkanTexture> pYUVOutTexture, const std::vector<VkRect2D> *pDamage = nullptr );
 
 struct wlr_renderer *vulkan_renderer_create( void );
 
@@ -543,6 +570,7 @@ enum ShaderType {
 	SHADER_TYPE_RCAS,
 	SHADER_TYPE_NIS,
 	SHADER_TYPE_RGB_TO_NV12,
+	SHADER_TYPE_BLIT_NV12,
 
 	SHADER_TYPE_COUNT
 };
@@ -631,6 +659,28 @@ namespace std
 	};
 }
 
+enum PipelineCompilePriority : uint32_t
+{
+	PIPELINE_COMPILE_PRIORITY_PRECOMPILE = 0,
+	PIPELINE_COMPILE_PRIORITY_PREDICTED,
+	// Asked for by the render path and not ready yet.
+	PIPELINE_COMPILE_PRIORITY_REQUESTED,
+};
+
+struct PipelineCompileJob_t
+{
+	PipelineInfo_t key;
+	PipelineCompilePriority priority;
+	uint64_t order;
+
+	// Highest priority first, then first come first served.
+	bool operator<(const PipelineCompileJob_t& o) const {
+		if (priority != o.priority)
+			return priority < o.priority;
+		return order > o.order;
+	}
+};
+
 static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 {
 	return (x + (y - 1)) / y;
@@ -682,6 +732,7 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(CreateGraphicsPipelines) \
 	VK_FUNC(CreateImage) \
 	VK_FUNC(CreateImageView) \
+	VK_FUNC(CreatePipelineCache) \
 	VK_FUNC(CreatePipelineLayout) \
 	VK_FUNC(CreateSampler) \
 	VK_FUNC(CreateSamplerYcbcrConversion) \
@@ -710,6 +761,7 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(GetImageMemoryRequirements) \
 	VK_FUNC(GetImageSubresourceLayout) \
 	VK_FUNC(GetMemoryFdKHR) \
+	VK_FUNC(GetPipelineCacheData) \
 	VK_FUNC(GetSemaphoreCounterValue) \
 	VK_FUNC(GetSwapchainImagesKHR) \
 	VK_FUNC(MapMemory) \
@@ -754,14 +806,18 @@ public:
 	bool BInit(VkInstance instance, VkSurfaceKHR surface);
 
 	VkSampler sampler(SamplerState key);
-	VkPipeline pipeline(ShaderType type, uint32_t layerCount = 1, uint32_t ycbcrMask = 0, uint32_t blur_layers = 0, uint32_t colorspace_mask = 0, uint32_t output_eotf = EOTF_Gamma22, bool itm_enable = false);
+	VkPipeline pipeline(ShaderType type, uint32_t layerCount = 1, uint32_t ycbcrMask = 0, uint32_t blur_layers = 0, uint32_t colorspace_mask = 0, uint32_t output_eotf = EOTF_Gamma22, bool itm_enable = false, bool allow_fallback = true);
+	void predictPipelines(const FrameInfo_t *frameInfo, uint32_t output_eotf);
 	int32_t findMemoryType( VkMemoryPropertyFlags properties, uint32_t requiredTypeBits );
 	std::unique_ptr<CVulkanCmdBuffer> commandBuffer();
 	uint64_t submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuf);
 	uint64_t submitInternal( CVulkanCmdBuffer* cmdBuf );
 	void wait(uint64_t sequence, bool reset = true);
+	// Only waits, doesn't recycle anything, so it's safe from any thread.
+	bool waitForSequence(uint64_t sequence, uint64_t ulTimeoutNs);
 	void waitIdle(bool reset = true);
 	void garbageCollect();
+	void savePipelineCache();
 	inline VkDescriptorSet descriptorSet()
 	{
 		VkDescriptorSet ret = m_descriptorSets[m_currentDescriptorSet];
@@ -784,6 +840,8 @@ public:
 	inline uint32_t queueFamily() {return m_queueFamily;}
 	inline uint32_t generalQueueFamily() {return m_generalQueueFamily;}
 	inline VkBuffer uploadBuffer() {return m_uploadBuffer;}
+	// Offset into uploadBuffer() of the end of the last uploadBufferData.
+	inline uint32_t uploadBufferOffset() {return m_uploadBufferOffset;}
 	inline VkPipelineLayout pipelineLayout() {return m_pipelineLayout;}
 	inline int drmRenderFd() {return m_drmRendererFd;}
 	inline bool supportsModifiers() {return m_bSupportsModifiers;}
@@ -825,9 +883,13 @@ protected:
 	bool createLayouts();
 	bool createPools();
 	bool createShaders();
+	void createPipelineCache(uint32_t shaderHash);
 	bool createScratchResources();
 	VkPipeline compilePipeline(uint32_t layerCount, uint32_t ycbcrMask, ShaderType type, uint32_t blur_layer_count, uint32_t composite_debug, uint32_t colorspace_mask, uint32_t output_eotf, bool itm_enable);
 	void compileAllPipelines();
+	void pipelineCompileThread();
+	void queuePipelineCompile(const PipelineInfo_t &key, PipelineCompilePriority priority);
+	void queuePipelinePredictions(uint32_t layerCount, uint32_t ycbcrMask, uint32_t colorspace_mask, uint32_t output_eotf, uint32_t composite_debug);
 
 	VkDevice m_device = nullptr;
 	VkPhysicalDevice m_physDev = nullptr;
@@ -858,9 +920,26 @@ protected:
 
 	std::unordered_map< SamplerState, VkSampler > m_samplerCache;
 	std::array<VkShaderModule, SHADER_TYPE_COUNT> m_shaderModules;
-	std::unordered_map<PipelineInfo_t, VkPipeline> m_pipelineMap;
+	gamescope::CReadMostlyHashTable<PipelineInfo_t, VkPipeline> m_pipelineMap;
+	// Serializes inserts into m_pipelineMap, lookups don't need it.
 	std::mutex m_pipelineMutex;
 
+	std::priority_queue<PipelineCompileJob_t> m_pipelineCompileQueue;
+	std::unordered_map<PipelineInfo_t, PipelineCompilePriority> m_pipelinesQueued;
+	uint64_t m_pipelineCompileOrder = 0;
+	std::mutex m_pipelineCompileMutex;
+	std::condition_variable m_pipelineCompileCV;
+
+	// Only touched by the render thread.
+	PipelineInfo_t m_lastPredictedFrame = {};
+	gamescope::IBackendConnector *m_pLastPredictedConnector = nullptr;
+	bool m_bLastPredictedHDR = false;
+
+	VkPipelineCache m_pipelineCache = VK_NULL_HANDLE;
+	std::string m_pipelineCachePath;
+	uint32_t m_pipelineCacheShaderHash = 0;
+	std::mutex m_pipelineCacheSaveMutex;
+
 	// currently just one set, no need to double buffer because we
 	// vkQueueWaitIdle after each submit.
 	// should be moved to the output if we are going to support multiple outputs
@@ -15,5 +15,12 @@ uniform layers_t {
     float u_nitsToLinear; // hdr -> sdr
     float u_itmSdrNits;
     float u_itmTargetNits;
+
+    // Where this dispatch starts, for partial updates.
+    uvec2 u_dispatchOffset;
+
+    // NV12 captures only.
+    mat3x4 u_outputCTM;
+    uvec2 u_halfExtent;
 };
 
@@ -93,8 +93,15 @@
 #include "commit.h"
 #include "reshade_effect_manager.hpp"
 #include "BufferMemo.h"
+#include "png_writer.hpp"
+#include "yuv_convert.hpp"
 #include "Utils/Process.h"
 #include "Utils/Algorithm.h"
+#include "Utils/SPSCRing.h"
+#include "Utils/WorkQueue.h"
+#include "Utils/SpanProfiler.h"
+#include "appid_cache.hpp"
+#include "x11_property_batch.hpp"
 
 #include "wlr_begin.hpp"
 #include "wlr/types/wlr_pointer_constraints_v1.h"
@@ -135,6 +142,9 @@ gamescope_color_mgmt_tracker_t g_ColorMgmt{};
 
 static gamescope_color_mgmt_luts g_ColorMgmtLutsOverride[ EOTF_Count ];
 static lut3d_t g_ColorMgmtLooks[ EOTF_Count ];
+// Bumped every time a look is loaded, so the LUT cache never mixes up two looks.
+static uint32_t g_uColorMgmtLookGeneration = 0;
+static uint32_t g_uColorMgmtLookIds[ EOTF_Count ];
 
 
 gamescope_color_mgmt_luts g_ColorMgmtLuts[ EOTF_Count ];
@@ -236,134 +246,534 @@ static const gamescope_color_mgmt_t k_ScreenshotColorMgmtHDR =
 //#define COLOR_MGMT_MICROBENCH
 // sudo cpupower frequency-set --governor performance
 
+///
+// Color Mgmt LUT cache
+//
+// Dragging a brightness or night mode slider back and forth revisits
+// the same handful of parameter sets, so keep the generated + uploaded
+// LUTs around, keyed on everything that feeds into calcColorTransform.
+//
+
+struct color_mgmt_lut_key_t
+{
+	bool operator == (const color_mgmt_lut_key_t&) const = default;
+	bool operator != (const color_mgmt_lut_key_t&) const = default;
+
+	displaycolorimetry_t inputColorimetry;
+	EOTF inputEOTF;
+	displaycolorimetry_t outputEncodingColorimetry;
+	EOTF outputEncodingEOTF;
+	glm::vec2 outputVirtualWhite;
+	EChromaticAdaptationMethod chromaticAdaptationMode;
+	colormapping_t colorMapping;
+	nightmode_t nightmode;
+	float flG22Luminance;
+	ETonemapOperator eTonemapOperator;
+	tonemap_info_t tonemapSource;
+	tonemap_info_t tonemapDest;
+	float flGain;
+	uint32_t uLookId;
+};
+
+// The key is hashed word by word, which is only sound if there's no padding
+// in it. Floats rule out std::has_unique_object_representations, so check
+// the members add up to the whole thing instead.
+static_assert( std::is_trivially_copyable_v<color_mgmt_lut_key_t> );
+static_assert( sizeof( color_mgmt_lut_key_t ) % sizeof( uint32_t ) == 0 );
+static_assert( sizeof( color_mgmt_lut_key_t ) ==
+	sizeof( color_mgmt_lut_key_t::inputColorimetry ) + sizeof( color_mgmt_lut_key_t::inputEOTF ) +
+	sizeof( color_mgmt_lut_key_t::outputEncodingColorimetry ) + sizeof( color_mgmt_lut_key_t::outputEncodingEOTF ) +
+	sizeof( color_mgmt_lut_key_t::outputVirtualWhite ) + sizeof( color_mgmt_lut_key_t::chromaticAdaptationMode ) +
+	sizeof( color_mgmt_lut_key_t::colorMapping ) + sizeof( color_mgmt_lut_key_t::nightmode ) +
+	sizeof( color_mgmt_lut_key_t::flG22Luminance ) + sizeof( color_mgmt_lut_key_t::eTonemapOperator ) +
+	sizeof( color_mgmt_lut_key_t::tonemapSource ) + sizeof( color_mgmt_lut_key_t::tonemapDest ) +
+	sizeof( color_mgmt_lut_key_t::flGain ) + sizeof( color_mgmt_lut_key_t::uLookId ),
+	"color_mgmt_lut_key_t has padding (or a member is missing here)" );
+
+static uint32_t hash_color_mgmt_lut_key( const color_mgmt_lut_key_t &key )
+{
+	uint32_t uWords[ sizeof( color_mgmt_lut_key_t ) / sizeof( uint32_t ) ];
+	memcpy( uWords, &key, sizeof( uWords ) );
+
+	uint32_t uHash = 0;
+	for ( uint32_t uWord : uWords )
+		uHash = hash_combine( uHash, uWord );
+	return uHash;
+}
+
+struct color_mgmt_lut_cache_entry_t
+{
+	color_mgmt_lut_key_t key;
+	uint32_t uHash = 0;
+	uint64_t ulLastUsed = 0;
+	std::unique_ptr<gamescope_color_mgmt_luts> pLuts;
+};
+
+static std::vector<color_mgmt_lut_cache_entry_t> g_ColorMgmtLutCache;
+static uint64_t g_ulColorMgmtLutCacheTick = 0;
+
+gamescope::ConVar<uint32_t> cv_color_lut_cache_size{ "color_lut_cache_size", 32, "Maximum number of generated color management LUT pairs (1D shaper + 3D) to keep around. 0 disables the cache." };
+gamescope::ConVar<uint64_t> cv_color_lut_cache_hits{ "color_lut_cache_hits", 0, "Number of color management LUTs served from the LUT cache. (Read-only)" };
+gamescope::ConVar<uint64_t> cv_color_lut_cache_misses{ "color_lut_cache_misses", 0, "Number of color management LUTs that had to be generated. (Read-only)" };
+
+static gamescope_color_mgmt_luts *
+find_cached_color_mgmt_luts( const color_mgmt_lut_key_t &key, uint32_t uHash )
+{
+	for ( color_mgmt_lut_cache_entry_t &entry : g_ColorMgmtLutCache )
+	{
+		if ( entry.uHash == uHash && entry.key == key )
+		{
+			entry.ulLastUsed = ++g_ulColorMgmtLutCacheTick;
+			return entry.pLuts.get();
+		}
+	}
+
+	return nullptr;
+}
+
+static gamescope_color_mgmt_luts *
+alloc_cached_color_mgmt_luts( const color_mgmt_lut_key_t &key, uint32_t uHash )
+{
+	// Evict the least recently used entries to make room.
+	const uint32_t uMaxEntries = cv_color_lut_cache_size;
+	while ( !g_ColorMgmtLutCache.empty() && g_ColorMgmtLutCache.size() >= uMaxEntries )
+	{
+		auto lruIter = std::min_element( g_ColorMgmtLutCache.begin(), g_ColorMgmtLutCache.end(),
+			[]( const color_mgmt_lut_cache_entry_t &a, const color_mgmt_lut_cache_entry_t &b ) { return a.ulLastUsed < b.ulLastUsed; } );
+		g_ColorMgmtLutCache.erase( lruIter );
+	}
+
+	if ( uMaxEntries == 0 )
+		return nullptr;
+
+	color_mgmt_lut_cache_entry_t &entry = g_ColorMgmtLutCache.emplace_back();
+	entry.key = key;
+	entry.uHash = uHash;
+	entry.ulLastUsed = ++g_ulColorMgmtLutCacheTick;
+	entry.pLuts = std::make_unique<gamescope_color_mgmt_luts>();
+	entry.pLuts->vk_lut1d = vulkan_create_1d_lut(s_nLutSize1d);
+	entry.pLuts->vk_lut3d = vulkan_create_3d_lut(s_nLutEdgeSize3d, s_nLutEdgeSize3d, s_nLutEdgeSize3d);
+	return entry.pLuts.get();
+}
+
+// Make sure the textures in luts are only referenced by luts, so they can be written to.
 static void
-create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_color_mgmt_luts outColorMgmtLuts[ EOTF_Count ])
+create_unshared_color_mgmt_textures( gamescope_color_mgmt_luts &luts )
+{
+	if ( !luts.vk_lut1d || luts.vk_lut1d->GetRefCount() > 1 )
+		luts.vk_lut1d = vulkan_create_1d_lut(s_nLutSize1d);
+
+	if ( !luts.vk_lut3d || luts.vk_lut3d->GetRefCount() > 1 )
+		luts.vk_lut3d = vulkan_create_3d_lut(s_nLutEdgeSize3d, s_nLutEdgeSize3d, s_nLutEdgeSize3d);
+}
+
+static void
+shutdown_color_mgmt_lut_cache()
+{
+	g_ColorMgmtLutCache.clear();
+}
+
+// Everything needed to generate the LUTs for one input EOTF.
+struct color_mgmt_lut_params_t
+{
+	color_mgmt_lut_key_t key{};
+	uint32_t uHash = 0;
+	tonemapping_t tonemapping{};
+};
+
+static const lut3d_t *
+get_color_mgmt_look( EOTF inputEOTF )
+{
+	return g_ColorMgmtLooks[inputEOTF].lutEdgeSize > 0 ? &g_ColorMgmtLooks[inputEOTF] : nullptr;
+}
+
+static void
+build_color_mgmt_lut_params( const gamescope_color_mgmt_t& newColorMgmt, EOTF inputEOTF, color_mgmt_lut_params_t *pParams )
 {
 	const displaycolorimetry_t& displayColorimetry = newColorMgmt.displayColorimetry;
 	const displaycolorimetry_t& outputEncodingColorimetry = newColorMgmt.outputEncodingColorimetry;
 
-	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
-	{
-		if (!outColorMgmtLuts[nInputEOTF].vk_lut1d)
-			outColorMgmtLuts[nInputEOTF].vk_lut1d = vulkan_create_1d_lut(s_nLutSize1d);
+	displaycolorimetry_t inputColorimetry{};
+	colormapping_t colorMapping{};
 
-		if (!outColorMgmtLuts[nInputEOTF].vk_lut3d)
-			outColorMgmtLuts[nInputEOTF].vk_lut3d = vulkan_create_3d_lut(s_nLutEdgeSize3d, s_nLutEdgeSize3d, s_nLutEdgeSize3d);
+	tonemapping_t &tonemapping = pParams->tonemapping;
+	tonemapping = tonemapping_t{};
+	tonemapping.bUseShaper = true;
 
-		if ( g_ColorMgmtLutsOverride[nInputEOTF].HasLuts() )
+	float flGain = 1.f;
+
+	if ( inputEOTF == EOTF_Gamma22 )
+	{
+		flGain = newColorMgmt.flSDRInputGain;
+		if ( newColorMgmt.outputEncodingEOTF == EOTF_Gamma22 )
 		{
-			memcpy(g_ColorMgmtLuts[nInputEOTF].lut1d, g_ColorMgmtLutsOverride[nInputEOTF].lut1d, sizeof(g_ColorMgmtLutsOverride[nInputEOTF].lut1d));
-			memcpy(g_ColorMgmtLuts[nInputEOTF].lut3d, g_ColorMgmtLutsOverride[nInputEOTF].lut3d, sizeof(g_ColorMgmtLutsOverride[nInputEOTF].lut3d));
+			// G22 -> G22. Does not matter what the g22 mult is
+			tonemapping.g22_luminance = 1.f;
+			// xwm_log.infof("G22 -> G22");
 		}
-		else
+		else if ( newColorMgmt.outputEncodingEOTF == EOTF_PQ )
 		{
-			displaycolorimetry_t inputColorimetry{};
-			colormapping_t colorMapping{};
+			// G22 -> PQ. SDR content going on an HDR output
+			tonemapping.g22_luminance = newColorMgmt.flSDROnHDRBrightness;
+			// xwm_log.infof("G22 -> PQ");
+		}
 
-			tonemapping_t tonemapping{};
-			tonemapping.bUseShaper = true;
+		// The final display colorimetry is used to build the output mapping, as we want a gamut-aware handling
+		// for sdrGamutWideness indepdendent of the output encoding (for SDR data), and when mapping SDR -> PQ output
+		// we only want to utilize a portion of the gamut the actual display can reproduce
+		buildSDRColorimetry( &inputColorimetry, &colorMapping, newColorMgmt.sdrGamutWideness, displayColorimetry );
+	}
+	else if ( inputEOTF == EOTF_PQ )
+	{
+		flGain = newColorMgmt.flHDRInputGain;
+		if ( newColorMgmt.outputEncodingEOTF == EOTF_Gamma22 )
+		{
+			// PQ -> G22  Leverage the display's native brightness
+			tonemapping.g22_luminance = newColorMgmt.flInternalDisplayBrightness;
 
-			EOTF inputEOTF = static_cast<EOTF>( nInputEOTF );
-			float flGain = 1.f;
-			lut3d_t * pLook = g_ColorMgmtLooks[nInputEOTF].lutEdgeSize > 0 ? &g_ColorMgmtLooks[nInputEOTF] : nullptr;
+			// Determine the tonemapping parameters
+			// Use the external atoms if provided
+			tonemap_info_t source = newColorMgmt.hdrTonemapSourceMetadata;
+			tonemap_info_t dest = newColorMgmt.hdrTonemapDisplayMetadata;
+			// Otherwise, rely on the Vulkan source info and the EDID
+			// TODO: If source is invalid, use the provided metadata.
+			// TODO: If hdrTonemapDisplayMetadata is invalid, use the one provided by the display
 
-			if ( inputEOTF == EOTF_Gamma22 )
-			{
-				flGain = newColorMgmt.flSDRInputGain;
-				if ( newColorMgmt.outputEncodingEOTF == EOTF_Gamma22 )
-				{
-					// G22 -> G22. Does not matter what the g22 mult is
-					tonemapping.g22_luminance = 1.f;
-					// xwm_log.infof("G22 -> G22");
-				}
-				else if ( newColorMgmt.outputEncodingEOTF == EOTF_PQ )
-				{
-					// G22 -> PQ. SDR content going on an HDR output
-					tonemapping.g22_luminance = newColorMgmt.flSDROnHDRBrightness;
-					// xwm_log.infof("G22 -> PQ");
-				}
+			// Adjust the source brightness range by the requested HDR input gain
+			dest.flBlackPointNits /= flGain;
+			dest.flWhitePointNits /= flGain;
 
-				// The final display colorimetry is used to build the output mapping, as we want a gamut-aware handling
-				// for sdrGamutWideness indepdendent of the output encoding (for SDR data), and when mapping SDR -> PQ output
-				// we only want to utilize a portion of the gamut the actual display can reproduce
-				buildSDRColorimetry( &inputColorimetry, &colorMapping, newColorMgmt.sdrGamutWideness, displayColorimetry );
+			if ( source.BIsValid() && dest.BIsValid() )
+			{
+				tonemapping.eOperator = newColorMgmt.hdrTonemapOperator;
+				tonemapping.eetf2390.init( source, newColorMgmt.hdrTonemapDisplayMetadata );
 			}
-			else if ( inputEOTF == EOTF_PQ )
+			else
 			{
-				flGain = newColorMgmt.flHDRInputGain;
-				if ( newColorMgmt.outputEncodingEOTF == EOTF_Gamma22 )
-				{
-					// PQ -> G22  Leverage the display's native brightness
-					tonemapping.g22_luminance = newColorMgmt.flInternalDisplayBrightness;
-
-					// Determine the tonemapping parameters
-					// Use the external atoms if provided
-					tonemap_info_t source = newColorMgmt.hdrTonemapSourceMetadata;
-					tonemap_info_t dest = newColorMgmt.hdrTonemapDisplayMetadata;
-					// Otherwise, rely on the Vulkan source info and the EDID
-					// TODO: If source is invalid, use the provided metadata.
-					// TODO: If hdrTonemapDisplayMetadata is invalid, use the one provided by the display
-
-					// Adjust the source brightness range by the requested HDR input gain
-					dest.flBlackPointNits /= flGain;
-					dest.flWhitePointNits /= flGain;
-
-					if ( source.BIsValid() && dest.BIsValid() )
-					{
-						tonemapping.eOperator = newColorMgmt.hdrTonemapOperator;
-						tonemapping.eetf2390.init( source, newColorMgmt.hdrTonemapDisplayMetadata );
-					}
-					else
-					{
-						tonemapping.eOperator = ETonemapOperator_None;
-					}
-					/*
-					xwm_log.infof("PQ -> 2.2  -   g22_luminance %f gain %f", tonemapping.g22_luminance, flGain );
-					xwm_log.infof("source %f %f", source.flBlackPointNits, source.flWhitePointNits );
-					xwm_log.infof("dest %f %f", dest.flBlackPointNits, dest.flWhitePointNits );
-					xwm_log.infof("operator %d", (int) tonemapping.eOperator );*/
-				}
-				else if ( newColorMgmt.outputEncodingEOTF == EOTF_PQ )
-				{
-					// PQ -> PQ passthrough (though this does apply gain)
-					// TODO: should we manipulate the output static metadata to reflect the gain factor?
-					tonemapping.g22_luminance = 1.f;
-					// xwm_log.infof("PQ -> PQ");
-				}
-
-				buildPQColorimetry( &inputColorimetry, &colorMapping, displayColorimetry );
+				tonemapping.eOperator = ETonemapOperator_None;
 			}
+			/*
+			xwm_log.infof("PQ -> 2.2  -   g22_luminance %f gain %f", tonemapping.g22_luminance, flGain );
+			xwm_log.infof("source %f %f", source.flBlackPointNits, source.flWhitePointNits );
+			xwm_log.infof("dest %f %f", dest.flBlackPointNits, dest.flWhitePointNits );
+			xwm_log.infof("operator %d", (int) tonemapping.eOperator );*/
+		}
+		else if ( newColorMgmt.outputEncodingEOTF == EOTF_PQ )
+		{
+			// PQ -> PQ passthrough (though this does apply gain)
+			// TODO: should we manipulate the output static metadata to reflect the gain factor?
+			tonemapping.g22_luminance = 1.f;
+			// xwm_log.infof("PQ -> PQ");
+		}
 
-			calcColorTransform<s_nLutEdgeSize3d>( &g_tmpLut1d, s_nLutSize1d, &g_tmpLut3d, inputColorimetry, inputEOTF,
-				outputEncodingColorimetry, newColorMgmt.outputEncodingEOTF,
-				newColorMgmt.outputVirtualWhite, newColorMgmt.chromaticAdaptationMode,
-				colorMapping, newColorMgmt.nightmode, tonemapping, pLook, flGain );
+		buildPQColorimetry( &inputColorimetry, &colorMapping, displayColorimetry );
+	}
 
-			// Create quantized output luts
-			for ( size_t i=0, end = g_tmpLut1d.dataR.size(); i<end; ++i )
-			{
-				outColorMgmtLuts[nInputEOTF].lut1d[4*i+0] = quantize_lut_value_16bit( g_tmpLut1d.dataR[i] );
-				outColorMgmtLuts[nInputEOTF].lut1d[4*i+1] = quantize_lut_value_16bit( g_tmpLut1d.dataG[i] );
-				outColorMgmtLuts[nInputEOTF].lut1d[4*i+2] = quantize_lut_value_16bit( g_tmpLut1d.dataB[i] );
-				outColorMgmtLuts[nInputEOTF].lut1d[4*i+3] = 0;
-			}
+	color_mgmt_lut_key_t &key = pParams->key;
+	key = color_mgmt_lut_key_t{};
+	key.inputColorimetry = inputColorimetry;
+	key.inputEOTF = inputEOTF;
+	key.outputEncodingColorimetry = outputEncodingColorimetry;
+	key.outputEncodingEOTF = newColorMgmt.outputEncodingEOTF;
+	key.outputVirtualWhite = newColorMgmt.outputVirtualWhite;
+	key.chromaticAdaptationMode = newColorMgmt.chromaticAdaptationMode;
+	key.colorMapping = colorMapping;
+	key.nightmode = newColorMgmt.nightmode;
+	key.flG22Luminance = tonemapping.g22_luminance;
+	key.eTonemapOperator = tonemapping.eOperator;
+	if ( tonemapping.eOperator != ETonemapOperator_None )
+	{
+		key.tonemapSource = newColorMgmt.hdrTonemapSourceMetadata;
+		key.tonemapDest = newColorMgmt.hdrTonemapDisplayMetadata;
+	}
+	key.flGain = flGain;
+	key.uLookId = get_color_mgmt_look( inputEOTF ) ? g_uColorMgmtLookIds[inputEOTF] : 0;
 
-			for ( size_t i=0, end = g_tmpLut3d.data.size(); i<end; ++i )
-			{
-				outColorMgmtLuts[nInputEOTF].lut3d[4*i+0] = quantize_lut_value_16bit( g_tmpLut3d.data[i].r );
-				outColorMgmtLuts[nInputEOTF].lut3d[4*i+1] = quantize_lut_value_16bit( g_tmpLut3d.data[i].g );
-				outColorMgmtLuts[nInputEOTF].lut3d[4*i+2] = quantize_lut_value_16bit( g_tmpLut3d.data[i].b );
-				outColorMgmtLuts[nInputEOTF].lut3d[4*i+3] = 0;
-			}
-		}
+	pParams->uHash = hash_color_mgmt_lut_key( key );
+}
+
+// Pure CPU work, safe to call off the compositor thread as long as pLook stays alive.
+static void
+generate_color_mgmt_luts( const color_mgmt_lut_params_t &params, const lut3d_t *pLook,
+	lut1d_t *pTmpLut1d, lut3d_t *pTmpLut3d, uint16_t *pOutLut1d, uint16_t *pOutLut3d )
+{
+	const color_mgmt_lut_key_t &key = params.key;
 
-		outColorMgmtLuts[nInputEOTF].bHasLut1D = true;
-		outColorMgmtLuts[nInputEOTF].bHasLut3D = true;
+	calcColorTransform<s_nLutEdgeSize3d>( pTmpLut1d, s_nLutSize1d, pTmpLut3d, key.inputColorimetry, key.inputEOTF,
+		key.outputEncodingColorimetry, key.outputEncodingEOTF,
+		key.outputVirtualWhite, key.chromaticAdaptationMode,
+		key.colorMapping, key.nightmode, params.tonemapping, pLook, key.flGain );
 
-		vulkan_update_luts(outColorMgmtLuts[nInputEOTF].vk_lut1d, outColorMgmtLuts[nInputEOTF].vk_lut3d, outColorMgmtLuts[nInputEOTF].lut1d, outColorMgmtLuts[nInputEOTF].lut3d);
+	// Create quantized output luts
+	for ( size_t i=0, end = pTmpLut1d->dataR.size(); i<end; ++i )
+	{
+		pOutLut1d[4*i+0] = quantize_lut_value_16bit( pTmpLut1d->dataR[i] );
+		pOutLut1d[4*i+1] = quantize_lut_value_16bit( pTmpLut1d->dataG[i] );
+		pOutLut1d[4*i+2] = quantize_lut_value_16bit( pTmpLut1d->dataB[i] );
+		pOutLut1d[4*i+3] = 0;
+	}
+
+	for ( size_t i=0, end = pTmpLut3d->data.size(); i<end; ++i )
+	{
+		pOutLut3d[4*i+0] = quantize_lut_value_16bit( pTmpLut3d->data[i].r );
+		pOutLut3d[4*i+1] = quantize_lut_value_16bit( pTmpLut3d->data[i].g );
+		pOutLut3d[4*i+2] = quantize_lut_value_16bit( pTmpLut3d->data[i].b );
+		pOutLut3d[4*i+3] = 0;
 	}
 }
 
+static void
+apply_cached_color_mgmt_luts( const gamescope_color_mgmt_luts &cachedLuts, gamescope_color_mgmt_luts &outLuts )
+{
+	// Cache entries are immutable once uploaded, so they can be shared by reference.
+	memcpy(outLuts.lut1d, cachedLuts.lut1d, sizeof(cachedLuts.lut1d));
+	memcpy(outLuts.lut3d, cachedLuts.lut3d, sizeof(cachedLuts.lut3d));
+	outLuts.vk_lut1d = cachedLuts.vk_lut1d;
+	outLuts.vk_lut3d = cachedLuts.vk_lut3d;
+	outLuts.bHasLut1D = true;
+	outLuts.bHasLut3D = true;
+}
+
+// Where freshly generated LUTs for params should be written:
+// a new cache entry, or with the cache disabled, straight into our own textures like we used to.
+static gamescope_color_mgmt_luts *
+alloc_generated_color_mgmt_luts( const color_mgmt_lut_params_t &params, gamescope_color_mgmt_luts &outLuts )
+{
+	cv_color_lut_cache_misses = cv_color_lut_cache_misses.Get() + 1;
+
+	gamescope_color_mgmt_luts *pLuts = alloc_cached_color_mgmt_luts( params.key, params.uHash );
+	if ( !pLuts )
+	{
+		create_unshared_color_mgmt_textures( outLuts );
+		pLuts = &outLuts;
+	}
+	return pLuts;
+}
+
+// The data pointers need to stay valid until uploads is passed to vulkan_update_luts.
+static void
+queue_generated_color_mgmt_luts_upload( gamescope_color_mgmt_luts *pGeneratedLuts, gamescope_color_mgmt_luts &outLuts,
+	void *pLut1dData, void *pLut3dData, std::vector<VulkanLutUpload_t> &uploads )
+{
+	pGeneratedLuts->bHasLut1D = true;
+	pGeneratedLuts->bHasLut3D = true;
+
+	uploads.push_back( VulkanLutUpload_t{ pGeneratedLuts->vk_lut1d, pGeneratedLuts->vk_lut3d, pLut1dData, pLut3dData } );
+
+	if ( pGeneratedLuts != &outLuts )
+		apply_cached_color_mgmt_luts( *pGeneratedLuts, outLuts );
+}
+
+static void
+upload_generated_color_mgmt_luts( gamescope_color_mgmt_luts *pGeneratedLuts, gamescope_color_mgmt_luts &outLuts )
+{
+	std::vector<VulkanLutUpload_t> uploads;
+	queue_generated_color_mgmt_luts_upload( pGeneratedLuts, outLuts, pGeneratedLuts->lut1d, pGeneratedLuts->lut3d, uploads );
+	vulkan_update_luts( uploads );
+}
+
+static void
+apply_color_mgmt_lut_override( EOTF inputEOTF, gamescope_color_mgmt_luts &outLuts )
+{
+	// Overrides are uploaded into our own textures, never into shared cache entries.
+	create_unshared_color_mgmt_textures( outLuts );
+
+	memcpy(g_ColorMgmtLuts[inputEOTF].lut1d, g_ColorMgmtLutsOverride[inputEOTF].lut1d, sizeof(g_ColorMgmtLutsOverride[inputEOTF].lut1d));
+	memcpy(g_ColorMgmtLuts[inputEOTF].lut3d, g_ColorMgmtLutsOverride[inputEOTF].lut3d, sizeof(g_ColorMgmtLutsOverride[inputEOTF].lut3d));
+
+	outLuts.bHasLut1D = true;
+	outLuts.bHasLut3D = true;
+
+	vulkan_update_luts(outLuts.vk_lut1d, outLuts.vk_lut3d, outLuts.lut1d, outLuts.lut3d);
+}
+
+// Applies the LUTs for inputEOTF if they can be had without generating anything.
+static bool
+try_apply_color_mgmt_luts_fast( const color_mgmt_lut_params_t &params, gamescope_color_mgmt_luts &outLuts )
+{
+	EOTF inputEOTF = params.key.inputEOTF;
+	if ( g_ColorMgmtLutsOverride[inputEOTF].HasLuts() )
+	{
+		apply_color_mgmt_lut_override( inputEOTF, outLuts );
+		return true;
+	}
+
+	if ( gamescope_color_mgmt_luts *pCachedLuts = find_cached_color_mgmt_luts( params.key, params.uHash ) )
+	{
+		cv_color_lut_cache_hits = cv_color_lut_cache_hits.Get() + 1;
+		apply_cached_color_mgmt_luts( *pCachedLuts, outLuts );
+		return true;
+	}
+
+	return false;
+}
+
+static void
+create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_color_mgmt_luts outColorMgmtLuts[ EOTF_Count ])
+{
+	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+	{
+		EOTF inputEOTF = static_cast<EOTF>( nInputEOTF );
+
+		color_mgmt_lut_params_t params;
+		build_color_mgmt_lut_params( newColorMgmt, inputEOTF, &params );
+
+		if ( try_apply_color_mgmt_luts_fast( params, outColorMgmtLuts[nInputEOTF] ) )
+			continue;
+
+		gamescope_color_mgmt_luts *pGeneratedLuts = alloc_generated_color_mgmt_luts( params, outColorMgmtLuts[nInputEOTF] );
+		generate_color_mgmt_luts( params, get_color_mgmt_look( inputEOTF ), &g_tmpLut1d, &g_tmpLut3d, pGeneratedLuts->lut1d, pGeneratedLuts->lut3d );
+		upload_generated_color_mgmt_luts( pGeneratedLuts, outColorMgmtLuts[nInputEOTF] );
+	}
+}
+
+///
+// Async Color Mgmt LUT generation
+//
+// Generating a new set of LUTs takes long enough to hitch a frame, eg. while
+// dragging a brightness slider. Instead, do the CPU side on a background
+// thread while we keep compositing with the old LUTs, then upload + swap
+// the new ones in on the first paint after it lands.
+//
+
+gamescope::ConVar<bool> cv_color_mgmt_async_luts{ "color_mgmt_async_luts", true, "Generate new color management LUTs on a background thread and swap them in once ready, rather than stalling the frame." };
+
+struct color_mgmt_lut_job_t
+{
+	gamescope_color_mgmt_t colorMgmt;
+
+	color_mgmt_lut_params_t params[ EOTF_Count ];
+	bool bGenerate[ EOTF_Count ] = {};
+	// Copied, so loading a new look while we are working is harmless.
+	lut3d_t looks[ EOTF_Count ];
+
+	uint16_t lut1d[ EOTF_Count ][ s_nLutSize1d * 4 ];
+	uint16_t lut3d[ EOTF_Count ][ s_nLutEdgeSize3d * s_nLutEdgeSize3d * s_nLutEdgeSize3d * 4 ];
+
+	// What was current when the job was started, the results are stale
+	// if anything else got applied since.
+	uint32_t uBaseSerial = 0;
+
+	std::atomic<bool> bDone = { false };
+	std::thread thread;
+};
+
+static std::unique_ptr<color_mgmt_lut_job_t> g_pColorMgmtLutJob;
+
+static void
+color_mgmt_lut_job_main( color_mgmt_lut_job_t *pJob )
+{
+	pthread_setname_np( pthread_self(), "gamescope-lut" );
+
+	lut1d_t tmpLut1d;
+	lut3d_t tmpLut3d;
+	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+	{
+		if ( !pJob->bGenerate[nInputEOTF] )
+			continue;
+
+		const lut3d_t *pLook = pJob->looks[nInputEOTF].lutEdgeSize > 0 ? &pJob->looks[nInputEOTF] : nullptr;
+		generate_color_mgmt_luts( pJob->params[nInputEOTF], pLook, &tmpLut1d, &tmpLut3d, pJob->lut1d[nInputEOTF], pJob->lut3d[nInputEOTF] );
+	}
+
+	pJob->bDone = true;
+	force_repaint();
+}
+
+// Returns false if everything could be applied immediately and no job was needed.
+static bool
+start_color_mgmt_lut_job( const gamescope_color_mgmt_t& newColorMgmt )
+{
+	auto pJob = std::make_unique<color_mgmt_lut_job_t>();
+	pJob->colorMgmt = newColorMgmt;
+	pJob->uBaseSerial = g_ColorMgmt.serial;
+
+	bool bNeedsJob = false;
+	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+	{
+		EOTF inputEOTF = static_cast<EOTF>( nInputEOTF );
+		build_color_mgmt_lut_params( newColorMgmt, inputEOTF, &pJob->params[nInputEOTF] );
+
+		bool bFast = g_ColorMgmtLutsOverride[inputEOTF].HasLuts() ||
+			find_cached_color_mgmt_luts( pJob->params[nInputEOTF].key, pJob->params[nInputEOTF].uHash );
+		if ( bFast )
+			continue;
+
+		pJob->bGenerate[nInputEOTF] = true;
+		if ( const lut3d_t *pLook = get_color_mgmt_look( inputEOTF ) )
+			pJob->looks[nInputEOTF] = *pLook;
+		bNeedsJob = true;
+	}
+
+	if ( !bNeedsJob )
+		return false;
+
+	color_mgmt_lut_job_t *pRawJob = pJob.get();
+	pJob->thread = std::thread( color_mgmt_lut_job_main, pRawJob );
+	g_pColorMgmtLutJob = std::move( pJob );
+	return true;
+}
+
+// Uploads and swaps in the results of a finished job.
+// Returns true if g_ColorMgmtLuts changed.
+static bool
+finish_color_mgmt_lut_job()
+{
+	if ( !g_pColorMgmtLutJob || !g_pColorMgmtLutJob->bDone )
+		return false;
+
+	std::unique_ptr<color_mgmt_lut_job_t> pJob = std::move( g_pColorMgmtLutJob );
+	pJob->thread.join();
+
+	// Color management got turned off, or other LUTs were applied
+	// synchronously while we were working. Don't clobber them, and don't
+	// pay for uploads nobody will use.
+	if ( !g_ColorMgmt.pending.enabled || g_ColorMgmt.serial != pJob->uBaseSerial )
+	{
+		xwm_log.debugf( "Dropping stale color mgmt LUT job" );
+		return false;
+	}
+
+	std::vector<VulkanLutUpload_t> uploads;
+	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+	{
+		const color_mgmt_lut_params_t &params = pJob->params[nInputEOTF];
+		gamescope_color_mgmt_luts &outLuts = g_ColorMgmtLuts[nInputEOTF];
+
+		if ( !pJob->bGenerate[nInputEOTF] )
+		{
+			// Was an override or cache hit when the job started, resolve it again now.
+			if ( try_apply_color_mgmt_luts_fast( params, outLuts ) )
+				continue;
+
+			gamescope_color_mgmt_luts *pGeneratedLuts = alloc_generated_color_mgmt_luts( params, outLuts );
+			generate_color_mgmt_luts( params, get_color_mgmt_look( params.key.inputEOTF ), &g_tmpLut1d, &g_tmpLut3d, pGeneratedLuts->lut1d, pGeneratedLuts->lut3d );
+			upload_generated_color_mgmt_luts( pGeneratedLuts, outLuts );
+			continue;
+		}
+
+		gamescope_color_mgmt_luts *pGeneratedLuts = alloc_generated_color_mgmt_luts( params, outLuts );
+		memcpy( pGeneratedLuts->lut1d, pJob->lut1d[nInputEOTF], sizeof( pGeneratedLuts->lut1d ) );
+		memcpy( pGeneratedLuts->lut3d, pJob->lut3d[nInputEOTF], sizeof( pGeneratedLuts->lut3d ) );
+		// Upload from the job rather than the cache entry, a later EOTF can evict that.
+		queue_generated_color_mgmt_luts_upload( pGeneratedLuts, outLuts, pJob->lut1d[nInputEOTF], pJob->lut3d[nInputEOTF], uploads );
+	}
+
+	// One submit and one wait for the whole set, instead of one per EOTF.
+	vulkan_update_luts( uploads );
+
+	g_ColorMgmt.current = pJob->colorMgmt;
+	return true;
+}
+
+static void
+shutdown_color_mgmt_lut_job()
+{
+	if ( g_pColorMgmtLutJob && g_pColorMgmtLutJob->thread.joinable() )
+		g_pColorMgmtLutJob->thread.join();
+	g_pColorMgmtLutJob = nullptr;
+}
+
 gamescope::ConVar<bool> cv_tearing_enabled{ "tearing_enabled", false, "Whether or not tearing is enabled." };
 int g_nSteamMaxHeight = 0;
 bool g_bVRRCapable_CachedValue = false;
@@ -388,6 +798,12 @@ update_color_mgmt()
 	g_ColorMgmt.pending.flInternalDisplayBrightness =
 		GetBackend()->GetCurrentConnector()->GetHDRInfo().uMaxContentLightLevel;
 
+	static uint32_t s_NextColorMgmtSerial = 0;
+
+	// Swap in anything our background job finished since the last paint.
+	if ( finish_color_mgmt_lut_job() )
+		g_ColorMgmt.serial = ++s_NextColorMgmtSerial;
+
 #ifdef COLOR_MGMT_MICROBENCH
 	struct timespec t0, t1;
 #else
@@ -396,6 +812,18 @@ update_color_mgmt()
 		return;
 #endif
 
+	// Keep compositing with the LUTs we have until the in-flight job lands,
+	// then pick up whatever is pending at that point.
+	if ( g_pColorMgmtLutJob && g_ColorMgmt.pending.enabled )
+		return;
+
+	// The very first set is built synchronously so we never composite without LUTs.
+	if ( cv_color_mgmt_async_luts && g_ColorMgmt.serial != 0 && g_ColorMgmt.pending.enabled )
+	{
+		if ( start_color_mgmt_lut_job( g_ColorMgmt.pending ) )
+			return;
+	}
+
 #ifdef COLOR_MGMT_MICROBENCH
 	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
 #endif
@@ -432,8 +860,6 @@ update_color_mgmt()
 	}
 #endif
 
-	static uint32_t s_NextColorMgmtSerial = 0;
-
 	g_ColorMgmt.serial = ++s_NextColorMgmtSerial;
 	g_ColorMgmt.current = g_ColorMgmt.pending;
 }
@@ -683,9 +1109,16 @@ bool set_color_shaperlut_override(const char *path)
 	return true;
 }
 
+static void
+update_color_look_id( EOTF eEOTF )
+{
+	g_uColorMgmtLookIds[eEOTF] = ++g_uColorMgmtLookGeneration;
+}
+
 bool set_color_look_pq(const char *path)
 {
 	LoadCubeLut( &g_ColorMgmtLooks[EOTF_PQ], path );
+	update_color_look_id( EOTF_PQ );
 	g_ColorMgmt.pending.externalDirtyCtr++;
 	return true;
 }
@@ -693,6 +1126,7 @@ bool set_color_look_pq(const char *path)
 bool set_color_look_g22(const char *path)
 {
 	LoadCubeLut( &g_ColorMgmtLooks[EOTF_Gamma22], path );
+	update_color_look_id( EOTF_Gamma22 );
 	g_ColorMgmt.pending.externalDirtyCtr++;
 	return true;
 }
@@ -1064,41 +1498,24 @@ static std::atomic<bool> g_bForceRepaint{false};
 
 extern int g_nCursorScaleHeight;
 
-// poor man's semaphore
-class sem
+struct stats_event_t
 {
-public:
-	void wait( void )
-	{
-		std::unique_lock<std::mutex> lock(mtx);
-
-		while(count == 0){
-			cv.wait(lock);
-		}
-		count--;
-	}
-
-	void signal( void )
-	{
-		std::unique_lock<std::mutex> lock(mtx);
-		count++;
-		cv.notify_one();
-	}
-
-private:
-	std::mutex mtx;
-	std::condition_variable cv;
-	int count = 0;
+	uint32_t uLength;
+	char szText[ 252 ];
 };
 
-sem statsThreadSem;
-std::mutex statsEventQueueLock;
-std::vector< std::string > statsEventQueue;
+// Filled by stats_printf on the compositor thread, drained by the stats thread.
+static gamescope::CSPSCRing< stats_event_t, 64 > statsEventQueue;
+// Bumped after every push (and on shutdown) for the stats thread to wait on.
+static std::atomic< uint32_t > statsEventSignal = { 0 };
+
+gamescope::ConVar<uint64_t> cv_stats_events_dropped{ "stats_events_dropped", 0, "Number of stats pipe events dropped because the stats thread fell behind. (Read-only)" };
+gamescope::ConVar<uint64_t> cv_stats_events_truncated{ "stats_events_truncated", 0, "Number of stats pipe events that were too long and got truncated. (Read-only)" };
 
 std::string statsThreadPath;
 int			statsPipeFD = -1;
 
-bool statsThreadRun;
+std::atomic< bool > statsThreadRun = { false };
 
 void statsThreadMain( void )
 {
@@ -1115,61 +1532,66 @@ void statsThreadMain( void )
 		}
 	}
 
-wait:
-	statsThreadSem.wait();
-
-	if ( statsThreadRun == false )
+	auto fnWriteEvent = []( const stats_event_t &event )
 	{
-		return;
-	}
-
-	std::string event;
+		ssize_t ret = write( statsPipeFD, event.szText, event.uLength );
+		(void) ret;
+	};
 
-retry:
+	for ( ;; )
 	{
-		std::unique_lock< std::mutex > lock( statsEventQueueLock );
+		// Grab the signal before draining, so a push that lands
+		// after we find the queue empty still wakes us up.
+		uint32_t uSignal = statsEventSignal.load();
 
-		if( statsEventQueue.empty() )
-		{
-			goto wait;
-		}
+		while ( statsEventQueue.TryPop( fnWriteEvent ) )
+			;
 
-		event = statsEventQueue[ 0 ];
-		statsEventQueue.erase( statsEventQueue.begin() );
-	}
-
-	dprintf( statsPipeFD, "%s", event.c_str() );
+		if ( !statsThreadRun )
+			return;
 
-	goto retry;
+		statsEventSignal.wait( uSignal );
+	}
 }
 
 static inline void stats_printf( const char* format, ...)
 {
-	static char buffer[256];
-	static std::string eventstr;
+	if ( !statsThreadRun )
+		return;
 
 	va_list args;
 	va_start(args, format);
-	vsprintf(buffer,format, args);
-	va_end(args);
-
-	eventstr = buffer;
 
+	bool bTruncated = false;
+	bool bPushed = statsEventQueue.TryPush( [&]( stats_event_t &event )
 	{
-		{
-			std::unique_lock< std::mutex > lock( statsEventQueueLock );
+		// va_start can't be used in the lambda, format from a copy of ours.
+		va_list argsCopy;
+		va_copy(argsCopy, args);
+		int nLength = vsnprintf( event.szText, sizeof( event.szText ), format, argsCopy );
+		va_end(argsCopy);
 
-			if( statsEventQueue.size() > 50 )
-			{
-				// overflow, drop event
-				return;
-			}
+		if ( nLength < 0 )
+			nLength = 0;
 
-			statsEventQueue.push_back( eventstr );
+		bTruncated = size_t( nLength ) >= sizeof( event.szText );
+		event.uLength = std::min< uint32_t >( uint32_t( nLength ), sizeof( event.szText ) - 1 );
+	} );
 
-			statsThreadSem.signal();
-		}
+	va_end(args);
+
+	if ( !bPushed )
+	{
+		// overflow, drop event
+		cv_stats_events_dropped = cv_stats_events_dropped.Get() + 1;
+		return;
 	}
+
+	if ( bTruncated )
+		cv_stats_events_truncated = cv_stats_events_truncated.Get() + 1;
+
+	statsEventSignal++;
+	statsEventSignal.notify_one();
 }
 
 uint64_t get_time_in_nanos()
@@ -1207,55 +1629,92 @@ bool xwayland_ctx_t::HasQueuedEvents()
 	return XEventsQueued( dpy, QueuedAlready ) != 0;
 }
 
+// Windows that aren't ours come and go, just start over past this.
+static constexpr size_t k_uMaxChildToplevelCache = 4096;
+
 static steamcompmgr_win_t *
 find_win(xwayland_ctx_t *ctx, Window id, bool find_children = true)
 {
-	steamcompmgr_win_t	*w;
-
 	if (id == None)
 	{
 		return NULL;
 	}
 
-	for (w = ctx->list; w; w = w->xwayland().next)
+	if (steamcompmgr_win_t **ppWindow = ctx->windowIndex.Find(id))
 	{
-		if (w->xwayland().id == id)
-		{
-			return w;
-		}
+		return *ppWindow;
 	}
 
 	if ( !find_children )
 		return nullptr;
 
+	{
+		std::unique_lock lock( ctx->childToplevelMutex );
+		if ( Window *pToplevel = ctx->childToplevels.Find( id ) )
+		{
+			if ( steamcompmgr_win_t **ppWindow = ctx->windowIndex.Find( *pToplevel ) )
+				return *ppWindow;
+
+			ctx->childToplevels.Erase( id );
+		}
+	}
+
 	// Didn't find, must be a children somewhere; try again with parent.
-	Window root = None;
-	Window parent = None;
-	Window *children = NULL;
-	unsigned int childrenCount;
-	XQueryTree(ctx->dpy, id, &root, &parent, &children, &childrenCount);
-	if (children)
-		XFree(children);
+	steamcompmgr_win_t *w = nullptr;
+	for (Window child = id; !w; )
+	{
+		Window root = None;
+		Window parent = None;
+		Window *children = NULL;
+		unsigned int childrenCount;
+		XQueryTree(ctx->dpy, child, &root, &parent, &children, &childrenCount);
+		if (children)
+			XFree(children);
+
+		if (root == parent || parent == None)
+		{
+			return NULL;
+		}
+
+		if (steamcompmgr_win_t **ppWindow = ctx->windowIndex.Find(parent))
+			w = *ppWindow;
+
+		child = parent;
+	}
 
-	if (root == parent || parent == None)
 	{
-		return NULL;
+		std::unique_lock lock( ctx->childToplevelMutex );
+		if ( ctx->childToplevels.Size() >= k_uMaxChildToplevelCache )
+			ctx->childToplevels.Clear();
+		ctx->childToplevels.Set( id, w->xwayland().id );
 	}
 
-	return find_win(ctx, parent);
+	return w;
 }
 
 static steamcompmgr_win_t * find_win( xwayland_ctx_t *ctx, struct wlr_surface *surf )
 {
 	steamcompmgr_win_t	*w = nullptr;
 
-	for (w = ctx->list; w; w = w->xwayland().next)
+	if ( Window *pId = ctx->surfaceWindows.Find( surf ) )
 	{
-		if ( w->xwayland().surface.main_surface == surf )
+		w = find_win( ctx, *pId, false );
+		if ( w && ( w->xwayland().surface.main_surface == surf || w->xwayland().surface.override_surface == surf ) )
 			return w;
 
-		if ( w->xwayland().surface.override_surface == surf )
+		ctx->surfaceWindows.Erase( surf );
+	}
+
+	for (w = ctx->list; w; w = w->xwayland().next)
+	{
+		if ( w->xwayland().surface.main_surface == surf || w->xwayland().surface.override_surface == surf )
+		{
+			// Surfaces that went away without us seeing it pile up, drop them now and then.
+			if ( ctx->surfaceWindows.Size() > ctx->windowIndex.Size() * 2 + 64 )
+				ctx->surfaceWindows.Clear();
+			ctx->surfaceWindows.Set( surf, w->xwayland().id );
 			return w;
+		}
 	}
 
 	return nullptr;
@@ -1274,7 +1733,8 @@ import_commit (
 	std::vector<struct wl_resource*> presentation_feedbacks,
 	std::optional<uint32_t> present_id,
 	uint64_t desired_present_time,
-	bool fifo )
+	bool fifo,
+	uint64_t commit_time )
 {
 	gamescope::Rc<commit_t> commit = new commit_t;
 
@@ -1289,6 +1749,7 @@ import_commit (
 		commit->feedback = *swapchain_feedback;
 	commit->present_id = present_id;
 	commit->desired_present_time = desired_present_time;
+	commit->commit_time = commit_time;
 
 	if ( gamescope::OwningRc<CVulkanTexture> pTexture = s_BufferMemos.LookupVulkanTexture( buf ) )
 	{
@@ -2144,6 +2605,190 @@ static void update_touch_scaling( const struct FrameInfo_t *frameInfo )
 }
 
 #if HAVE_PIPEWIRE
+gamescope::ConVar<bool> cv_pipewire_partial_capture{ "pipewire_partial_capture", true, "Only recomposite and convert the parts of a PipeWire buffer that changed since it was last rendered into." };
+
+// The NV12 conversion works on 16x16 tiles, damage is grown to whole ones.
+static constexpr int32_t k_nPipewireDamageTileSize = 16;
+// Buffers that were last rendered further back than this get redrawn in full.
+static constexpr uint64_t k_ulPipewireDamageHistory = 8;
+
+struct PipewireDamage_t
+{
+	bool bFull = false;
+	std::vector<VkRect2D> rects;
+
+	void SetFull()
+	{
+		bFull = true;
+		rects.clear();
+	}
+
+	void Add( const VkRect2D &rect )
+	{
+		if ( bFull || !rect.extent.width || !rect.extent.height )
+			return;
+
+		rects.push_back( rect );
+
+		// Past this, one bigger dispatch is cheaper than lots of small ones.
+		if ( rects.size() > k_nMaxPipewireDamageRects )
+		{
+			int32_t nX1 = INT32_MAX, nY1 = INT32_MAX, nX2 = 0, nY2 = 0;
+			for ( const VkRect2D &r : rects )
+			{
+				nX1 = std::min<int32_t>( nX1, r.offset.x );
+				nY1 = std::min<int32_t>( nY1, r.offset.y );
+				nX2 = std::max<int32_t>( nX2, r.offset.x + r.extent.width );
+				nY2 = std::max<int32_t>( nY2, r.offset.y + r.extent.height );
+			}
+			rects = { VkRect2D{ { nX1, nY1 }, { uint32_t( nX2 - nX1 ), uint32_t( nY2 - nY1 ) } } };
+		}
+	}
+
+	void Add( const PipewireDamage_t &other )
+	{
+		if ( other.bFull )
+			SetFull();
+
+		for ( const VkRect2D &rect : other.rects )
+			Add( rect );
+	}
+};
+
+// Everything about a layer of the capture that isn't covered by the window's own damage.
+struct PipewireLayerState_t
+{
+	steamcompmgr_win_t *pWindow = nullptr;
+	uint64_t ulWindowSeq = 0;
+	uint64_t ulCommitId = 0;
+	uint32_t uTexWidth = 0;
+	uint32_t uTexHeight = 0;
+	vec2_t scale = {};
+	vec2_t offset = {};
+	float flOpacity = 0.0f;
+	GamescopeUpscaleFilter eFilter{};
+	GamescopeAppTextureColorspace eColorspace{};
+	const gamescope::BackendBlob *pCtm = nullptr;
+
+	// Whether the layer is drawn the same way, other than its content.
+	bool SameComposite( const PipewireLayerState_t &other ) const
+	{
+		return ulWindowSeq == other.ulWindowSeq &&
+			uTexWidth == other.uTexWidth && uTexHeight == other.uTexHeight &&
+			scale.x == other.scale.x && scale.y == other.scale.y &&
+			offset.x == other.offset.x && offset.y == other.offset.y &&
+			flOpacity == other.flOpacity &&
+			eFilter == other.eFilter &&
+			eColorspace == other.eColorspace &&
+			pCtm == other.pCtm;
+	}
+};
+
+// Anything frame-wide that changes every pixel of the capture.
+struct PipewireColorState_t
+{
+	bool operator == ( const PipewireColorState_t & ) const = default;
+
+	uint32_t uColorMgmtSerial = 0;
+	std::array<const CVulkanTexture *, EOTF_Count> pShaperLuts{};
+	std::array<const CVulkanTexture *, EOTF_Count> pLut3Ds{};
+};
+
+// Buffer damage of w's commits after ulFromCommitId, up to and including ulToCommitId.
+// Fails if we don't remember that far back, or it isn't all relative to the same buffer size/surface.
+static bool get_window_damage_since( steamcompmgr_win_t *w, uint64_t ulFromCommitId, uint64_t ulToCommitId,
+	std::vector<wlr_box> *pOutDamage, uint32_t *puBufferWidth, uint32_t *puBufferHeight )
+{
+	const auto &history = w->commitDamageHistory;
+
+	auto iter = std::find_if( history.begin(), history.end(),
+		[&]( const steamcompmgr_win_t::CommitDamage_t &entry ) { return entry.ulCommitId == ulFromCommitId; } );
+	if ( iter == history.end() )
+		return false;
+
+	const steamcompmgr_win_t::CommitDamage_t &from = *iter;
+	for ( iter++; iter != history.end() && iter->ulCommitId <= ulToCommitId; iter++ )
+	{
+		if ( iter->pSurface != from.pSurface ||
+			 iter->uBufferWidth != from.uBufferWidth ||
+			 iter->uBufferHeight != from.uBufferHeight )
+			return false;
+
+		pOutDamage->insert( pOutDamage->end(), iter->damage.begin(), iter->damage.end() );
+	}
+
+	*puBufferWidth = from.uBufferWidth;
+	*puBufferHeight = from.uBufferHeight;
+	return true;
+}
+
+// Maps a rect of a layer's buffer to whole tiles of the capture it lands on.
+static VkRect2D pipewire_layer_damage_rect( const PipewireLayerState_t &layer, uint32_t uBufferWidth, uint32_t uBufferHeight,
+	const wlr_box &box, uint32_t uWidth, uint32_t uHeight )
+{
+	// The texture might be an upscaled copy of the buffer.
+	const float flTexScaleX = float( layer.uTexWidth ) / uBufferWidth;
+	const float flTexScaleY = float( layer.uTexHeight ) / uBufferHeight;
+
+	// Layers sample at ( coord + offset ) * scale, and filtering reaches
+	// up to a texel further out.
+	const int32_t nPad = int32_t( ceilf( 1.0f / std::min( layer.scale.x, layer.scale.y ) ) ) + 1;
+
+	int32_t nX1 = int32_t( floorf( box.x * flTexScaleX / layer.scale.x - layer.offset.x ) ) - nPad;
+	int32_t nY1 = int32_t( floorf( box.y * flTexScaleY / layer.scale.y - layer.offset.y ) ) - nPad;
+	int32_t nX2 = int32_t( ceilf( ( box.x + box.width ) * flTexScaleX / layer.scale.x - layer.offset.x ) ) + nPad;
+	int32_t nY2 = int32_t( ceilf( ( box.y + box.height ) * flTexScaleY / layer.scale.y - layer.offset.y ) ) + nPad;
+
+	nX1 = std::max<int32_t>( nX1, 0 ) / k_nPipewireDamageTileSize * k_nPipewireDamageTileSize;
+	nY1 = std::max<int32_t>( nY1, 0 ) / k_nPipewireDamageTileSize * k_nPipewireDamageTileSize;
+	nX2 = std::min<int32_t>( div_roundup( std::max<int32_t>( nX2, 0 ), k_nPipewireDamageTileSize ) * k_nPipewireDamageTileSize, uWidth );
+	nY2 = std::min<int32_t>( div_roundup( std::max<int32_t>( nY2, 0 ), k_nPipewireDamageTileSize ) * k_nPipewireDamageTileSize, uHeight );
+
+	if ( nX2 <= nX1 || nY2 <= nY1 )
+		return VkRect2D{};
+
+	return VkRect2D{ { nX1, nY1 }, { uint32_t( nX2 - nX1 ), uint32_t( nY2 - nY1 ) } };
+}
+
+// What changed on the capture since the last one.
+static PipewireDamage_t get_pipewire_frame_damage( const PipewireColorState_t &lastColorState, const PipewireColorState_t &colorState,
+	const std::vector<PipewireLayerState_t> &lastLayers, const std::vector<PipewireLayerState_t> &layers,
+	uint32_t uWidth, uint32_t uHeight )
+{
+	PipewireDamage_t damage;
+
+	if ( lastColorState != colorState || lastLayers.size() != layers.size() )
+	{
+		damage.SetFull();
+		return damage;
+	}
+
+	for ( size_t i = 0; i < layers.size(); i++ )
+	{
+		if ( !layers[i].SameComposite( lastLayers[i] ) )
+		{
+			damage.SetFull();
+			return damage;
+		}
+
+		if ( layers[i].ulCommitId == lastLayers[i].ulCommitId )
+			continue;
+
+		std::vector<wlr_box> bufferDamage;
+		uint32_t uBufferWidth = 0, uBufferHeight = 0;
+		if ( !get_window_damage_since( layers[i].pWindow, lastLayers[i].ulCommitId, layers[i].ulCommitId, &bufferDamage, &uBufferWidth, &uBufferHeight ) )
+		{
+			damage.SetFull();
+			return damage;
+		}
+
+		for ( const wlr_box &box : bufferDamage )
+			damage.Add( pipewire_layer_damage_rect( layers[i], uBufferWidth, uBufferHeight, box, uWidth, uHeight ) );
+	}
+
+	return damage;
+}
+
 static void paint_pipewire()
 {
 	static struct pipewire_buffer *s_pPipewireBuffer = nullptr;
@@ -2157,8 +2802,19 @@ static void paint_pipewire()
 	}
 
 	// Queue up a buffer with some metadata.
-	if ( !s_pPipewireBuffer )
+	while ( !s_pPipewireBuffer )
+	{
 		s_pPipewireBuffer = dequeue_pipewire_buffer();
+		if ( !s_pPipewireBuffer )
+			break;
+
+		// Went stale while it was waiting for us.
+		if ( s_pPipewireBuffer->IsStale() )
+		{
+			pipewire_destroy_buffer( s_pPipewireBuffer );
+			s_pPipewireBuffer = nullptr;
+		}
+	}
 
 	if ( !s_pPipewireBuffer || !s_pPipewireBuffer->texture )
 		return;
@@ -2239,18 +2895,86 @@ static void paint_pipewire()
 
 	// Paint the windows we have onto the Pipewire stream.
 	paint_window( pFocus->focusWindow, pFocus->focusWindow, &frameInfo, nullptr, 0, 1.0f, pFocus->overrideWindow );
+	const int nFocusLayers = frameInfo.layerCount;
 
 	if ( pFocus->overrideWindow && !pFocus->focusWindow->isSteamStreamingClient )
 		paint_window( pFocus->overrideWindow, pFocus->focusWindow, &frameInfo, nullptr, PaintWindowFlag::NoFilter, 1.0f, pFocus->overrideWindow );
 
-	gamescope::Rc<CVulkanTexture> pRGBTexture = s_pPipewireBuffer->texture->isYcbcr()
-		? vulkan_acquire_screenshot_texture( uWidth, uHeight, false, DRM_FORMAT_XRGB2101010 )
-		: gamescope::Rc<CVulkanTexture>{ s_pPipewireBuffer->texture };
+	// Work out what changed since the last capture, and from that, what the
+	// buffer we're rendering into is missing since it was last used.
+	static uint64_t s_ulPipewireFrame = 0;
+	static std::array<PipewireDamage_t, k_ulPipewireDamageHistory> s_PipewireDamageHistory;
+	static std::vector<PipewireLayerState_t> s_LastPipewireLayers;
+	static PipewireColorState_t s_LastPipewireColorState;
+
+	PipewireColorState_t colorState;
+	colorState.uColorMgmtSerial = g_ColorMgmt.serial;
+	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
+	{
+		colorState.pShaperLuts[nInputEOTF] = frameInfo.shaperLut[nInputEOTF].get();
+		colorState.pLut3Ds[nInputEOTF] = frameInfo.lut3D[nInputEOTF].get();
+	}
+
+	std::vector<PipewireLayerState_t> layers;
+	uint64_t ulNewestCommitTime = 0;
+	for ( int i = 0; i < frameInfo.layerCount; i++ )
+	{
+		const FrameInfo_t::Layer_t &layer = frameInfo.layers[i];
+		steamcompmgr_win_t *pWindow = i < nFocusLayers ? pFocus->focusWindow : pFocus->overrideWindow;
+
+		if ( commit_t *pCommit = get_window_last_done_commit_peek( pWindow ) )
+			ulNewestCommitTime = std::max( ulNewestCommitTime, pCommit->commit_time );
+
+		layers.push_back( PipewireLayerState_t
+		{
+			.pWindow = pWindow,
+			.ulWindowSeq = pWindow->seq,
+			.ulCommitId = i < nFocusLayers ? ulFocusCommitId : ulOverrideCommitId,
+			.uTexWidth = layer.tex ? layer.tex->width() : 0,
+			.uTexHeight = layer.tex ? layer.tex->height() : 0,
+			.scale = layer.scale,
+			.offset = layer.offset,
+			.flOpacity = layer.opacity,
+			.eFilter = layer.filter,
+			.eColorspace = layer.colorspace,
+			.pCtm = layer.ctm.get(),
+		} );
+	}
+
+	PipewireDamage_t frameDamage = get_pipewire_frame_damage( s_LastPipewireColorState, colorState, s_LastPipewireLayers, layers, uWidth, uHeight );
+	s_LastPipewireLayers = std::move( layers );
+	s_LastPipewireColorState = colorState;
+
+	const uint64_t ulFrame = ++s_ulPipewireFrame;
+	s_PipewireDamageHistory[ ulFrame % k_ulPipewireDamageHistory ] = frameDamage;
+
+	PipewireDamage_t renderDamage;
+	const uint64_t ulBufferFrame = s_pPipewireBuffer->damage_frame;
+	if ( !cv_pipewire_partial_capture || ulBufferFrame == 0 || ulFrame - ulBufferFrame > k_ulPipewireDamageHistory )
+	{
+		renderDamage.SetFull();
+	}
+	else
+	{
+		for ( uint64_t ulDamageFrame = ulBufferFrame + 1; ulDamageFrame <= ulFrame; ulDamageFrame++ )
+			renderDamage.Add( s_PipewireDamageHistory[ ulDamageFrame % k_ulPipewireDamageHistory ] );
+	}
+
+	s_pPipewireBuffer->full_damage = frameDamage.bFull;
+	s_pPipewireBuffer->damage = std::move( frameDamage.rects );
+
+	// Stamp it on the vblank timeline, which follows the hardware's flip timestamps.
+	const uint64_t ulCompositeTime = get_time_in_nanos();
+	s_pPipewireBuffer->vblank_time = g_SteamCompMgrVBlankTime.schedule.ulTargetVBlank ? g_SteamCompMgrVBlankTime.schedule.ulTargetVBlank : ulCompositeTime;
+	s_pPipewireBuffer->commit_time = ulNewestCommitTime;
+	s_pPipewireBuffer->composite_time = ulCompositeTime;
 
+	// NV12/P010 get composited, scaled and converted in one go.
+	gamescope::Rc<CVulkanTexture> pRGBTexture = s_pPipewireBuffer->texture->isYcbcr() ? nullptr : s_pPipewireBuffer->texture;
 	gamescope::Rc<CVulkanTexture> pYUVTexture = s_pPipewireBuffer->texture->isYcbcr() ? s_pPipewireBuffer->texture : nullptr;
 
 
-	std::optional<uint64_t> oPipewireSequence = vulkan_screenshot( &frameInfo, pRGBTexture, pYUVTexture );
+	std::optional<uint64_t> oPipewireSequence = vulkan_screenshot( &frameInfo, pRGBTexture, pYUVTexture, renderDamage.bFull ? nullptr : &renderDamage.rects );
 	// If we ever want the fat compositing path, use this.
 	//std::optional<uint64_t> oPipewireSequence = vulkan_composite( &frameInfo, s_pPipewireBuffer->texture, false, pRGBTexture, false );
 
@@ -2261,9 +2985,10 @@ static void paint_pipewire()
 
 	if ( oPipewireSequence )
 	{
-		vulkan_wait( *oPipewireSequence, true );
+		s_pPipewireBuffer->damage_frame = ulFrame;
 
-		push_pipewire_buffer( s_pPipewireBuffer );
+		// The PipeWire thread waits for the GPU, not us.
+		push_pipewire_buffer( s_pPipewireBuffer, *oPipewireSequence );
 		s_pPipewireBuffer = nullptr;
 	}
 }
@@ -2288,6 +3013,65 @@ bool ShouldDrawCursor()
 	return !pFocus->GetNestedHints();
 }
 
+gamescope::ConVar<int> cv_screenshot_png_compression{ "screenshot_png_compression", 6, "zlib compression level (0-9) for PNG screenshots. Lower is faster, higher is smaller." };
+
+// Screenshots are converted and encoded here rather than on a thread each.
+// The queue is bounded, when it is full new requests stay pending
+// until a job finishes instead of piling up threads and memory.
+static constexpr uint32_t k_nScreenshotThreads = 2;
+static constexpr uint32_t k_nMaxQueuedScreenshots = 4;
+
+static gamescope::CWorkQueue &GetScreenshotQueue()
+{
+	// Never destroyed, like the detached threads this replaces: we don't want to
+	// block exit on an encode that touches X11/wlserver state being torn down.
+	static gamescope::CWorkQueue *s_pScreenshotQueue = new gamescope::CWorkQueue( "gamescope-scrsh", k_nScreenshotThreads, k_nMaxQueuedScreenshots );
+	return *s_pScreenshotQueue;
+}
+
+// Staging buffers for converting screenshots, handed from one job to the next.
+// At most one per screenshot thread is kept, and none bigger than the cap,
+// so an 8K capture doesn't stay pinned for the life of the process.
+static constexpr size_t k_ulMaxRetainedScreenshotStaging = 64 * 1024 * 1024;
+static std::mutex g_ScreenshotStagingMutex;
+static std::vector<std::vector<uint8_t>> g_ScreenshotStaging;
+
+static std::vector<uint8_t> AcquireScreenshotStaging( size_t ulSize )
+{
+	std::vector<uint8_t> buffer;
+	{
+		std::unique_lock lock( g_ScreenshotStagingMutex );
+		if ( !g_ScreenshotStaging.empty() )
+		{
+			buffer = std::move( g_ScreenshotStaging.back() );
+			g_ScreenshotStaging.pop_back();
+		}
+	}
+	buffer.resize( ulSize );
+	return buffer;
+}
+
+static void ReleaseScreenshotStaging( std::vector<uint8_t> buffer )
+{
+	if ( buffer.capacity() > k_ulMaxRetainedScreenshotStaging )
+		return;
+
+	std::unique_lock lock( g_ScreenshotStagingMutex );
+	if ( g_ScreenshotStaging.size() < k_nScreenshotThreads )
+		g_ScreenshotStaging.emplace_back( std::move( buffer ) );
+}
+
+static gamescope::ConCommand cc_screenshot_stats( "screenshot_stats", "Print screenshot queue stats.",
+[]( std::span<std::string_view> args )
+{
+	gamescope::CWorkQueue::Stats_t stats = GetScreenshotQueue().GetStats();
+	xwm_log.infof( "Screenshots: %u queued (peak %u), %u in progress, %lu completed, %lu rejected. Avg %.2fms, max %.2fms.",
+		stats.uQueued, stats.uPeakQueued, stats.uRunning,
+		stats.ulCompleted, stats.ulRejected,
+		stats.ulCompleted ? stats.ulTotalJobNanos / double( stats.ulCompleted ) / 1'000'000.0 : 0.0,
+		stats.ulMaxJobNanos / 1'000'000.0 );
+});
+
 static void
 paint_all( global_focus_t *pFocus, bool async )
 {
@@ -2305,6 +3089,8 @@ paint_all( global_focus_t *pFocus, bool async )
 
 	update_color_mgmt();
 
+	gamescope::CSpanScope paintSpan( "paint_all" );
+
 	paintID++;
 	gpuvis_trace_begin_ctx_printf( paintID, "paint_all" );
 	steamcompmgr_win_t	*w;
@@ -2624,6 +3410,14 @@ paint_all( global_focus_t *pFocus, bool async )
 	std::optional<gamescope::GamescopeScreenshotInfo> oScreenshotInfo =
 		gamescope::CScreenshotManager::Get().ProcessPendingScreenshot();
 
+	// Don't composite a screenshot we have nowhere to put, leave the request
+	// pending and pick it up again when a screenshot job finishes.
+	if ( oScreenshotInfo && !GetScreenshotQueue().HasCapacity() )
+	{
+		gamescope::CScreenshotManager::Get().DeferScreenshot( std::move( *oScreenshotInfo ) );
+		oScreenshotInfo = std::nullopt;
+	}
+
 	if ( oScreenshotInfo )
 	{
 		std::filesystem::path path = std::filesystem::path{ oScreenshotInfo->szScreenshotPath };
@@ -2751,9 +3545,7 @@ paint_all( global_focus_t *pFocus, bool async )
 				}
 			}
 
-			std::thread screenshotThread = std::thread([=] {
-				pthread_setname_np( pthread_self(), "gamescope-scrsh" );
-
+			bool bSubmitted = GetScreenshotQueue().TrySubmit( [=]() mutable {
 				const uint8_t *mappedData = pScreenshotTexture->mappedData();
 
 				bool bScreenshotSuccess = false;
@@ -2762,7 +3554,9 @@ paint_all( global_focus_t *pFocus, bool async )
 				{
 					// Make our own copy of the image to remove the alpha channel.
 					constexpr uint32_t kCompCnt = 3;
-					auto imageData = std::vector<uint16_t>( g_nOutputWidth * g_nOutputHeight * kCompCnt );
+					std::vector<uint8_t> stagingData = AcquireScreenshotStaging( g_nOutputWidth * g_nOutputHeight * kCompCnt * sizeof( uint16_t ) );
+					defer( ReleaseScreenshotStaging( std::move( stagingData ) ) );
+					uint16_t *imageData = reinterpret_cast<uint16_t *>( stagingData.data() );
 
 					for (uint32_t y = 0; y < g_nOutputHeight; y++)
 					{
@@ -2777,6 +3571,10 @@ paint_all( global_focus_t *pFocus, bool async )
 						}
 					}
 
+					// Done with the texture, let the compositor have it back for the next capture.
+					mappedData = nullptr;
+					pScreenshotTexture = nullptr;
+
 					assert( HAVE_AVIF );
 #if HAVE_AVIF
 					avifResult avifResult = AVIF_RESULT_OK;
@@ -2810,7 +3608,7 @@ paint_all( global_focus_t *pFocus, bool async )
 					rgbAvifImage.format = AVIF_RGB_FORMAT_RGB;
 					rgbAvifImage.ignoreAlpha = AVIF_TRUE;
 
-					rgbAvifImage.pixels = (uint8_t *)imageData.data();
+					rgbAvifImage.pixels = stagingData.data();
 					rgbAvifImage.rowBytes = g_nOutputWidth * kCompCnt * sizeof( uint16_t );
 
 					if ( ( avifResult = avifImageRGBToYUV( pAvifImage, &rgbAvifImage ) ) != AVIF_RESULT_OK ) // Not really! See Matrix Coefficients IDENTITY above.
@@ -2855,22 +3653,17 @@ paint_all( global_focus_t *pFocus, bool async )
 				}
 				else if (pScreenshotTexture->format() == VK_FORMAT_B8G8R8A8_UNORM)
 				{
-					// Make our own copy of the image to remove the alpha channel.
-					auto imageData = std::vector<uint8_t>(currentOutputWidth * currentOutputHeight * 4);
+					// Make our own copy of the image to swizzle it and remove the alpha channel.
 					const uint32_t comp = 4;
 					const uint32_t pitch = currentOutputWidth * comp;
-					for (uint32_t y = 0; y < currentOutputHeight; y++)
-					{
-						for (uint32_t x = 0; x < currentOutputWidth; x++)
-						{
-							// BGR...
-							imageData[y * pitch + x * comp + 0] = mappedData[y * pScreenshotTexture->rowPitch() + x * comp + 2];
-							imageData[y * pitch + x * comp + 1] = mappedData[y * pScreenshotTexture->rowPitch() + x * comp + 1];
-							imageData[y * pitch + x * comp + 2] = mappedData[y * pScreenshotTexture->rowPitch() + x * comp + 0];
-							imageData[y * pitch + x * comp + 3] = 255;
-						}
-					}
-					if ( stbi_write_png( oScreenshotInfo->szScreenshotPath.c_str(), currentOutputWidth, currentOutputHeight, 4, imageData.data(), pitch ) )
+					std::vector<uint8_t> imageData = AcquireScreenshotStaging( pitch * currentOutputHeight );
+					defer( ReleaseScreenshotStaging( std::move( imageData ) ) );
+					gamescope::SwizzleBGRAToRGBA( mappedData, pScreenshotTexture->rowPitch(), imageData.data(), pitch, currentOutputWidth, currentOutputHeight );
+
+					mappedData = nullptr;
+					pScreenshotTexture = nullptr;
+
+					if ( gamescope::WritePNG( oScreenshotInfo->szScreenshotPath.c_str(), imageData.data(), pitch, currentOutputWidth, currentOutputHeight, cv_screenshot_png_compression ) )
 					{
 						xwm_log.infof( "Screenshot saved to %s", oScreenshotInfo->szScreenshotPath.c_str() );
 						bScreenshotSuccess = true;
@@ -2882,25 +3675,43 @@ paint_all( global_focus_t *pFocus, bool async )
 				}
 				else if (pScreenshotTexture->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM)
 				{
+					// Keep the raw NV12 around, that's what debug captures are after.
 					FILE *file = fopen( oScreenshotInfo->szScreenshotPath.c_str(), "wb" );
 					if (file)
 					{
 						fwrite(mappedData, 1, pScreenshotTexture->totalSize(), file );
 						fclose(file);
 
-						char cmd[4096];
-						sprintf(cmd, "ffmpeg -f rawvideo -pixel_format nv12 -video_size %dx%d -i %s %s_encoded.png", pScreenshotTexture->width(), pScreenshotTexture->height(), oScreenshotInfo->szScreenshotPath.c_str(), oScreenshotInfo->szScreenshotPath.c_str() );
+						const uint32_t uWidth = pScreenshotTexture->width();
+						const uint32_t uHeight = pScreenshotTexture->height();
+						const uint32_t pitch = uWidth * 4;
+						std::vector<uint8_t> imageData = AcquireScreenshotStaging( pitch * uHeight );
+						defer( ReleaseScreenshotStaging( std::move( imageData ) ) );
+
+						const EStreamColorspace eColorspace = pScreenshotTexture->streamColorspace();
+						const gamescope::YCbCrMatrix eMatrix = eColorspace == k_EStreamColorspace_BT709 || eColorspace == k_EStreamColorspace_BT709_Full
+							? gamescope::YCBCR_MATRIX_BT709
+							: gamescope::YCBCR_MATRIX_BT601;
+						const bool bFullRange = eColorspace == k_EStreamColorspace_BT601_Full || eColorspace == k_EStreamColorspace_BT709_Full;
 
-						int ret = system(cmd);
+						gamescope::ConvertNV12ToRGBA(
+							mappedData + pScreenshotTexture->lumaOffset(), pScreenshotTexture->lumaRowPitch(),
+							mappedData + pScreenshotTexture->chromaOffset(), pScreenshotTexture->chromaRowPitch(),
+							imageData.data(), pitch, uWidth, uHeight, eMatrix, bFullRange );
 
-						/* Above call may fail, ffmpeg returns 0 on success */
-						if (ret) {
-							xwm_log.infof("Ffmpeg call return status %i", ret);
-							xwm_log.errorf( "Failed to save screenshot to %s", oScreenshotInfo->szScreenshotPath.c_str() );
-						} else {
-							xwm_log.infof("Screenshot saved to %s", oScreenshotInfo->szScreenshotPath.c_str());
+						mappedData = nullptr;
+						pScreenshotTexture = nullptr;
+
+						std::string szEncodedPath = oScreenshotInfo->szScreenshotPath + "_encoded.png";
+						if ( gamescope::WritePNG( szEncodedPath.c_str(), imageData.data(), pitch, uWidth, uHeight, cv_screenshot_png_compression ) )
+						{
+							xwm_log.infof( "Screenshot saved to %s", szEncodedPath.c_str() );
 							bScreenshotSuccess = true;
 						}
+						else
+						{
+							xwm_log.errorf( "Failed to save screenshot to %s", szEncodedPath.c_str() );
+						}
 					}
 					else
 					{
@@ -2923,13 +3734,32 @@ paint_all( global_focus_t *pFocus, bool async )
 						}
 						wlserver_unlock();
 				}
+
+				// Something came in while we were busy, go take it.
+				if ( gamescope::CScreenshotManager::Get().HasPendingScreenshot() )
+					force_repaint();
 			});
 
-			screenshotThread.detach();
+			if ( !bSubmitted )
+			{
+				xwm_log.errorf( "Screenshot queue is full. Not actually writing a screenshot." );
+				if ( oScreenshotInfo->bX11PropertyRequested )
+				{
+					XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
+					XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeDebugScreenShotAtom );
+				}
+			}
+		}
+		else if ( drmCaptureFormat != DRM_FORMAT_INVALID )
+		{
+			// Every screenshot image is still being read back by a screenshot job,
+			// try again once one of them is done with it.
+			xwm_log.debugf( "Ran out of screenshot images, deferring screenshot." );
+			gamescope::CScreenshotManager::Get().DeferScreenshot( std::move( *oScreenshotInfo ) );
 		}
 		else
 		{
-			xwm_log.errorf( "Oh no, we ran out of screenshot images. Not actually writing a screenshot." );
+			xwm_log.errorf( "Unsupported screenshot format for %s. Not actually writing a screenshot.", oScreenshotInfo->szScreenshotPath.c_str() );
 			if ( oScreenshotInfo->bX11PropertyRequested )
 			{
 				XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
@@ -4090,14 +4920,14 @@ determine_and_apply_focus( global_focus_t *pFocus )
 }
 
 static void
-get_win_type(xwayland_ctx_t *ctx, steamcompmgr_win_t *w)
+get_win_type(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, gamescope::CX11PropertyBatch &props)
 {
 	w->is_dialog = !!w->xwayland().transientFor;
 
-	std::vector<unsigned int> atoms;
-	if ( get_prop( ctx, w->xwayland().id, ctx->atoms.winTypeAtom, atoms ) )
+	std::vector<uint32_t> atoms;
+	if ( props.GetCardinalList( ctx->atoms.winTypeAtom, &atoms ) )
 	{
-		for ( unsigned int atom : atoms )
+		for ( uint32_t atom : atoms )
 		{
 			if ( atom == ctx->atoms.winDialogAtom )
 			{
@@ -4112,12 +4942,12 @@ get_win_type(xwayland_ctx_t *ctx, steamcompmgr_win_t *w)
 }
 
 static void
-get_size_hints(xwayland_ctx_t *ctx, steamcompmgr_win_t *w)
+get_size_hints(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, gamescope::CX11PropertyBatch &props)
 {
 	XSizeHints hints;
 	long hintsSpecified = 0;
 
-	XGetWMNormalHints(ctx->dpy, w->xwayland().id, &hints, &hintsSpecified);
+	props.GetSizeHints(XA_WM_NORMAL_HINTS, &hints, &hintsSpecified);
 
 	const bool bHasPositionAndGravityHints = ( hintsSpecified & ( PPosition | PWinGravity ) ) == ( PPosition | PWinGravity );
 	if ( bHasPositionAndGravityHints &&
@@ -4184,19 +5014,18 @@ get_size_hints(xwayland_ctx_t *ctx, steamcompmgr_win_t *w)
 }
 
 static void
-get_win_title(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, Atom atom)
+get_win_title(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, Atom atom, gamescope::CX11PropertyBatch &props)
 {
 	assert(atom == XA_WM_NAME || atom == ctx->atoms.netWMNameAtom);
 
-	// Allocates a title we are meant to free,
-	// let's re-use this allocation for w->title :)
-	XTextProperty tp;
-	XGetTextProperty( ctx->dpy, w->xwayland().id, &tp, atom );
+	std::string title;
+	Atom encoding = None;
+	props.GetText( atom, &title, &encoding );
 
 	bool is_utf8;
-	if (tp.encoding == ctx->atoms.utf8StringAtom) {
+	if (encoding == ctx->atoms.utf8StringAtom) {
 		is_utf8 = true;
-	} else if (tp.encoding == XA_STRING) {
+	} else if (encoding == XA_STRING) {
 		is_utf8 = false;
 	} else {
 		return;
@@ -4209,9 +5038,8 @@ get_win_title(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, Atom atom)
 		return;
 	}
 
-	if (tp.nitems > 0) {
-		// Ride off the allocation from XGetTextProperty.
-		w->title = std::make_shared<std::string>((const char *)tp.value);
+	if (!title.empty()) {
+		w->title = std::make_shared<std::string>(std::move(title));
 	} else {
 		w->title = NULL;
 	}
@@ -4219,39 +5047,31 @@ get_win_title(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, Atom atom)
 }
 
 static void
-get_net_wm_state(xwayland_ctx_t *ctx, steamcompmgr_win_t *w)
+get_net_wm_state(xwayland_ctx_t *ctx, steamcompmgr_win_t *w, gamescope::CX11PropertyBatch &props)
 {
-	Atom type;
-	int format;
-	unsigned long nitems;
-	unsigned long bytesAfter;
-	unsigned char *data;
-	if (XGetWindowProperty(ctx->dpy, w->xwayland().id, ctx->atoms.netWMStateAtom, 0, 2048, false,
-			AnyPropertyType, &type, &format, &nitems, &bytesAfter, &data) != Success) {
+	std::vector<Atom> states;
+	if (!props.GetAtomList(ctx->atoms.netWMStateAtom, &states)) {
 		return;
 	}
 
-	Atom *props = (Atom *)data;
-	for (size_t i = 0; i < nitems; i++) {
-		if (props[i] == ctx->atoms.netWMStateFullscreenAtom) {
+	for (Atom state : states) {
+		if (state == ctx->atoms.netWMStateFullscreenAtom) {
 			w->isFullscreen = true;
-		} else if (props[i] == ctx->atoms.netWMStateSkipTaskbarAtom) {
+		} else if (state == ctx->atoms.netWMStateSkipTaskbarAtom) {
 			w->skipTaskbar = true;
-		} else if (props[i] == ctx->atoms.netWMStateSkipPagerAtom) {
+		} else if (state == ctx->atoms.netWMStateSkipPagerAtom) {
 			w->skipPager = true;
 		} else {
-			xwm_log.debugf("Unhandled initial NET_WM_STATE property: %s", XGetAtomName(ctx->dpy, props[i]));
+			xwm_log.debugf("Unhandled initial NET_WM_STATE property: %s", XGetAtomName(ctx->dpy, state));
 		}
 	}
-
-	XFree(data);
 }
 
 static void
-get_win_icon(xwayland_ctx_t* ctx, steamcompmgr_win_t* w)
+get_win_icon(xwayland_ctx_t* ctx, steamcompmgr_win_t* w, gamescope::CX11PropertyBatch &props)
 {
 	w->icon = std::make_shared<std::vector<uint32_t>>();
-	get_prop(ctx, w->xwayland().id, ctx->atoms.netWMIcon, *w->icon.get());
+	props.GetCardinalList(ctx->atoms.netWMIcon, w->icon.get());
 }
 
 static void
@@ -4270,24 +5090,45 @@ map_win(xwayland_ctx_t* ctx, Window id, unsigned long sequence)
 
 	XFlush(ctx->dpy);
 
+	// Send off every property read up front so mapping only waits on one round trip,
+	// the replies get picked up below as they're needed.
+	gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+	props.Request( ctx->atoms.opacityAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.steamAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.netWMNameAtom, gamescope::EX11PropertyKind::Text );
+	props.Request( XA_WM_NAME, gamescope::EX11PropertyKind::Text );
+	props.Request( ctx->atoms.netWMIcon, gamescope::EX11PropertyKind::CardinalList );
+	props.Request( ctx->atoms.steamInputFocusAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.steamStreamingClientAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.steamStreamingClientVideoAtom, gamescope::EX11PropertyKind::Cardinal );
+	if ( steamMode == true )
+		props.Request( ctx->atoms.gameAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.overlayAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( ctx->atoms.externalOverlayAtom, gamescope::EX11PropertyKind::Cardinal );
+	props.Request( XA_WM_NORMAL_HINTS, gamescope::EX11PropertyKind::SizeHints );
+	props.Request( ctx->atoms.netWMStateAtom, gamescope::EX11PropertyKind::AtomList );
+	props.Request( XA_WM_HINTS, gamescope::EX11PropertyKind::WMHints );
+	props.Request( XA_WM_TRANSIENT_FOR, gamescope::EX11PropertyKind::WindowId );
+	props.Request( ctx->atoms.winTypeAtom, gamescope::EX11PropertyKind::CardinalList );
+
 	/* This needs to be here since we don't get PropertyNotify when unmapped */
-	w->opacity = get_prop(ctx, w->xwayland().id, ctx->atoms.opacityAtom, OPAQUE);
+	w->opacity = props.GetCardinal(ctx->atoms.opacityAtom, OPAQUE);
 
-	w->isSteamLegacyBigPicture = get_prop(ctx, w->xwayland().id, ctx->atoms.steamAtom, 0);
+	w->isSteamLegacyBigPicture = props.GetCardinal(ctx->atoms.steamAtom, 0);
 
 	/* First try to read the UTF8 title prop, then fallback to the non-UTF8 one */
-	get_win_title( ctx, w, ctx->atoms.netWMNameAtom );
-	get_win_title( ctx, w, XA_WM_NAME );
-	get_win_icon( ctx, w );
+	get_win_title( ctx, w, ctx->atoms.netWMNameAtom, props );
+	get_win_title( ctx, w, XA_WM_NAME, props );
+	get_win_icon( ctx, w, props );
 
-	w->inputFocusMode = get_prop(ctx, w->xwayland().id, ctx->atoms.steamInputFocusAtom, 0);
+	w->inputFocusMode = props.GetCardinal(ctx->atoms.steamInputFocusAtom, 0);
 
-	w->isSteamStreamingClient = get_prop(ctx, w->xwayland().id, ctx->atoms.steamStreamingClientAtom, 0);
-	w->isSteamStreamingClientVideo = get_prop(ctx, w->xwayland().id, ctx->atoms.steamStreamingClientVideoAtom, 0);
+	w->isSteamStreamingClient = props.GetCardinal(ctx->atoms.steamStreamingClientAtom, 0);
+	w->isSteamStreamingClientVideo = props.GetCardinal(ctx->atoms.steamStreamingClientVideoAtom, 0);
 
 	if ( steamMode == true )
 	{
-		uint32_t appID = get_prop(ctx, w->xwayland().id, ctx->atoms.gameAtom, 0);
+		uint32_t appID = props.GetCardinal(ctx->atoms.gameAtom, 0);
 
 		if ( w->appID != 0 && appID != 0 && w->appID != appID )
 		{
@@ -4304,32 +5145,29 @@ map_win(xwayland_ctx_t* ctx, Window id, unsigned long sequence)
 		w->appID = w->xwayland().id;
 	}
 	
-	w->isOverlay = get_prop(ctx, w->xwayland().id, ctx->atoms.overlayAtom, 0);
-	w->isExternalOverlay = get_prop(ctx, w->xwayland().id, ctx->atoms.externalOverlayAtom, 0);
+	w->isOverlay = props.GetCardinal(ctx->atoms.overlayAtom, 0);
+	w->isExternalOverlay = props.GetCardinal(ctx->atoms.externalOverlayAtom, 0);
 
 	// misyl: Disable appID for overlay types, as parts of the code don't expect that focus-wise.
 	// Fixes mangoapp usage when nested, and not in SteamOS.
 	if ( w->isExternalOverlay )
 		w->appID = 0;
 
-	get_size_hints(ctx, w);
-
-	get_net_wm_state(ctx, w);
+	get_size_hints(ctx, w, props);
 
-	XWMHints *wmHints = XGetWMHints( ctx->dpy, w->xwayland().id );
+	get_net_wm_state(ctx, w, props);
 
-	if ( wmHints != nullptr )
+	XWMHints wmHints;
+	if ( props.GetWMHints( XA_WM_HINTS, &wmHints ) )
 	{
-		if ( wmHints->flags & (InputHint | StateHint ) && wmHints->input == true && wmHints->initial_state == NormalState )
+		if ( wmHints.flags & (InputHint | StateHint ) && wmHints.input == true && wmHints.initial_state == NormalState )
 		{
 			XRaiseWindow( ctx->dpy, w->xwayland().id );
 		}
-
-		XFree( wmHints );
 	}
 
 	Window transientFor = None;
-	if ( XGetTransientForHint( ctx->dpy, w->xwayland().id, &transientFor ) )
+	if ( props.GetWindow( XA_WM_TRANSIENT_FOR, &transientFor ) )
 	{
 		w->xwayland().transientFor = transientFor;
 	}
@@ -4338,7 +5176,7 @@ map_win(xwayland_ctx_t* ctx, Window id, unsigned long sequence)
 		w->xwayland().transientFor = None;
 	}
 
-	get_win_type( ctx, w );
+	get_win_type( ctx, w, props );
 
 	w->xwayland().damage_sequence = 0;
 	w->xwayland().map_sequence = sequence;
@@ -4381,113 +5219,13 @@ unmap_win(xwayland_ctx_t *ctx, Window id, bool fade)
 uint32_t
 get_appid_from_pid( pid_t pid )
 {
-	uint32_t unFoundAppId = 0;
-
-	char filename[256];
-	pid_t next_pid = pid;
-
-	while ( 1 )
-	{
-		snprintf( filename, sizeof( filename ), "/proc/%i/stat", next_pid );
-		std::ifstream proc_stat_file( filename );
-
-		if (!proc_stat_file.is_open() || proc_stat_file.bad())
-			break;
-
-		std::string proc_stat;
-
-		std::getline( proc_stat_file, proc_stat );
-
-		char *procName = nullptr;
-		char *lastParens = nullptr;
-
-		for ( uint32_t i = 0; i < proc_stat.length(); i++ )
-		{
-			if ( procName == nullptr && proc_stat[ i ] == '(' )
-			{
-				procName = &proc_stat[ i + 1 ];
-			}
-
-			if ( proc_stat[ i ] == ')' )
-			{
-				lastParens = &proc_stat[ i ];
-			}
-		}
-
-		if (!lastParens)
-			break;
-
-		*lastParens = '\0';
-		char state;
-		int parent_pid = -1;
-
-		sscanf( lastParens + 1, " %c %d", &state, &parent_pid );
-
-		if ( strcmp( "reaper", procName ) == 0 )
-		{
-			snprintf( filename, sizeof( filename ), "/proc/%i/cmdline", next_pid );
-			std::ifstream proc_cmdline_file( filename );
-			std::string proc_cmdline;
-
-			bool bSteamLaunch = false;
-			uint32_t unAppId = 0;
-
-			std::getline( proc_cmdline_file, proc_cmdline );
-
-			for ( uint32_t j = 0; j < proc_cmdline.length(); j++ )
-			{
-				if ( proc_cmdline[ j ] == '\0' && j + 1 < proc_cmdline.length() )
-				{
-					if ( strcmp( "SteamLaunch", &proc_cmdline[ j + 1 ] ) == 0 )
-					{
-						bSteamLaunch = true;
-					}
-					else if ( sscanf( &proc_cmdline[ j + 1 ], "AppId=%u", &unAppId ) == 1 && unAppId != 0 )
-					{
-						if ( bSteamLaunch == true )
-						{
-							unFoundAppId = unAppId;
-						}
-					}
-					else if ( strcmp( "--", &proc_cmdline[ j + 1 ] ) == 0 )
-					{
-						break;
-					}
-				}
-			}
-		}
-
-		if ( parent_pid == -1 || parent_pid == 0 )
-		{
-			break;
-		}
-		else
-		{
-			next_pid = parent_pid;
-		}
-	}
-
-	return unFoundAppId;
+	return gamescope::CAppIdCache::Get().GetAppIdForPid( pid );
 }
 
 static pid_t
-get_win_pid(xwayland_ctx_t *ctx, Window id)
+get_win_pid(Window id, gamescope::CX11PropertyBatch &props)
 {
-	XResClientIdSpec client_spec = {
-		.client = id,
-		.mask = XRES_CLIENT_ID_PID_MASK,
-	};
-	long num_ids = 0;
-	XResClientIdValue *client_ids = NULL;
-	XResQueryClientIds(ctx->dpy, 1, &client_spec, &num_ids, &client_ids);
-
-	pid_t pid = -1;
-	for (long i = 0; i < num_ids; i++) {
-		pid = XResGetClientPid(&client_ids[i]);
-		if (pid > 0)
-			break;
-	}
-	XResClientIdsDestroy(num_ids, client_ids);
+	pid_t pid = props.GetClientPid();
 	if (pid <= 0)
 		xwm_log.errorf("Failed to find PID for window 0x%lx", id);
 	return pid;
@@ -4532,9 +5270,16 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 	}
 	new_win->opacity = OPAQUE;
 
+	// Same as map_win, everything goes out before we wait on any of it.
+	gamescope::CX11PropertyBatch props( ctx->dpy, id );
+	if ( useXRes == true )
+		props.RequestClientPid();
+	props.Request( XA_WM_TRANSIENT_FOR, gamescope::EX11PropertyKind::WindowId );
+	props.Request( ctx->atoms.winTypeAtom, gamescope::EX11PropertyKind::CardinalList );
+
 	if ( useXRes == true )
 	{
-		new_win->pid = get_win_pid(ctx, id);
+		new_win->pid = get_win_pid(id, props);
 	}
 	else
 	{
@@ -4575,7 +5320,7 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 		new_win->appID = 0;
 
 	Window transientFor = None;
-	if ( XGetTransientForHint( ctx->dpy, id, &transientFor ) )
+	if ( props.GetWindow( XA_WM_TRANSIENT_FOR, &transientFor ) )
 	{
 		new_win->xwayland().transientFor = transientFor;
 	}
@@ -4584,7 +5329,7 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 		new_win->xwayland().transientFor = None;
 	}
 
-	get_win_type( ctx, new_win );
+	get_win_type( ctx, new_win, props );
 
 	new_win->title = NULL;
 	new_win->utf8_title = false;
@@ -4605,6 +5350,7 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 		std::unique_lock lock( ctx->list_mutex );
 		new_win->xwayland().next = *p;
 		*p = new_win;
+		ctx->windowIndex.Set( id, new_win );
 	}
 	if (new_win->xwayland().a.map_state == IsViewable)
 		map_win(ctx, id, sequence);
@@ -4737,7 +5483,28 @@ finish_destroy_win(xwayland_ctx_t *ctx, Window id, bool gone)
 			{
 				std::unique_lock lock( ctx->list_mutex );
 				*prev = w->xwayland().next;
+
+				steamcompmgr_win_t **ppIndexed = ctx->windowIndex.Find( id );
+				if ( ppIndexed && *ppIndexed == w )
+				{
+					ctx->windowIndex.Erase( id );
+
+					// In case the same XID got added twice.
+					for ( steamcompmgr_win_t *other = ctx->list; other; other = other->xwayland().next )
+					{
+						if ( other->xwayland().id == id )
+						{
+							ctx->windowIndex.Set( id, other );
+							break;
+						}
+					}
+				}
+			}
+			{
+				std::unique_lock lock( ctx->childToplevelMutex );
+				ctx->childToplevels.EraseIf( [id]( Window, Window toplevel ) { return toplevel == id; } );
 			}
+			ctx->surfaceWindows.EraseIf( [id]( struct wlr_surface *, Window window ) { return window == id; } );
 			if (w->xwayland().damage != None)
 			{
 				XDamageDestroy(ctx->dpy, w->xwayland().damage);
@@ -5178,18 +5945,13 @@ init_runtime_info()
 	update_runtime_info();
 }
 
+// wlserver_lock is held.
 static void
-steamcompmgr_flush_frame_done( steamcompmgr_win_t *w )
+steamcompmgr_flush_frame_done( steamcompmgr_win_t *w, const struct timespec &now )
 {
 	wlr_surface *current_surface = w->current_surface();
 	if ( current_surface && w->unlockedForFrameCallback && w->receivedDoneCommit )
 	{
-		// TODO: Look into making this _RAW
-		// wlroots, seems to just use normal MONOTONIC
-		// all over so this may be problematic to just change.
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-
 		wlr_surface *main_surface = w->main_surface();
 		w->unlockedForFrameCallback = false;
 		w->receivedDoneCommit = false;
@@ -5197,8 +5959,6 @@ steamcompmgr_flush_frame_done( steamcompmgr_win_t *w )
 		w->last_commit_first_latch_time = timespec_to_nanos(now);
 
 		// Acknowledge commit once.
-		wlserver_lock();
-
 		if ( main_surface != nullptr )
 		{
 			wlserver_send_frame_done(main_surface, &now);
@@ -5208,8 +5968,6 @@ steamcompmgr_flush_frame_done( steamcompmgr_win_t *w )
 		{
 			wlserver_send_frame_done(current_surface, &now);
 		}
-
-		wlserver_unlock();
 	}
 }
 
@@ -5450,7 +6208,8 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 		steamcompmgr_win_t * w = find_win(ctx, ev->window);
 		if (w)
 		{
-			get_win_type(ctx, w);
+			gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+			get_win_type(ctx, w, props);
 			MakeFocusDirty();
 		}		
 	}
@@ -5459,7 +6218,8 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 		steamcompmgr_win_t * w = find_win(ctx, ev->window);
 		if (w)
 		{
-			get_size_hints(ctx, w);
+			gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+			get_size_hints(ctx, w, props);
 			MakeFocusDirty();
 		}
 	}
@@ -5508,8 +6268,12 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 		steamcompmgr_win_t * w = find_win(ctx, ev->window);
 		if (w)
 		{
+			gamescope::CX11PropertyBatch props( ctx->dpy, ev->window );
+			props.Request( XA_WM_TRANSIENT_FOR, gamescope::EX11PropertyKind::WindowId );
+			props.Request( ctx->atoms.winTypeAtom, gamescope::EX11PropertyKind::CardinalList );
+
 			Window transientFor = None;
-			if ( XGetTransientForHint( ctx->dpy, ev->window, &transientFor ) )
+			if ( props.GetWindow( XA_WM_TRANSIENT_FOR, &transientFor ) )
 			{
 				w->xwayland().transientFor = transientFor;
 			}
@@ -5517,7 +6281,7 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 			{
 				w->xwayland().transientFor = None;
 			}
-			get_win_type( ctx, w );
+			get_win_type( ctx, w, props );
 
 			MakeFocusDirty();
 		}
@@ -5528,7 +6292,8 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 
 		if (w)
 		{
-			get_win_title(ctx, w, ev->atom);
+			gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+			get_win_title(ctx, w, ev->atom, props);
 
 			for ( auto &iter : g_VirtualConnectorFocuses )
 			{
@@ -5547,7 +6312,8 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 
 		if (w)
 		{
-			get_win_icon(ctx, w);
+			gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+			get_win_icon(ctx, w, props);
 
 			for ( auto &iter : g_VirtualConnectorFocuses )
 			{
@@ -6105,11 +6871,15 @@ steamcompmgr_exit(void)
 	for ( auto &lut : g_ColorMgmtLutsOverride ) lut.shutdown();
 	for ( auto &lut : g_ScreenshotColorMgmtLuts ) lut.shutdown();
 	for ( auto &lut : g_ScreenshotColorMgmtLutsHDR ) lut.shutdown();
+	shutdown_color_mgmt_lut_job();
+	shutdown_color_mgmt_lut_cache();
+	vulkan_save_pipeline_cache();
 
 	if ( statsThreadRun == true )
 	{
 		statsThreadRun = false;
-		statsThreadSem.signal();
+		statsEventSignal++;
+		statsEventSignal.notify_one();
 	}
 
 	{
@@ -6508,6 +7278,38 @@ void handle_presented_xdg()
 	}
 }
 
+// Frame callbacks and presentation feedback for every window, X11 and xdg alike,
+// go out together once per vblank: one wlserver_lock, one timestamp and
+// one client flush, rather than a round trip per window.
+static void steamcompmgr_dispatch_vblank_feedback()
+{
+	// TODO: Look into making this _RAW
+	// wlroots, seems to just use normal MONOTONIC
+	// all over so this may be problematic to just change.
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	wlserver_lock();
+
+	// When we have observed both a complete commit and a VBlank, we should request a new frame.
+	gamescope_xwayland_server_t *server = NULL;
+	for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
+	{
+		for (steamcompmgr_win_t *w = server->ctx->list; w; w = w->xwayland().next)
+			steamcompmgr_flush_frame_done(w, now);
+	}
+
+	for ( const auto& xdg_win : g_steamcompmgr_xdg_wins )
+		steamcompmgr_flush_frame_done(xdg_win.get(), now);
+
+	for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
+		handle_presented_xwayland( server->ctx.get() );
+
+	handle_presented_xdg();
+
+	wlserver_unlock();
+}
+
 void nudge_steamcompmgr( void )
 {
 	g_SteamCompMgrWaiter.Nudge();
@@ -6577,15 +7379,36 @@ static TempUpscaleImage_t *GetTempUpscaleImage( uint32_t uWidth, uint32_t uHeigh
 
 gamescope::ConVar<bool> cv_surface_update_force_only_current_surface( "surface_update_force_only_current_surface", false, "Force updates to apply only to the current surface, ignoring commits for other surfaces." );
 
+// Enough for a capture running at a fraction of the app's frame rate.
+static constexpr size_t k_uMaxCommitDamageHistory = 8;
+
+// Adds the damage of a dropped commit to pDamage.
+// If it was for another surface or buffer size, the boxes don't mean
+// anything in pDamage's buffer, so damage all of it instead.
+static void merge_commit_damage( steamcompmgr_win_t::CommitDamage_t *pDamage, std::optional<steamcompmgr_win_t::CommitDamage_t> oDropped )
+{
+	if ( !oDropped )
+		return;
+
+	if ( oDropped->pSurface == pDamage->pSurface &&
+		 oDropped->uBufferWidth == pDamage->uBufferWidth &&
+		 oDropped->uBufferHeight == pDamage->uBufferHeight )
+	{
+		pDamage->damage.insert( pDamage->damage.end(), oDropped->damage.begin(), oDropped->damage.end() );
+	}
+	else
+	{
+		pDamage->damage = { wlr_box{ 0, 0, int( pDamage->uBufferWidth ), int( pDamage->uBufferHeight ) } };
+	}
+}
+
 void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, ResListEntry_t& reslistentry)
 {
 	struct wlr_buffer *buf = reslistentry.buf;
 
 	if ( w == nullptr )
 	{
-		wlserver_lock();
-		wlr_buffer_unlock( buf );
-		wlserver_unlock();
+		wlserver_release_buffer_deferred( buf );
 
 		// Make sure to send the discarded event if we hit this
 		// to ensure forward progress.
@@ -6626,9 +7449,7 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 
 	if ( bOnlyCurrentSurface && !for_current_surface )
 	{
-		wlserver_lock();
-		wlr_buffer_unlock( buf );
-		wlserver_unlock();
+		wlserver_release_buffer_deferred( buf );
 
 		// Don't mark as recieve done commit, it was for the wrong surface.
 		return;
@@ -6643,9 +7464,19 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 
 	if ( already_exists && !reslistentry.feedback && reslistentry.presentation_feedbacks.empty() )
 	{
-		wlserver_lock();
-		wlr_buffer_unlock( buf );
-		wlserver_unlock();
+		// The client may have drawn into the buffer again, so hold on to the
+		// damage for captures working out what changed.
+		steamcompmgr_win_t::CommitDamage_t droppedDamage
+		{
+			.pSurface = reslistentry.surf,
+			.uBufferWidth = uint32_t( buf->width ),
+			.uBufferHeight = uint32_t( buf->height ),
+			.damage = std::move( reslistentry.damage ),
+		};
+		merge_commit_damage( &droppedDamage, std::move( w->droppedCommitDamage ) );
+		w->droppedCommitDamage = std::move( droppedDamage );
+
+		wlserver_release_buffer_deferred( buf );
 		xwm_log.warnf( "got the same buffer committed twice, ignoring." );
 
 		// If we have a duplicated commit + frame callback, ensure that is signalled.
@@ -6664,7 +7495,8 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 		std::move(reslistentry.presentation_feedbacks),
 		reslistentry.present_id,
 		reslistentry.desired_present_time,
-		reslistentry.fifo );
+		reslistentry.fifo,
+		reslistentry.commit_time );
 
 	int fence = -1;
 	if ( newCommit != nullptr )
@@ -6783,6 +7615,21 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 				g_ImageWaiter.AddWaitable( newCommit.get() );
 		}
 
+		steamcompmgr_win_t::CommitDamage_t commitDamage
+		{
+			.ulCommitId = newCommit->commitID,
+			.pSurface = reslistentry.surf,
+			.uBufferWidth = uint32_t( buf->width ),
+			.uBufferHeight = uint32_t( buf->height ),
+			.damage = std::move( reslistentry.damage ),
+		};
+		merge_commit_damage( &commitDamage, std::move( w->droppedCommitDamage ) );
+		w->droppedCommitDamage = std::nullopt;
+
+		w->commitDamageHistory.push_back( std::move( commitDamage ) );
+		if ( w->commitDamageHistory.size() > k_uMaxCommitDamageHistory )
+			w->commitDamageHistory.pop_front();
+
 		w->commit_queue.push_back( std::move(newCommit) );
 	}
 }
@@ -6915,6 +7762,11 @@ void xwayland_ctx_t::Dispatch()
 				break;
 			}
 			case ReparentNotify:
+				{
+					std::unique_lock lock( ctx->childToplevelMutex );
+					ctx->childToplevels.Clear();
+				}
+
 				if (ev.xreparent.parent == ctx->root)
 					add_win(ctx, ev.xreparent.window, 0, ev.xreparent.serial);
 				else
@@ -6932,7 +7784,8 @@ void xwayland_ctx_t::Dispatch()
 						w = find_win(ctx, ev.xreparent.parent);
 						if (w)
 						{
-							get_size_hints(ctx, w);
+							gamescope::CX11PropertyBatch props( ctx->dpy, w->xwayland().id );
+							get_size_hints(ctx, w, props);
 							MakeFocusDirty();
 						}
 					}
@@ -7473,17 +8326,6 @@ void steamcompmgr_check_xdg(bool vblank, uint64_t vblank_idx)
 
 	handle_done_commits_xdg( vblank, vblank_idx );
 
-	// When we have observed both a complete commit and a VBlank, we should request a new frame.
-	if (vblank)
-	{
-		for ( const auto& xdg_win : g_steamcompmgr_xdg_wins )
-		{
-			steamcompmgr_flush_frame_done(xdg_win.get());
-		}
-
-		handle_presented_xdg();
-	}
-
 	check_new_xdg_res();
 }
 
@@ -7623,6 +8465,38 @@ static gamescope::CTimerFunction g_FPSLimitVRRTimer{ []
 	// do nothing.
 }};
 
+static gamescope::ConVar<uint32_t> cv_trace_loop_budget_us( "trace_loop_budget_us", 0, "Log which stages ran when a main loop iteration spends longer than this working (not waiting). Needs trace_spans. 0 to disable." );
+
+static void steamcompmgr_check_loop_budget( uint64_t ulIterationBegin, uint64_t ulWorkNanos )
+{
+	const uint64_t ulBudgetNanos = uint64_t( cv_trace_loop_budget_us ) * 1'000ul;
+	if ( !ulBudgetNanos || ulWorkNanos <= ulBudgetNanos )
+		return;
+
+	// Don't flood the log when everything is slow.
+	static uint64_t s_ulLastReport = 0;
+	static uint32_t s_uOverruns = 0;
+	s_uOverruns++;
+
+	const uint64_t ulNow = get_time_in_nanos();
+	if ( ulNow - s_ulLastReport < 1'000'000'000ul )
+		return;
+
+	std::string sBreakdown;
+	for ( const auto &span : gamescope::CSpanProfiler::Get().Snapshot( ulIterationBegin, gamescope::CSpanProfiler::CurrentThreadId() ) )
+	{
+		char szSpan[128];
+		snprintf( szSpan, sizeof( szSpan ), "%s%s %.2fms", sBreakdown.empty() ? "" : ", ", span.pszName, ( span.ulEndNanos - span.ulBeginNanos ) / 1'000'000.0 );
+		sBreakdown += szSpan;
+	}
+
+	xwm_log.infof( "Main loop took %.2fms, over the %.2fms budget (%u times since last report): %s",
+		ulWorkNanos / 1'000'000.0, ulBudgetNanos / 1'000'000.0, s_uOverruns, sBreakdown.c_str() );
+
+	s_ulLastReport = ulNow;
+	s_uOverruns = 0;
+}
+
 void
 steamcompmgr_main(int argc, char **argv)
 {
@@ -7808,7 +8682,11 @@ steamcompmgr_main(int argc, char **argv)
 
 	for (;;)
 	{
+		gamescope::CSpanScope iterationSpan( "steamcompmgr_iteration" );
+		uint64_t ulWaitNanos = 0;
+
 		{
+			gamescope::CSpanScope span( "x11_dispatch" );
 			gamescope_xwayland_server_t *server = NULL;
 			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 			{
@@ -7818,7 +8696,11 @@ steamcompmgr_main(int argc, char **argv)
 			}
 		}
 
-		g_SteamCompMgrWaiter.PollEvents();
+		{
+			gamescope::CSpanScope span( "wait" );
+			g_SteamCompMgrWaiter.PollEvents();
+			ulWaitNanos = span.End();
+		}
 
 		bool vblank = false;
 		if ( std::optional<gamescope::VBlankTime> pendingVBlank = GetVBlankTimer().ProcessVBlank() )
@@ -7890,6 +8772,8 @@ steamcompmgr_main(int argc, char **argv)
 		// XXX: Need to look into why this doesn't work.
 		//	if ( bDirtyFocuses )
 		{
+			gamescope::CSpanScope span( "virtual_connector_focus" );
+
 			// TODO(misyl): Improve this situation, it's kind of a mess.
 			// We could/should make this event driven rather than solving
 			// per-frame.
@@ -8027,6 +8911,7 @@ steamcompmgr_main(int argc, char **argv)
 		if ( vblank )
 		{
 			{
+				gamescope::CSpanScope span( "latch_frame_done" );
 				uint64_t now = get_time_in_nanos();
 
 				gamescope_xwayland_server_t *server = NULL;
@@ -8046,23 +8931,15 @@ steamcompmgr_main(int argc, char **argv)
 		}
 
 		{
+			gamescope::CSpanScope span( "done_commits" );
 			gamescope_xwayland_server_t *server = NULL;
 			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 			{
 				handle_done_commits_xwayland(server->ctx.get(), vblank, vblank_idx);
-
-				// When we have observed both a complete commit and a VBlank, we should request a new frame.
-				if (vblank)
-				{
-					for (steamcompmgr_win_t *w = server->ctx->list; w; w = w->xwayland().next)
-					{
-						steamcompmgr_flush_frame_done(w);
-					}
-				}
 			}
-		}
 
-		steamcompmgr_check_xdg(vblank, vblank_idx);
+			steamcompmgr_check_xdg(vblank, vblank_idx);
+		}
 
 		if ( s_oLowestFPSLimitScheduleVRR )
 		{
@@ -8118,16 +8995,14 @@ steamcompmgr_main(int argc, char **argv)
 
 		if ( vblank )
 		{
-			wlserver_lock();
-			gamescope_xwayland_server_t *server = NULL;
-			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
-				handle_presented_xwayland( server->ctx.get() );
-			wlserver_unlock();
+			gamescope::CSpanScope span( "vblank_feedback" );
+			steamcompmgr_dispatch_vblank_feedback();
 		}
 
 		//
 
 		{
+			gamescope::CSpanScope span( "new_xwayland_res" );
 			gamescope_xwayland_server_t *server = NULL;
 			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 				check_new_xwayland_res(server->ctx.get());
@@ -8182,11 +9057,14 @@ steamcompmgr_main(int argc, char **argv)
 		// Handles if we got a commit for the window we want to focus
 		// to switch to it for painting (outdatedInteractiveFocus)
 		// Doesn't realllly matter but avoids an extra frame of being on the wrong window.
-		for ( auto &iter : g_VirtualConnectorFocuses )
 		{
-			global_focus_t *pFocus = &iter.second;
-			if ( pFocus->IsDirty() )
-				determine_and_apply_focus( pFocus );
+			gamescope::CSpanScope span( "focus" );
+			for ( auto &iter : g_VirtualConnectorFocuses )
+			{
+				global_focus_t *pFocus = &iter.second;
+				if ( pFocus->IsDirty() )
+					determine_and_apply_focus( pFocus );
+			}
 		}
 
 		// XXX(misyl): This is bad! We shouldnt change the upscaler like this at all!!!
@@ -8384,7 +9262,10 @@ steamcompmgr_main(int argc, char **argv)
 
 #if HAVE_PIPEWIRE
 			if ( pipewire_is_streaming() )
+			{
+				gamescope::CSpanScope span( "paint_pipewire" );
 				paint_pipewire();
+			}
 #endif
 		}
 
@@ -8406,9 +9287,18 @@ steamcompmgr_main(int argc, char **argv)
 			XFlush(root_ctx->dpy);
 		}
 
-		vulkan_garbage_collect();
+		{
+			gamescope::CSpanScope span( "garbage_collect" );
+			vulkan_garbage_collect();
+		}
 
 		vblank = false;
+
+		if ( iterationSpan.IsRecording() )
+		{
+			const uint64_t ulIterationBegin = iterationSpan.GetBeginNanos();
+			steamcompmgr_check_loop_budget( ulIterationBegin, iterationSpan.End() - ulWaitNanos );
+		}
 	}
 
 	steamcompmgr_exit();
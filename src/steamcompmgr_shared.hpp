@@ -3,6 +3,9 @@
 #include <variant>
 #include <string>
 #include <utility>
+#include <deque>
+#include <optional>
+#include <vector>
 
 #include <wlr/util/box.h>
 
@@ -151,6 +154,21 @@ struct steamcompmgr_win_t {
 	std::shared_ptr<std::string> engineName;
 
 	std::vector< gamescope::Rc<commit_t> > commit_queue;
+
+	struct CommitDamage_t
+	{
+		uint64_t ulCommitId = 0;
+		struct wlr_surface *pSurface = nullptr;
+		uint32_t uBufferWidth = 0;
+		uint32_t uBufferHeight = 0;
+		std::vector<wlr_box> damage;
+	};
+	// Buffer damage of the last few commits, oldest first, so a capture that
+	// missed some in between can still work out what changed since it last looked.
+	std::deque<CommitDamage_t> commitDamageHistory;
+	// Damage from commits we dropped (eg. the same buffer committed twice),
+	// folded into the next commit that makes it into the history.
+	std::optional<CommitDamage_t> droppedCommitDamage;
 	std::shared_ptr<std::vector< uint32_t >> icon;
 
 	steamcompmgr_win_type_t		type;
@@ -275,6 +293,21 @@ namespace gamescope
 			return std::exchange( m_ScreenshotInfo, std::nullopt );
 		}
 
+		// Puts a screenshot we couldn't take yet back,
+		// unless a newer request came in meanwhile.
+		void DeferScreenshot( GamescopeScreenshotInfo info )
+		{
+			std::unique_lock lock{ m_ScreenshotInfoMutex };
+			if ( !m_ScreenshotInfo )
+				m_ScreenshotInfo = std::move( info );
+		}
+
+		bool HasPendingScreenshot()
+		{
+			std::unique_lock lock{ m_ScreenshotInfoMutex };
+			return m_ScreenshotInfo.has_value();
+		}
+
 		static CScreenshotManager &Get();
 	private:
 		std::mutex m_ScreenshotInfoMutex;
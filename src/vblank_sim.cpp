@@ -0,0 +1,347 @@
+// Offline frame-pacing simulator for the vblank scheduling math.
+//
+// Replays draw-time traces through CVBlankScheduler with a simulated clock
+// and reports missed vblanks, latency-to-scanout and wake-up jitter
+// (how much the actual wake-up moves around relative to the targeted vblank)
+// for a set of tunings.
+//
+// Trace format: one frame per line, '#' starts a comment.
+//   <draw time ns> [compositing 0/1] [wake-up delay ns]
+// The draw time is from wake-up to commit, the wake-up delay is how late
+// the timer fired (scheduler quantum).
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "vblankscheduler.hpp"
+#include "refresh_rate.h"
+
+using namespace gamescope;
+
+struct SimFrame_t
+{
+    uint64_t ulDrawTime;
+    bool bCompositing;
+    uint64_t ulWakeupDelay;
+};
+
+struct SimTrace_t
+{
+    std::string sName;
+    std::vector<SimFrame_t> frames;
+};
+
+struct SimTuning_t
+{
+    std::string sName;
+    VBlankTuning tuning;
+};
+
+struct SimResult_t
+{
+    uint64_t ulFrames = 0;
+    uint64_t ulMissed = 0;
+    double flAvgLatencyMs = 0.0;
+    double flWakeJitterMs = 0.0;
+    double flNsPerSchedule = 0.0;
+};
+
+static bool LoadTrace( const char *pszPath, SimTrace_t *pOutTrace )
+{
+    FILE *pFile = fopen( pszPath, "r" );
+    if ( !pFile )
+    {
+        fprintf( stderr, "Failed to open trace %s: %s\n", pszPath, strerror( errno ) );
+        return false;
+    }
+
+    pOutTrace->sName = pszPath;
+
+    char szLine[256];
+    while ( fgets( szLine, sizeof( szLine ), pFile ) )
+    {
+        char *pszComment = strchr( szLine, '#' );
+        if ( pszComment )
+            *pszComment = '\0';
+
+        unsigned long long ulDrawTime = 0;
+        int nCompositing = 0;
+        unsigned long long ulWakeupDelay = 0;
+        if ( sscanf( szLine, "%llu %d %llu", &ulDrawTime, &nCompositing, &ulWakeupDelay ) < 1 )
+            continue;
+
+        pOutTrace->frames.push_back( SimFrame_t{ ulDrawTime, nCompositing != 0, ulWakeupDelay } );
+    }
+
+    fclose( pFile );
+    return !pOutTrace->frames.empty();
+}
+
+// Small deterministic LCG so the synthetic traces are identical run to run.
+struct SimRandom_t
+{
+    uint64_t ulState = 0x9e3779b97f4a7c15ull;
+
+    uint64_t Next()
+    {
+        ulState = ulState * 6364136223846793005ull + 1442695040888963407ull;
+        return ulState >> 33;
+    }
+
+    // [ulMin, ulMax]
+    uint64_t Range( uint64_t ulMin, uint64_t ulMax )
+    {
+        return ulMin + Next() % ( ulMax - ulMin + 1 );
+    }
+};
+
+static std::vector<SimTrace_t> MakeSyntheticTraces( uint32_t uFrameCount )
+{
+    std::vector<SimTrace_t> traces;
+    SimRandom_t random;
+
+    SimTrace_t steady{ "synthetic: steady 1.5ms", {} };
+    for ( uint32_t i = 0; i < uFrameCount; i++ )
+        steady.frames.push_back( SimFrame_t{ random.Range( 1'300'000, 1'700'000 ), false, random.Range( 0, 50'000 ) } );
+    traces.emplace_back( std::move( steady ) );
+
+    SimTrace_t compositing{ "synthetic: compositing 3ms", {} };
+    for ( uint32_t i = 0; i < uFrameCount; i++ )
+        compositing.frames.push_back( SimFrame_t{ random.Range( 2'500'000, 3'500'000 ), true, random.Range( 0, 50'000 ) } );
+    traces.emplace_back( std::move( compositing ) );
+
+    SimTrace_t spiky{ "synthetic: 1.5ms with 1% 6ms spikes", {} };
+    for ( uint32_t i = 0; i < uFrameCount; i++ )
+    {
+        uint64_t ulDrawTime = random.Range( 0, 99 ) == 0 ? random.Range( 5'000'000, 7'000'000 ) : random.Range( 1'300'000, 1'700'000 );
+        spiky.frames.push_back( SimFrame_t{ ulDrawTime, false, random.Range( 0, 50'000 ) } );
+    }
+    traces.emplace_back( std::move( spiky ) );
+
+    SimTrace_t phases{ "synthetic: direct scanout <-> compositing phases", {} };
+    for ( uint32_t i = 0; i < uFrameCount; i++ )
+    {
+        bool bCompositing = ( i / 500 ) % 2 == 1;
+        uint64_t ulDrawTime = bCompositing ? random.Range( 2'500'000, 4'000'000 ) : random.Range( 800'000, 1'200'000 );
+        phases.frames.push_back( SimFrame_t{ ulDrawTime, bCompositing, random.Range( 0, 200'000 ) } );
+    }
+    traces.emplace_back( std::move( phases ) );
+
+    return traces;
+}
+
+static std::vector<SimTuning_t> MakeTunings()
+{
+    std::vector<SimTuning_t> tunings;
+
+    tunings.push_back( SimTuning_t{ "default", VBlankTuning{} } );
+
+    SimTuning_t smallRedZone{ "redzone 1.0ms", {} };
+    smallRedZone.tuning.ulVBlankDrawBufferRedZone = 1'000'000;
+    tunings.push_back( smallRedZone );
+
+    SimTuning_t largeRedZone{ "redzone 2.5ms", {} };
+    largeRedZone.tuning.ulVBlankDrawBufferRedZone = 2'500'000;
+    tunings.push_back( largeRedZone );
+
+    SimTuning_t fastDecay{ "decay 93%", {} };
+    fastDecay.tuning.ulVBlankRateOfDecayPercentage = 930;
+    tunings.push_back( fastDecay );
+
+    SimTuning_t slowDecay{ "decay 99.5%", {} };
+    slowDecay.tuning.ulVBlankRateOfDecayPercentage = 995;
+    tunings.push_back( slowDecay );
+
+    SimTuning_t lowCompositingMin{ "min compositing 1.5ms", {} };
+    lowCompositingMin.tuning.ulVBlankDrawTimeMinCompositing = 1'500'000;
+    tunings.push_back( lowCompositingMin );
+
+    SimTuning_t p99{ "percentile p99", {} };
+    p99.tuning.ePredictor = VBlankPredictor::Percentile;
+    tunings.push_back( p99 );
+
+    SimTuning_t p95{ "percentile p95", {} };
+    p95.tuning.ePredictor = VBlankPredictor::Percentile;
+    p95.tuning.ulVBlankDrawTimePercentile = 950;
+    tunings.push_back( p95 );
+
+    return tunings;
+}
+
+static SimResult_t Simulate( const SimTrace_t &trace, const SimTuning_t &tuning, int32_t nRefreshmHz, bool bInternalScreen )
+{
+    CVBlankScheduler scheduler;
+    scheduler.Tuning() = tuning.tuning;
+
+    const uint64_t ulInterval = mHzToRefreshCycle( nRefreshmHz );
+
+    // Start a few cycles in so nothing underflows.
+    uint64_t ulNow = ulInterval * 4;
+    uint64_t ulLastVBlank = ulNow;
+    uint64_t ulLastDrawTime = CVBlankScheduler::kStartingVBlankDrawTime;
+
+    SimResult_t result;
+    double flTotalLatency = 0.0;
+    double flOffsetSum = 0.0;
+    double flOffsetSqSum = 0.0;
+    uint64_t ulScheduleNanos = 0;
+
+    for ( const SimFrame_t &frame : trace.frames )
+    {
+        VBlankScheduleInput input =
+        {
+            .ulNow = ulNow,
+            .ulLastVBlank = ulLastVBlank,
+            .nRefreshmHz = nRefreshmHz,
+            .bInternalScreen = bInternalScreen,
+            .bVRR = false,
+            .bCompositing = frame.bCompositing,
+            .ulLastDrawTime = ulLastDrawTime,
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        VBlankScheduleTime schedule = scheduler.CalcNextWakeupTime( input, false );
+        ulScheduleNanos += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+
+        const uint64_t ulWakeup = schedule.ulScheduledWakeupPoint + frame.ulWakeupDelay;
+        const uint64_t ulCommit = ulWakeup + frame.ulDrawTime;
+
+        // The commit lands on the first vblank after it.
+        uint64_t ulScanout = schedule.ulTargetVBlank;
+        while ( ulScanout < ulCommit )
+            ulScanout += ulInterval;
+
+        if ( ulScanout > schedule.ulTargetVBlank )
+            result.ulMissed++;
+
+        flTotalLatency += double( ulScanout - ulWakeup );
+
+        // Where we actually woke up relative to the vblank we were aiming for,
+        // late timers included. Can go negative if the timer fired past it.
+        const double flOffset = double( schedule.ulTargetVBlank ) - double( ulWakeup );
+        flOffsetSum += flOffset;
+        flOffsetSqSum += flOffset * flOffset;
+
+        // Same feedback as the real thing: draw time is measured from
+        // the scheduled wake-up and the vblank comes from the page flip.
+        ulLastDrawTime = ulCommit - schedule.ulScheduledWakeupPoint;
+        scheduler.AddDrawTimeSample( ulLastDrawTime, frame.bCompositing );
+        ulLastVBlank = ulScanout;
+        ulNow = ulScanout;
+
+        result.ulFrames++;
+    }
+
+    if ( result.ulFrames )
+    {
+        const double flFrames = double( result.ulFrames );
+        const double flMeanOffset = flOffsetSum / flFrames;
+
+        result.flAvgLatencyMs = flTotalLatency / flFrames / 1'000'000.0;
+        result.flWakeJitterMs = std::sqrt( std::max( flOffsetSqSum / flFrames - flMeanOffset * flMeanOffset, 0.0 ) ) / 1'000'000.0;
+        result.flNsPerSchedule = double( ulScheduleNanos ) / flFrames;
+    }
+
+    return result;
+}
+
+static void PrintUsage( const char *pszArgv0 )
+{
+    fprintf( stderr,
+        "usage: %s [options] [trace files...]\n"
+        "  --refresh HZ           refresh rate to simulate (default 60)\n"
+        "  --external             simulate an external screen (scaled redzone)\n"
+        "  --frames N             frames per synthetic trace (default 10000)\n"
+        "  --redzone NS           add a custom tuning with this redzone\n"
+        "  --decay PERMILLE       ...and this rate of decay (eg. 980)\n"
+        "  --min-compositing NS   ...and this minimum compositing draw time\n"
+        "  --percentile PERMILLE  ...using the percentile predictor (eg. 990)\n"
+        "With no trace files, a set of synthetic traces is used.\n",
+        pszArgv0 );
+}
+
+int main( int argc, char **argv )
+{
+    int32_t nRefreshmHz = ConvertHztomHz( 60 );
+    bool bInternalScreen = true;
+    uint32_t uSyntheticFrames = 10'000;
+
+    bool bCustomTuning = false;
+    SimTuning_t customTuning{ "custom", {} };
+
+    std::vector<SimTrace_t> traces;
+
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *pszArg = argv[i];
+        const bool bHasValue = i + 1 < argc;
+
+        if ( !strcmp( pszArg, "--refresh" ) && bHasValue )
+            nRefreshmHz = ConvertHztomHz( float( atof( argv[++i] ) ) );
+        else if ( !strcmp( pszArg, "--external" ) )
+            bInternalScreen = false;
+        else if ( !strcmp( pszArg, "--frames" ) && bHasValue )
+            uSyntheticFrames = uint32_t( atoi( argv[++i] ) );
+        else if ( !strcmp( pszArg, "--redzone" ) && bHasValue )
+            bCustomTuning = true, customTuning.tuning.ulVBlankDrawBufferRedZone = strtoull( argv[++i], nullptr, 10 );
+        else if ( !strcmp( pszArg, "--decay" ) && bHasValue )
+            bCustomTuning = true, customTuning.tuning.ulVBlankRateOfDecayPercentage = strtoull( argv[++i], nullptr, 10 );
+        else if ( !strcmp( pszArg, "--min-compositing" ) && bHasValue )
+            bCustomTuning = true, customTuning.tuning.ulVBlankDrawTimeMinCompositing = strtoull( argv[++i], nullptr, 10 );
+        else if ( !strcmp( pszArg, "--percentile" ) && bHasValue )
+        {
+            bCustomTuning = true;
+            customTuning.tuning.ePredictor = VBlankPredictor::Percentile;
+            customTuning.tuning.ulVBlankDrawTimePercentile = strtoull( argv[++i], nullptr, 10 );
+        }
+        else if ( pszArg[0] == '-' )
+        {
+            PrintUsage( argv[0] );
+            return 1;
+        }
+        else
+        {
+            SimTrace_t trace;
+            if ( !LoadTrace( pszArg, &trace ) )
+                return 1;
+            traces.emplace_back( std::move( trace ) );
+        }
+    }
+
+    if ( traces.empty() )
+        traces = MakeSyntheticTraces( uSyntheticFrames );
+
+    std::vector<SimTuning_t> tunings = MakeTunings();
+    if ( bCustomTuning )
+        tunings.push_back( customTuning );
+
+    printf( "Simulating %.3fHz, %s screen\n", ConvertmHzToHz( float( nRefreshmHz ) ), bInternalScreen ? "internal" : "external" );
+
+    for ( const SimTrace_t &trace : traces )
+    {
+        printf( "\n%s (%zu frames)\n", trace.sName.c_str(), trace.frames.size() );
+        printf( "  %-24s %10s %9s %14s %17s %12s\n", "tuning", "missed", "missed%", "latency (ms)", "wake jitter (ms)", "ns/schedule" );
+
+        for ( const SimTuning_t &tuning : tunings )
+        {
+            SimResult_t result = Simulate( trace, tuning, nRefreshmHz, bInternalScreen );
+            printf( "  %-24s %10llu %8.2f%% %14.3f %17.3f %12.1f\n",
+                tuning.sName.c_str(),
+                (unsigned long long)result.ulMissed,
+                result.ulFrames ? 100.0 * result.ulMissed / result.ulFrames : 0.0,
+                result.flAvgLatencyMs,
+                result.flWakeJitterMs,
+                result.flNsPerSchedule );
+        }
+    }
+
+    return 0;
+}
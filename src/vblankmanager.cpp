@@ -24,6 +24,8 @@ LogScope g_VBlankLog("vblank");
 namespace gamescope
 {
 	ConVar<bool> vblank_debug( "vblank_debug", false, "Enable vblank debug spew to stderr." );
+	ConVar<uint32_t> cv_vblank_predictor( "vblank_predictor", 0, "How to predict the next draw time when scheduling vblank wake-ups. 0 = Decaying peak of recent draw times. 1 = Percentile of recent draw times, tracked separately for composited and direct scanout frames." );
+	ConVar<uint32_t> cv_vblank_predictor_percentile( "vblank_predictor_percentile", VBlankTuning::kDefaultVBlankDrawTimePercentile, "Per-mille percentile of recent draw times to target with vblank_predictor 1. eg. 990 = p99." );
 
 	CVBlankTimer::CVBlankTimer()
 	{
@@ -83,107 +85,37 @@ namespace gamescope
 	uint64_t CVBlankTimer::GetNextVBlank( uint64_t ulOffset ) const
 	{
 		const uint64_t ulIntervalNSecs = mHzToRefreshCycle( GetRefresh() );
-		const uint64_t ulNow = get_time_in_nanos();
 
-		uint64_t ulTargetPoint = GetLastVBlank() + ulIntervalNSecs - ulOffset;
-
-		while ( ulTargetPoint < ulNow )
-			ulTargetPoint += ulIntervalNSecs;
-
-		return ulTargetPoint;
+		return CVBlankScheduler::GetNextVBlank( GetLastVBlank(), ulIntervalNSecs, get_time_in_nanos(), ulOffset );
 	}
 
 	VBlankScheduleTime CVBlankTimer::CalcNextWakeupTime( bool bPreemptive )
 	{
-		const GamescopeScreenType eScreenType = GetBackend()->GetScreenType();
-
-		const int nRefreshRate = GetRefresh();
-		const uint64_t ulRefreshInterval = mHzToRefreshCycle( nRefreshRate );
+		IBackendConnector *pConnector = GetBackend()->GetCurrentConnector();
 
-		bool bVRR = GetBackend()->GetCurrentConnector() && GetBackend()->GetCurrentConnector()->IsVRRActive();
-		uint64_t ulOffset = 0;
-		if ( !bVRR )
+		VBlankScheduleInput input =
 		{
-			// The redzone is relative to 60Hz for external displays.
-			// Scale it by our target refresh so we don't miss submitting for
-			// vblank in DRM.
-			// (This fixes wonky frame-pacing on 4K@30Hz screens)
-			//
-			// TODO(Josh): Is this fudging still needed with our SteamOS kernel patches
-			// to not account for vertical front porch when dealing with the vblank
-			// drm_commit is going to target?
-			// Need to re-test that.
-			const uint64_t ulRedZone = eScreenType == GAMESCOPE_SCREEN_TYPE_INTERNAL
-				? m_ulVBlankDrawBufferRedZone
-				: std::min<uint64_t>( m_ulVBlankDrawBufferRedZone, ( m_ulVBlankDrawBufferRedZone * 60'000 * nRefreshRate ) / 60'000 );
-
-			const uint64_t ulDecayAlpha = m_ulVBlankRateOfDecayPercentage; // eg. 980 = 98%
-
-			uint64_t ulDrawTime = m_ulLastDrawTime;
-			/// See comment of m_ulVBlankDrawTimeMinCompositing.
-			if ( m_bCurrentlyCompositing )
-				ulDrawTime = std::max( ulDrawTime, m_ulVBlankDrawTimeMinCompositing );
-
-			uint64_t ulNewRollingDrawTime;
-			// This is a rolling average when ulDrawTime < m_ulRollingMaxDrawTime,
-			// and a maximum when ulDrawTime > m_ulRollingMaxDrawTime.
-			//
-			// This allows us to deal with spikes in the draw buffer time very easily.
-			// eg. if we suddenly spike up (eg. because of test commits taking a stupid long time),
-			// we will then be able to deal with spikes in the long term, even if several commits after
-			// we get back into a good state and then regress again.
-
-			// If we go over half of our deadzone, be more defensive about things and
-			// spike up back to our current drawtime (sawtooth).
-			if ( int64_t( ulDrawTime ) - int64_t( ulRedZone / 2 ) > int64_t( m_ulRollingMaxDrawTime ) )
-				ulNewRollingDrawTime = ulDrawTime;
-			else
-				ulNewRollingDrawTime = ( ( ulDecayAlpha * m_ulRollingMaxDrawTime ) + ( kVBlankRateOfDecayMax - ulDecayAlpha ) * ulDrawTime ) / kVBlankRateOfDecayMax;
-
-			// If we need to offset for our draw more than half of our vblank, something is very wrong.
-			// Clamp our max time to half of the vblank if we can.
-			ulNewRollingDrawTime = std::min( ulNewRollingDrawTime, ulRefreshInterval - ulRedZone );
-
-			// If this is not a pre-emptive re-arming, then update
-			// the rolling internal max draw time for next time.
-			if ( !bPreemptive )
-				m_ulRollingMaxDrawTime = ulNewRollingDrawTime;
-
-			ulOffset = ulNewRollingDrawTime + ulRedZone;
-
-			if ( vblank_debug && !bPreemptive )
-				VBlankDebugSpew( ulOffset, ulDrawTime, ulRedZone );
-		}
-		else
-		{
-			// See above.
-			if ( !bPreemptive )
-			{
-				// Reset the max draw time to default, it is unused for VRR.
-				m_ulRollingMaxDrawTime = kStartingVBlankDrawTime;
-			}
+			.ulNow = get_time_in_nanos(),
+			.ulLastVBlank = GetLastVBlank(),
+			.nRefreshmHz = GetRefresh(),
+			.bInternalScreen = GetBackend()->GetScreenType() == GAMESCOPE_SCREEN_TYPE_INTERNAL,
+			.bVRR = pConnector && pConnector->IsVRRActive(),
+			.bCompositing = m_bCurrentlyCompositing,
+			.ulLastDrawTime = m_ulLastDrawTime,
+		};
 
-			uint64_t ulRedZone = kVRRFlushingTime;
+		std::unique_lock lock( m_SchedulerMutex );
 
-			uint64_t ulDrawTime = 0;
-			/// See comment of m_ulVBlankDrawTimeMinCompositing.
-			if ( m_bCurrentlyCompositing )
-				ulDrawTime = std::max( ulDrawTime, m_ulVBlankDrawTimeMinCompositing );
+		VBlankTuning &tuning = m_Scheduler.Tuning();
+		tuning.ePredictor = cv_vblank_predictor == 1 ? VBlankPredictor::Percentile : VBlankPredictor::RollingMax;
+		tuning.ulVBlankDrawTimePercentile = cv_vblank_predictor_percentile;
 
-			ulOffset = ulDrawTime + ulRedZone;
+		VBlankScheduleDebug debug;
+		VBlankScheduleTime schedule = m_Scheduler.CalcNextWakeupTime( input, bPreemptive, &debug );
 
-			if ( vblank_debug && !bPreemptive )
-				VBlankDebugSpew( ulOffset, ulDrawTime, ulRedZone );
-		}
+		if ( vblank_debug && !bPreemptive )
+			VBlankDebugSpew( debug.ulOffset, debug.ulDrawTime, debug.ulRedZone );
 
-		const uint64_t ulScheduledWakeupPoint = GetNextVBlank( ulOffset );
-		const uint64_t ulTargetVBlank = ulScheduledWakeupPoint + ulOffset;
-
-		VBlankScheduleTime schedule =
-		{
-			.ulTargetVBlank = ulTargetVBlank,
-			.ulScheduledWakeupPoint = ulScheduledWakeupPoint,
-		};
 		return schedule;
 	}
 
@@ -215,6 +147,9 @@ namespace gamescope
 	void CVBlankTimer::UpdateLastDrawTime( uint64_t ulNanos )
 	{
 		m_ulLastDrawTime = ulNanos;
+
+		std::unique_lock lock( m_SchedulerMutex );
+		m_Scheduler.AddDrawTimeSample( ulNanos, m_bCurrentlyCompositing );
 	}
 
 	void CVBlankTimer::WaitToBeArmed()
@@ -335,8 +270,8 @@ namespace gamescope
 
 			g_VBlankLog.infof( "redZone: %.2fms decayRate: %lu%% - rollingMaxDrawTime: %.2fms lastDrawTime: %.2fms lastOffset: %.2fms - drawTime: %.2fms offset: %.2fms",
 				ulRedZone / 1'000'000.0,
-				m_ulVBlankRateOfDecayPercentage,
-				m_ulRollingMaxDrawTime / 1'000'000.0,
+				m_Scheduler.Tuning().ulVBlankRateOfDecayPercentage,
+				m_Scheduler.GetRollingMaxDrawTime() / 1'000'000.0,
 				s_ulLastDrawTime / 1'000'000.0,
 				s_ulLastOffset / 1'000'000.0,
 				ulDrawTime / 1'000'000.0,
@@ -0,0 +1,188 @@
+#include <algorithm>
+
+#include "vblankscheduler.hpp"
+#include "refresh_rate.h"
+
+namespace gamescope
+{
+	void CVBlankDrawTimeHistogram::AddSample( uint64_t ulDrawTime )
+	{
+		const uint16_t uBucket = uint16_t( std::min<uint64_t>( ulDrawTime / kBucketWidth, kBucketCount - 1 ) );
+
+		if ( m_uCount == kWindowSize )
+			m_uBuckets[ m_uWindow[ m_uHead ] ]--;
+		else
+			m_uCount++;
+
+		m_uWindow[ m_uHead ] = uBucket;
+		m_uBuckets[ uBucket ]++;
+		m_uHead = ( m_uHead + 1 ) % kWindowSize;
+	}
+
+	uint64_t CVBlankDrawTimeHistogram::GetPercentile( uint64_t ulPerMille ) const
+	{
+		if ( !m_uCount )
+			return 0;
+
+		ulPerMille = std::clamp<uint64_t>( ulPerMille, 1, 1000 );
+
+		// Nearest-rank, rounding up so p99 of 256 samples doesn't ignore the 3rd worst.
+		const uint64_t ulRank = ( m_uCount * ulPerMille + 999 ) / 1000;
+
+		uint64_t ulSeen = 0;
+		for ( uint32_t i = 0; i < kBucketCount; i++ )
+		{
+			ulSeen += m_uBuckets[ i ];
+			if ( ulSeen >= ulRank )
+				return ( i + 1 ) * kBucketWidth;
+		}
+
+		return kBucketCount * kBucketWidth;
+	}
+
+	void CVBlankDrawTimeHistogram::Reset()
+	{
+		*this = CVBlankDrawTimeHistogram{};
+	}
+
+	uint64_t CVBlankScheduler::GetNextVBlank( uint64_t ulLastVBlank, uint64_t ulIntervalNSecs, uint64_t ulNow, uint64_t ulOffset )
+	{
+		uint64_t ulTargetPoint = ulLastVBlank + ulIntervalNSecs - ulOffset;
+
+		while ( ulTargetPoint < ulNow )
+			ulTargetPoint += ulIntervalNSecs;
+
+		return ulTargetPoint;
+	}
+
+	void CVBlankScheduler::AddDrawTimeSample( uint64_t ulDrawTime, bool bCompositing )
+	{
+		CVBlankDrawTimeHistogram &history = bCompositing ? m_CompositedDrawTimes : m_DirectDrawTimes;
+		history.AddSample( ulDrawTime );
+	}
+
+	VBlankScheduleTime CVBlankScheduler::CalcNextWakeupTime( const VBlankScheduleInput &input, bool bPreemptive, VBlankScheduleDebug *pOutDebug )
+	{
+		const int nRefreshRate = input.nRefreshmHz;
+		const uint64_t ulRefreshInterval = mHzToRefreshCycle( nRefreshRate );
+
+		if ( nRefreshRate != m_nHistogramRefreshmHz || input.bVRR != m_bHistogramVRR )
+		{
+			m_CompositedDrawTimes.Reset();
+			m_DirectDrawTimes.Reset();
+			m_nHistogramRefreshmHz = nRefreshRate;
+			m_bHistogramVRR = input.bVRR;
+		}
+
+		uint64_t ulOffset = 0;
+		uint64_t ulDrawTime = 0;
+		uint64_t ulRedZone = 0;
+		if ( !input.bVRR )
+		{
+			// The redzone is relative to 60Hz for external displays.
+			// Scale it by our target refresh so we don't miss submitting for
+			// vblank in DRM.
+			// (This fixes wonky frame-pacing on 4K@30Hz screens)
+			//
+			// TODO(Josh): Is this fudging still needed with our SteamOS kernel patches
+			// to not account for vertical front porch when dealing with the vblank
+			// drm_commit is going to target?
+			// Need to re-test that.
+			ulRedZone = input.bInternalScreen
+				? m_Tuning.ulVBlankDrawBufferRedZone
+				: std::min<uint64_t>( m_Tuning.ulVBlankDrawBufferRedZone, ( m_Tuning.ulVBlankDrawBufferRedZone * 60'000 * nRefreshRate ) / 60'000 );
+
+			const uint64_t ulDecayAlpha = m_Tuning.ulVBlankRateOfDecayPercentage; // eg. 980 = 98%
+
+			ulDrawTime = input.ulLastDrawTime;
+			/// See comment of VBlankTuning::ulVBlankDrawTimeMinCompositing.
+			if ( input.bCompositing )
+				ulDrawTime = std::max( ulDrawTime, m_Tuning.ulVBlankDrawTimeMinCompositing );
+
+			uint64_t ulNewRollingDrawTime;
+			// This is a rolling average when ulDrawTime < m_ulRollingMaxDrawTime,
+			// and a maximum when ulDrawTime > m_ulRollingMaxDrawTime.
+			//
+			// This allows us to deal with spikes in the draw buffer time very easily.
+			// eg. if we suddenly spike up (eg. because of test commits taking a stupid long time),
+			// we will then be able to deal with spikes in the long term, even if several commits after
+			// we get back into a good state and then regress again.
+
+			// If we go over half of our deadzone, be more defensive about things and
+			// spike up back to our current drawtime (sawtooth).
+			if ( int64_t( ulDrawTime ) - int64_t( ulRedZone / 2 ) > int64_t( m_ulRollingMaxDrawTime ) )
+				ulNewRollingDrawTime = ulDrawTime;
+			else
+				ulNewRollingDrawTime = ( ( ulDecayAlpha * m_ulRollingMaxDrawTime ) + ( kVBlankRateOfDecayMax - ulDecayAlpha ) * ulDrawTime ) / kVBlankRateOfDecayMax;
+
+			// If we need to offset for our draw more than half of our vblank, something is very wrong.
+			// Clamp our max time to half of the vblank if we can.
+			ulNewRollingDrawTime = std::min( ulNewRollingDrawTime, ulRefreshInterval - ulRedZone );
+
+			// If this is not a pre-emptive re-arming, then update
+			// the rolling internal max draw time for next time.
+			// We keep this going even when using the percentile predictor so
+			// we can fall back to it (or switch back) at any point.
+			if ( !bPreemptive )
+				m_ulRollingMaxDrawTime = ulNewRollingDrawTime;
+
+			uint64_t ulPredictedDrawTime = ulNewRollingDrawTime;
+			if ( m_Tuning.ePredictor == VBlankPredictor::Percentile )
+			{
+				// A single slow frame only moves the prediction if it makes it into the
+				// top percentile of the window, rather than pinning the offset to it
+				// until it decays away.
+				const CVBlankDrawTimeHistogram &history = input.bCompositing ? m_CompositedDrawTimes : m_DirectDrawTimes;
+				if ( history.Count() >= kMinPercentileSamples )
+				{
+					ulPredictedDrawTime = history.GetPercentile( m_Tuning.ulVBlankDrawTimePercentile );
+
+					/// See comment of VBlankTuning::ulVBlankDrawTimeMinCompositing.
+					if ( input.bCompositing )
+						ulPredictedDrawTime = std::max( ulPredictedDrawTime, m_Tuning.ulVBlankDrawTimeMinCompositing );
+
+					ulPredictedDrawTime = std::min( ulPredictedDrawTime, ulRefreshInterval - ulRedZone );
+				}
+			}
+
+			ulOffset = ulPredictedDrawTime + ulRedZone;
+		}
+		else
+		{
+			// See above.
+			if ( !bPreemptive )
+			{
+				// Reset the max draw time to default, it is unused for VRR.
+				m_ulRollingMaxDrawTime = kStartingVBlankDrawTime;
+			}
+
+			ulRedZone = kVRRFlushingTime;
+
+			/// See comment of VBlankTuning::ulVBlankDrawTimeMinCompositing.
+			if ( input.bCompositing )
+				ulDrawTime = std::max( ulDrawTime, m_Tuning.ulVBlankDrawTimeMinCompositing );
+
+			ulOffset = ulDrawTime + ulRedZone;
+		}
+
+		if ( pOutDebug )
+		{
+			*pOutDebug = VBlankScheduleDebug
+			{
+				.ulOffset = ulOffset,
+				.ulDrawTime = ulDrawTime,
+				.ulRedZone = ulRedZone,
+			};
+		}
+
+		const uint64_t ulScheduledWakeupPoint = GetNextVBlank( input.ulLastVBlank, ulRefreshInterval, input.ulNow, ulOffset );
+		const uint64_t ulTargetVBlank = ulScheduledWakeupPoint + ulOffset;
+
+		VBlankScheduleTime schedule =
+		{
+			.ulTargetVBlank = ulTargetVBlank,
+			.ulScheduledWakeupPoint = ulScheduledWakeupPoint,
+		};
+		return schedule;
+	}
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+
+namespace gamescope
+{
+    // Anything time-related is nanoseconds unless otherwise specified.
+
+    struct VBlankScheduleTime
+    {
+        // The expected time for the vblank we want to target.
+        uint64_t ulTargetVBlank = 0;
+        // The vblank offset by the redzone/scheduling calculation.
+        // This is when we want to wake-up by to meet that vblank time above.
+        uint64_t ulScheduledWakeupPoint = 0;
+    };
+
+    enum class VBlankPredictor : uint32_t
+    {
+        // Decaying peak of the last draw times (sawtooth).
+        RollingMax,
+        // Percentile of a window of recent draw times, tracked
+        // separately for composited and direct scanout frames.
+        Percentile,
+    };
+
+    struct VBlankTuning
+    {
+        static constexpr uint64_t kDefaultMinVBlankTime = 350'000ul;
+        static constexpr uint64_t kDefaultVBlankRedZone = 1'650'000ul;
+        static constexpr uint64_t kDefaultVBlankDrawTimeMinCompositing = 2'400'000ul;
+        static constexpr uint64_t kDefaultVBlankRateOfDecayPercentage = 980ul; // 98%
+        static constexpr uint64_t kDefaultVBlankDrawTimePercentile = 990ul; // p99
+
+        // This accounts for some time we cannot account for (which (I think) is the drm_commit -> triggering the pageflip)
+        // It would be nice to make this lower if we can find a way to track that effectively
+        // Perhaps the missing time is spent elsewhere, but given we track from the pipe write
+        // to after the return from `drm_commit` -- I am very doubtful.
+        // 1.3ms by default. (kDefaultMinVBlankTime)
+        uint64_t ulMinVBlankTime = kDefaultMinVBlankTime;
+
+        // The leeway we always apply to our buffer.
+        // 0.3ms by default. (kDefaultVBlankRedZone)
+        uint64_t ulVBlankDrawBufferRedZone = kDefaultVBlankRedZone;
+
+        // The minimum drawtime to use when we are compositing.
+        // Getting closer and closer to vblank when compositing means that we can get into
+        // a feedback loop with our GPU clocks. Pick a sane minimum draw time.
+        // 2.4ms by default. (kDefaultVBlankDrawTimeMinCompositing)
+        uint64_t ulVBlankDrawTimeMinCompositing = kDefaultVBlankDrawTimeMinCompositing;
+
+        // The rate of decay (as a percentage) of the rolling average -> current draw time
+        // 930 = 93%.
+        // 93% by default. (kDefaultVBlankRateOfDecayPercentage)
+        uint64_t ulVBlankRateOfDecayPercentage = kDefaultVBlankRateOfDecayPercentage;
+
+        // How we predict the next draw time.
+        VBlankPredictor ePredictor = VBlankPredictor::RollingMax;
+
+        // The percentile of recent draw times to target with VBlankPredictor::Percentile.
+        // 990 = p99.
+        // p99 by default. (kDefaultVBlankDrawTimePercentile)
+        uint64_t ulVBlankDrawTimePercentile = kDefaultVBlankDrawTimePercentile;
+    };
+
+    // Histogram over a sliding window of the last kWindowSize draw times.
+    // Adding a sample and querying a percentile are both O(1)/O(buckets)
+    // with no allocations.
+    class CVBlankDrawTimeHistogram
+    {
+    public:
+        static constexpr uint64_t kBucketWidth = 50'000ul; // 0.05ms
+        // 20ms, anything above that lands in the last bucket.
+        static constexpr uint32_t kBucketCount = 400;
+        static constexpr uint32_t kWindowSize = 256;
+
+        void AddSample( uint64_t ulDrawTime );
+        // Upper edge of the bucket containing the given per-mille percentile.
+        // eg. 990 = p99.
+        uint64_t GetPercentile( uint64_t ulPerMille ) const;
+
+        uint32_t Count() const { return m_uCount; }
+        void Reset();
+    private:
+        uint16_t m_uBuckets[ kBucketCount ]{};
+        // Bucket index of every sample in the window, oldest at m_uHead once full.
+        uint16_t m_uWindow[ kWindowSize ]{};
+        uint32_t m_uHead = 0;
+        uint32_t m_uCount = 0;
+    };
+
+    // Everything the scheduling math needs to know about the outside world.
+    struct VBlankScheduleInput
+    {
+        uint64_t ulNow = 0;
+        uint64_t ulLastVBlank = 0;
+        int32_t nRefreshmHz = 0;
+        bool bInternalScreen = true;
+        bool bVRR = false;
+        // Are we currently compositing? We may need
+        // to push back to avoid clock feedback loops if so.
+        bool bCompositing = false;
+        // The last time a 'draw' took from wake-up to page flip.
+        uint64_t ulLastDrawTime = 0;
+    };
+
+    struct VBlankScheduleDebug
+    {
+        uint64_t ulOffset = 0;
+        uint64_t ulDrawTime = 0;
+        uint64_t ulRedZone = 0;
+    };
+
+    // The pure scheduling half of CVBlankTimer.
+    // Holds no references to the backend or the real clock,
+    // so it can be driven by a simulator with recorded traces.
+    class CVBlankScheduler
+    {
+    public:
+        static constexpr uint64_t kStartingVBlankDrawTime = 3'000'000ul;
+        static constexpr uint64_t kVBlankRateOfDecayMax = 1000ul; // 100%
+        static constexpr uint64_t kVRRFlushingTime = 300'000;
+        // Don't trust a percentile until we have seen this many frames of that kind.
+        static constexpr uint32_t kMinPercentileSamples = 32;
+
+        static uint64_t GetNextVBlank( uint64_t ulLastVBlank, uint64_t ulIntervalNSecs, uint64_t ulNow, uint64_t ulOffset );
+
+        VBlankScheduleTime CalcNextWakeupTime( const VBlankScheduleInput &input, bool bPreemptive, VBlankScheduleDebug *pOutDebug = nullptr );
+
+        // Feeds the percentile predictor, call once per presented frame.
+        void AddDrawTimeSample( uint64_t ulDrawTime, bool bCompositing );
+
+        VBlankTuning &Tuning() { return m_Tuning; }
+        const VBlankTuning &Tuning() const { return m_Tuning; }
+
+        uint64_t GetRollingMaxDrawTime() const { return m_ulRollingMaxDrawTime; }
+    private:
+        VBlankTuning m_Tuning;
+
+        // Internal rolling peak exponential avg. draw time.
+        // This is updated in CalcNextWakeupTime when not
+        // doing pre-emptive timer re-arms.
+        uint64_t m_ulRollingMaxDrawTime = kStartingVBlankDrawTime;
+
+        // Recent draw times for VBlankPredictor::Percentile.
+        // Composition costs are very different from direct scanout ones,
+        // so keep them apart.
+        CVBlankDrawTimeHistogram m_CompositedDrawTimes;
+        CVBlankDrawTimeHistogram m_DirectDrawTimes;
+
+        // Draw times from another refresh rate or VRR state don't say much
+        // about this one, the histograms start over when either changes.
+        int32_t m_nHistogramRefreshmHz = 0;
+        bool m_bHistogramVRR = false;
+    };
+}
@@ -0,0 +1,67 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Utils/OpenHashMap.h"
+
+// Just enough of steamcompmgr_win_t to walk the list like find_win did.
+struct BenchWindow_t
+{
+    unsigned long id = 0;
+    BenchWindow_t *next = nullptr;
+};
+
+struct BenchWindows_t
+{
+    std::vector<std::unique_ptr<BenchWindow_t>> windows;
+    BenchWindow_t *list = nullptr;
+    gamescope::COpenHashMap<unsigned long, BenchWindow_t *> index;
+
+    BenchWindows_t( size_t uCount )
+    {
+        // Xwayland hands out XIDs from a per-client base.
+        for ( size_t i = 0; i < uCount; i++ )
+        {
+            auto pWindow = std::make_unique<BenchWindow_t>();
+            pWindow->id = 0x400000 + i * 0x20;
+            pWindow->next = list;
+            list = pWindow.get();
+            index.Set( pWindow->id, pWindow.get() );
+            windows.emplace_back( std::move( pWindow ) );
+        }
+    }
+};
+
+// Events are mostly for the game's windows, which were created first and
+// so end up at the far end of the list.
+static void Benchmark_FindWin_List( benchmark::State &state )
+{
+    BenchWindows_t windows( size_t( state.range( 0 ) ) );
+    const unsigned long ulId = windows.windows.front()->id;
+
+    for ( auto _ : state )
+    {
+        BenchWindow_t *w;
+        for ( w = windows.list; w; w = w->next )
+        {
+            if ( w->id == ulId )
+                break;
+        }
+        benchmark::DoNotOptimize( w );
+    }
+}
+BENCHMARK( Benchmark_FindWin_List )->Arg( 16 )->Arg( 128 )->Arg( 512 );
+
+static void Benchmark_FindWin_Index( benchmark::State &state )
+{
+    BenchWindows_t windows( size_t( state.range( 0 ) ) );
+    const unsigned long ulId = windows.windows.front()->id;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize( *windows.index.Find( ulId ) );
+}
+BENCHMARK( Benchmark_FindWin_Index )->Arg( 16 )->Arg( 128 )->Arg( 512 );
+
+BENCHMARK_MAIN();
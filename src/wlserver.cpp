@@ -64,6 +64,7 @@
 #include "commit.h"
 #include "Timeline.h"
 #include "Utils/NonCopyable.h"
+#include "Utils/MPSCQueue.h"
 
 #if HAVE_PIPEWIRE
 #include "pipewire.hpp"
@@ -124,6 +125,28 @@ std::vector<ResListEntry_t>& gamescope_xwayland_server_t::retrieve_commits()
 
 gamescope::ConVar<bool> cv_drm_debug_syncobj_force_wait_on_commit( "drm_debug_syncobj_force_wait_on_commit", false, "Force a wait on DRM sync objects before committing buffers" );
 
+// Past this many rects, the extents are close enough.
+static constexpr int k_nMaxCommitDamageRects = 16;
+
+static std::vector<struct wlr_box> GetCommitDamage( struct wlr_surface *surf )
+{
+	std::vector<struct wlr_box> damage;
+
+	int nBoxes = 0;
+	const pixman_box32_t *pBoxes = pixman_region32_rectangles( &surf->buffer_damage, &nBoxes );
+	if ( nBoxes > k_nMaxCommitDamageRects )
+	{
+		pBoxes = pixman_region32_extents( &surf->buffer_damage );
+		nBoxes = 1;
+	}
+
+	damage.reserve( nBoxes );
+	for ( int i = 0; i < nBoxes; i++ )
+		damage.push_back( wlr_box{ pBoxes[i].x1, pBoxes[i].y1, pBoxes[i].x2 - pBoxes[i].x1, pBoxes[i].y2 - pBoxes[i].y1 } );
+
+	return damage;
+}
+
 std::optional<ResListEntry_t> PrepareCommit( struct wlr_surface *surf, struct wlr_buffer *buf )
 {
 	auto wl_surf = get_wl_surface_info( surf );
@@ -157,7 +180,9 @@ std::optional<ResListEntry_t> PrepareCommit( struct wlr_surface *surf, struct wl
 		wl_surf->present_id,
 		wl_surf->desired_present_time,
 		std::move( pAcquirePoint ),
-		std::move( pReleasePoint )
+		std::move( pReleasePoint ),
+		GetCommitDamage( surf ),
+		get_time_in_nanos()
 	};
 	wl_surf->present_id = std::nullopt;
 	wl_surf->desired_present_time = 0;
@@ -1886,6 +1911,62 @@ bool wlserver_init( void ) {
 
 pthread_mutex_t waylock = PTHREAD_MUTEX_INITIALIZER;
 
+// wlroots isn't thread safe, so anything touching it still needs waylock.
+// What can be split off is work that only needs to happen *eventually*
+// under it, like dropping our lock on a buffer when a commit is retired.
+// Those get pushed here without taking any lock and the Wayland thread
+// releases them all at once each time around its loop, so the compositor
+// never waits on client dispatch just to let go of a buffer.
+//
+// Every drain happens with waylock held, which is what keeps it single-consumer.
+static gamescope::CMPSCQueue<struct wlr_buffer *> g_wlserverBufferReleases;
+// Set once the Wayland thread has done its last drain, from then on whoever
+// pushes a buffer has to release it themselves.
+static std::atomic<bool> g_bWlserverBufferReleasesStopped = { false };
+
+struct WlserverLockStats_t
+{
+	std::atomic<uint64_t> ulAcquisitions = { 0 };
+	std::atomic<uint64_t> ulContended = { 0 };
+	std::atomic<uint64_t> ulWaitNanos = { 0 };
+	std::atomic<uint64_t> ulMaxWaitNanos = { 0 };
+	std::atomic<uint64_t> ulMaxHoldNanos = { 0 };
+
+	std::atomic<uint64_t> ulDeferredReleases = { 0 };
+	std::atomic<uint64_t> ulReleaseBatches = { 0 };
+};
+static WlserverLockStats_t g_wlserverLockStats;
+// Only touched with waylock held.
+static uint64_t g_ulWlserverLockAcquiredNanos = 0;
+static thread_local bool t_bHoldsWaylock = false;
+
+static void atomic_store_max( std::atomic<uint64_t> &ulValue, uint64_t ulNew )
+{
+	uint64_t ulOld = ulValue.load( std::memory_order_relaxed );
+	while ( ulOld < ulNew && !ulValue.compare_exchange_weak( ulOld, ulNew, std::memory_order_relaxed ) )
+		;
+}
+
+static gamescope::ConCommand cc_wlserver_lock_stats( "wlserver_lock_stats", "Print how contended the wlserver lock has been, and reset the counters.",
+[]( std::span<std::string_view> args )
+{
+	WlserverLockStats_t &stats = g_wlserverLockStats;
+
+	const uint64_t ulAcquisitions = stats.ulAcquisitions.exchange( 0 );
+	const uint64_t ulContended = stats.ulContended.exchange( 0 );
+	const uint64_t ulWaitNanos = stats.ulWaitNanos.exchange( 0 );
+
+	wl_log.infof( "wlserver lock: %lu acquisitions, %lu contended (%.1f%%), %.3fms waited in total, %.3fms avg wait when contended, %.3fms max wait, %.3fms max hold",
+		ulAcquisitions, ulContended,
+		ulAcquisitions ? 100.0 * ulContended / ulAcquisitions : 0.0,
+		ulWaitNanos / 1'000'000.0,
+		ulContended ? ulWaitNanos / 1'000'000.0 / ulContended : 0.0,
+		stats.ulMaxWaitNanos.exchange( 0 ) / 1'000'000.0,
+		stats.ulMaxHoldNanos.exchange( 0 ) / 1'000'000.0 );
+	wl_log.infof( "wlserver lock: %lu buffer releases deferred, done in %lu batches",
+		stats.ulDeferredReleases.exchange( 0 ), stats.ulReleaseBatches.exchange( 0 ) );
+});
+
 bool wlserver_is_lock_held(void)
 {
 	int err = pthread_mutex_trylock(&waylock);
@@ -1899,13 +1980,43 @@ bool wlserver_is_lock_held(void)
 
 void wlserver_lock(void)
 {
-	pthread_mutex_lock(&waylock);
+	if ( pthread_mutex_trylock( &waylock ) != 0 )
+	{
+		const uint64_t ulWaitBegin = get_time_in_nanos();
+		pthread_mutex_lock( &waylock );
+		const uint64_t ulWaitNanos = get_time_in_nanos() - ulWaitBegin;
+
+		g_wlserverLockStats.ulContended.fetch_add( 1, std::memory_order_relaxed );
+		g_wlserverLockStats.ulWaitNanos.fetch_add( ulWaitNanos, std::memory_order_relaxed );
+		atomic_store_max( g_wlserverLockStats.ulMaxWaitNanos, ulWaitNanos );
+	}
+
+	g_wlserverLockStats.ulAcquisitions.fetch_add( 1, std::memory_order_relaxed );
+	g_ulWlserverLockAcquiredNanos = get_time_in_nanos();
+	t_bHoldsWaylock = true;
+}
+
+// With waylock held. The Wayland thread, or whoever's releasing once it's gone.
+static void wlserver_release_deferred_buffers()
+{
+	assert( wlserver_is_lock_held() );
+
+	size_t uReleased = g_wlserverBufferReleases.Drain( []( struct wlr_buffer *buf )
+	{
+		wlr_buffer_unlock( buf );
+	});
+
+	if ( uReleased )
+		g_wlserverLockStats.ulReleaseBatches.fetch_add( 1, std::memory_order_relaxed );
 }
 
 void wlserver_unlock(bool flush)
 {
     if (flush)
 	    wl_display_flush_clients(wlserver.display);
+
+	atomic_store_max( g_wlserverLockStats.ulMaxHoldNanos, get_time_in_nanos() - g_ulWlserverLockAcquiredNanos );
+	t_bHoldsWaylock = false;
 	pthread_mutex_unlock(&waylock);
 }
 
@@ -1913,6 +2024,42 @@ extern std::mutex g_SteamCompMgrXWaylandServerMutex;
 
 static int g_wlserverNudgePipe[2] = {-1, -1};
 
+void wlserver_release_buffer_deferred( struct wlr_buffer *buf )
+{
+	if ( !buf )
+		return;
+
+	bool bWasEmpty = g_wlserverBufferReleases.Push( buf );
+	g_wlserverLockStats.ulDeferredReleases.fetch_add( 1, std::memory_order_relaxed );
+
+	// Pairs with the fence in wlserver_run, either it sees our buffer
+	// in its last drain or we see that it's stopped.
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+	if ( g_bWlserverBufferReleasesStopped.load( std::memory_order_relaxed ) )
+	{
+		// Nobody is coming around for it any more (eg. commits torn down
+		// during shutdown).
+		if ( t_bHoldsWaylock )
+		{
+			wlserver_release_deferred_buffers();
+		}
+		else
+		{
+			wlserver_lock();
+			wlserver_release_deferred_buffers();
+			wlserver_unlock( false );
+		}
+		return;
+	}
+
+	// Only the first one since the last drain needs to wake the Wayland thread.
+	if ( bWasEmpty && g_wlserverNudgePipe[ 1 ] >= 0 )
+	{
+		if ( write( g_wlserverNudgePipe[ 1 ], "\n", 1 ) < 0 && errno != EAGAIN )
+			wl_log.errorf_errno( "wlserver_release_buffer_deferred: write failed" );
+	}
+}
+
 void wlserver_run(void)
 {
 	pthread_setname_np( pthread_self(), "gamescope-wl" );
@@ -1953,10 +2100,25 @@ void wlserver_run(void)
 			break;
 		}
 
+		if ( pollfds[ 1 ].revents & POLLIN ) {
+			char buf[64];
+			while ( read( g_wlserverNudgePipe[ 0 ], buf, sizeof( buf ) ) > 0 )
+				;
+
+			if ( !( pollfds[ 0 ].revents & POLLIN ) )
+			{
+				wlserver_lock();
+				wlserver_release_deferred_buffers();
+				wlserver_unlock();
+			}
+		}
+
 		if ( pollfds[ 0 ].revents & POLLIN ) {
 			// We have wayland stuff to do, do it while locked
 			wlserver_lock();
 
+			wlserver_release_deferred_buffers();
+
 			wl_display_flush_clients(wlserver.display);
 			int ret = wl_event_loop_dispatch(wlserver.event_loop, 0);
 			if (ret < 0) {
@@ -1990,6 +2152,9 @@ void wlserver_run(void)
 	// We need to shutdown Xwayland before disconnecting all clients, otherwise
 	// wlroots will restart it automatically.
 	wlserver_lock();
+	g_bWlserverBufferReleasesStopped.store( true, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+	wlserver_release_deferred_buffers();
 	wlserver.wlr.xwayland_servers.clear();
 	wl_display_destroy_clients(wlserver.display);
 	wl_display_destroy(wlserver.display);
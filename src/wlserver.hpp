@@ -48,6 +48,10 @@ struct ResListEntry_t {
 	uint64_t desired_present_time;
 	std::shared_ptr<gamescope::CAcquireTimelinePoint> pAcquirePoint;
 	std::shared_ptr<gamescope::CReleaseTimelinePoint> pReleasePoint;
+	// Buffer-local damage of this commit.
+	std::vector<struct wlr_box> damage;
+	// When the client committed it, CLOCK_MONOTONIC.
+	uint64_t commit_time;
 };
 
 struct wlserver_content_override;
@@ -230,6 +234,9 @@ void wlserver_run(void);
 void wlserver_lock(void);
 void wlserver_unlock(bool flush = true);
 bool wlserver_is_lock_held(void);
+// Drops our lock on the buffer on the Wayland thread, without waiting for it.
+// Can be called from any thread, with or without the wlserver lock held.
+void wlserver_release_buffer_deferred( struct wlr_buffer *buf );
 
 void wlserver_keyboardfocus( struct wlr_surface *surface, bool bConstrain = true );
 void wlserver_key( uint32_t key, bool press, uint32_t time );
@@ -0,0 +1,328 @@
+#include "x11_property_batch.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/res.h>
+
+namespace gamescope
+{
+    // From Xatomtype.h, which isn't installed.
+    static constexpr uint32_t k_uOldNumPropSizeElements = 15;
+    static constexpr uint32_t k_uNumPropSizeElements = 18;
+    static constexpr uint32_t k_uNumPropWMHintsElements = 9;
+
+    // What XGetTextProperty asks for.
+    static constexpr uint32_t k_uMaxTextPropertyLength = 1000000;
+    static constexpr uint32_t k_uMaxAtomListLength = 2048;
+
+    static void GetPropertyRequest( EX11PropertyKind eKind, Atom *pOutType, uint32_t *pOutLength )
+    {
+        switch ( eKind )
+        {
+            case EX11PropertyKind::Cardinal:
+                *pOutType = XA_CARDINAL;
+                *pOutLength = 1;
+                break;
+            case EX11PropertyKind::CardinalList:
+                *pOutType = XA_CARDINAL;
+                *pOutLength = UINT32_MAX;
+                break;
+            case EX11PropertyKind::Text:
+                *pOutType = AnyPropertyType;
+                *pOutLength = k_uMaxTextPropertyLength;
+                break;
+            case EX11PropertyKind::AtomList:
+                *pOutType = AnyPropertyType;
+                *pOutLength = k_uMaxAtomListLength;
+                break;
+            case EX11PropertyKind::SizeHints:
+                *pOutType = XA_WM_SIZE_HINTS;
+                *pOutLength = k_uNumPropSizeElements;
+                break;
+            case EX11PropertyKind::WMHints:
+                *pOutType = XA_WM_HINTS;
+                *pOutLength = k_uNumPropWMHintsElements;
+                break;
+            case EX11PropertyKind::WindowId:
+                *pOutType = XA_WINDOW;
+                *pOutLength = 1;
+                break;
+        }
+    }
+
+    // The 32-bit values of a reply, nullptr if it's some other format.
+    static const uint32_t *GetValues32( const xcb_get_property_reply_t *pReply, uint32_t *pOutCount )
+    {
+        *pOutCount = 0;
+        if ( !pReply || pReply->format != 32 )
+            return nullptr;
+
+        *pOutCount = xcb_get_property_value_length( pReply ) / sizeof( uint32_t );
+        return reinterpret_cast<const uint32_t *>( xcb_get_property_value( pReply ) );
+    }
+
+    CX11PropertyBatch::CX11PropertyBatch( Display *pDisplay, Window window )
+        : m_pConnection{ XGetXCBConnection( pDisplay ) }
+        , m_Window{ window }
+    {
+    }
+
+    CX11PropertyBatch::~CX11PropertyBatch()
+    {
+        for ( PendingProperty_t &property : m_Properties )
+        {
+            if ( !property.bCollected )
+                xcb_discard_reply( m_pConnection, property.cookie.sequence );
+            free( property.pReply );
+        }
+
+        if ( m_bClientPidRequested && !m_bClientPidCollected )
+            xcb_discard_reply( m_pConnection, m_uClientPidSequence );
+    }
+
+    void CX11PropertyBatch::Request( Atom prop, EX11PropertyKind eKind )
+    {
+        for ( const PendingProperty_t &property : m_Properties )
+        {
+            if ( property.prop == prop )
+            {
+                assert( property.eKind == eKind );
+                return;
+            }
+        }
+
+        Atom type = AnyPropertyType;
+        uint32_t uLength = 0;
+        GetPropertyRequest( eKind, &type, &uLength );
+
+        PendingProperty_t property;
+        property.prop = prop;
+        property.eKind = eKind;
+        property.cookie = xcb_get_property( m_pConnection, false, m_Window, prop, type, 0, uLength );
+        m_Properties.push_back( property );
+    }
+
+    void CX11PropertyBatch::RequestClientPid()
+    {
+        if ( m_bClientPidRequested )
+            return;
+
+        xcb_res_client_id_spec_t spec =
+        {
+            .client = uint32_t( m_Window ),
+            .mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID,
+        };
+        m_uClientPidSequence = xcb_res_query_client_ids( m_pConnection, 1, &spec ).sequence;
+        m_bClientPidRequested = true;
+    }
+
+    const xcb_get_property_reply_t *CX11PropertyBatch::GetReply( Atom prop, EX11PropertyKind eKind )
+    {
+        Request( prop, eKind );
+
+        for ( PendingProperty_t &property : m_Properties )
+        {
+            if ( property.prop != prop )
+                continue;
+
+            if ( !property.bCollected )
+            {
+                // Errors (eg. BadWindow for a window that's already gone) come
+                // back here rather than going through Xlib's error handler.
+                xcb_generic_error_t *pError = nullptr;
+                property.pReply = xcb_get_property_reply( m_pConnection, property.cookie, &pError );
+                property.bCollected = true;
+                free( pError );
+            }
+
+            if ( !property.pReply || property.pReply->type == XCB_NONE )
+                return nullptr;
+
+            return property.pReply;
+        }
+
+        return nullptr;
+    }
+
+    uint32_t CX11PropertyBatch::GetCardinal( Atom prop, uint32_t uDefault, bool *pbFound )
+    {
+        uint32_t uCount = 0;
+        const uint32_t *pValues = GetValues32( GetReply( prop, EX11PropertyKind::Cardinal ), &uCount );
+
+        const bool bFound = pValues && uCount >= 1;
+        if ( pbFound )
+            *pbFound = bFound;
+
+        return bFound ? pValues[0] : uDefault;
+    }
+
+    bool CX11PropertyBatch::GetCardinalList( Atom prop, std::vector<uint32_t> *pOutValues )
+    {
+        pOutValues->clear();
+
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::CardinalList );
+        if ( !pReply )
+            return false;
+
+        uint32_t uCount = 0;
+        if ( const uint32_t *pValues = GetValues32( pReply, &uCount ) )
+            pOutValues->assign( pValues, pValues + uCount );
+
+        return true;
+    }
+
+    bool CX11PropertyBatch::GetText( Atom prop, std::string *pOutText, Atom *pOutEncoding )
+    {
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::Text );
+        if ( !pReply )
+            return false;
+
+        // Up to the first NUL, like the C string we used to get.
+        const char *pszValue = reinterpret_cast<const char *>( xcb_get_property_value( pReply ) );
+        const size_t uLength = size_t( xcb_get_property_value_length( pReply ) );
+        pOutText->assign( pszValue, strnlen( pszValue, uLength ) );
+        *pOutEncoding = pReply->type;
+        return true;
+    }
+
+    bool CX11PropertyBatch::GetAtomList( Atom prop, std::vector<Atom> *pOutAtoms )
+    {
+        pOutAtoms->clear();
+
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::AtomList );
+        if ( !pReply )
+            return false;
+
+        uint32_t uCount = 0;
+        if ( const uint32_t *pValues = GetValues32( pReply, &uCount ) )
+            pOutAtoms->assign( pValues, pValues + uCount );
+
+        return true;
+    }
+
+    bool CX11PropertyBatch::GetSizeHints( Atom prop, XSizeHints *pOutHints, long *pOutSupplied )
+    {
+        *pOutHints = XSizeHints{};
+        *pOutSupplied = 0;
+
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::SizeHints );
+        if ( !pReply || pReply->type != XA_WM_SIZE_HINTS )
+            return false;
+
+        uint32_t uCount = 0;
+        const uint32_t *pValues = GetValues32( pReply, &uCount );
+        if ( !pValues || uCount < k_uOldNumPropSizeElements )
+            return false;
+
+        pOutHints->flags = long( pValues[0] );
+        pOutHints->x = int32_t( pValues[1] );
+        pOutHints->y = int32_t( pValues[2] );
+        pOutHints->width = int32_t( pValues[3] );
+        pOutHints->height = int32_t( pValues[4] );
+        pOutHints->min_width = int32_t( pValues[5] );
+        pOutHints->min_height = int32_t( pValues[6] );
+        pOutHints->max_width = int32_t( pValues[7] );
+        pOutHints->max_height = int32_t( pValues[8] );
+        pOutHints->width_inc = int32_t( pValues[9] );
+        pOutHints->height_inc = int32_t( pValues[10] );
+        pOutHints->min_aspect.x = int32_t( pValues[11] );
+        pOutHints->min_aspect.y = int32_t( pValues[12] );
+        pOutHints->max_aspect.x = int32_t( pValues[13] );
+        pOutHints->max_aspect.y = int32_t( pValues[14] );
+
+        *pOutSupplied = USPosition | USSize | PAllHints;
+        if ( uCount >= k_uNumPropSizeElements )
+        {
+            pOutHints->base_width = int32_t( pValues[15] );
+            pOutHints->base_height = int32_t( pValues[16] );
+            pOutHints->win_gravity = int32_t( pValues[17] );
+            *pOutSupplied |= PBaseSize | PWinGravity;
+        }
+
+        // Like XGetWMSizeHints, don't report anything we didn't get the fields for.
+        pOutHints->flags &= *pOutSupplied;
+
+        return true;
+    }
+
+    bool CX11PropertyBatch::GetWMHints( Atom prop, XWMHints *pOutHints )
+    {
+        *pOutHints = XWMHints{};
+
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::WMHints );
+        if ( !pReply || pReply->type != XA_WM_HINTS )
+            return false;
+
+        uint32_t uCount = 0;
+        const uint32_t *pValues = GetValues32( pReply, &uCount );
+        if ( !pValues || uCount < k_uNumPropWMHintsElements - 1 )
+            return false;
+
+        pOutHints->flags = long( pValues[0] );
+        pOutHints->input = pValues[1] ? True : False;
+        pOutHints->initial_state = int32_t( pValues[2] );
+        pOutHints->icon_pixmap = pValues[3];
+        pOutHints->icon_window = pValues[4];
+        pOutHints->icon_x = int32_t( pValues[5] );
+        pOutHints->icon_y = int32_t( pValues[6] );
+        pOutHints->icon_mask = pValues[7];
+        if ( uCount >= k_uNumPropWMHintsElements )
+            pOutHints->window_group = pValues[8];
+
+        return true;
+    }
+
+    bool CX11PropertyBatch::GetWindow( Atom prop, Window *pOutWindow )
+    {
+        const xcb_get_property_reply_t *pReply = GetReply( prop, EX11PropertyKind::WindowId );
+        if ( !pReply || pReply->type != XA_WINDOW )
+            return false;
+
+        uint32_t uCount = 0;
+        const uint32_t *pValues = GetValues32( pReply, &uCount );
+        if ( !pValues || uCount < 1 )
+            return false;
+
+        *pOutWindow = pValues[0];
+        return true;
+    }
+
+    pid_t CX11PropertyBatch::GetClientPid()
+    {
+        if ( m_bClientPidCollected )
+            return m_nClientPid;
+
+        RequestClientPid();
+
+        xcb_res_query_client_ids_cookie_t cookie = { m_uClientPidSequence };
+        xcb_generic_error_t *pError = nullptr;
+        xcb_res_query_client_ids_reply_t *pReply = xcb_res_query_client_ids_reply( m_pConnection, cookie, &pError );
+        m_bClientPidCollected = true;
+        free( pError );
+
+        if ( !pReply )
+            return m_nClientPid;
+
+        pid_t nPid = -1;
+        for ( xcb_res_client_id_value_iterator_t iter = xcb_res_query_client_ids_ids_iterator( pReply ); iter.rem; xcb_res_client_id_value_next( &iter ) )
+        {
+            if ( !( iter.data->spec.mask & XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID ) )
+                continue;
+
+            if ( xcb_res_client_id_value_value_length( iter.data ) < 1 )
+                continue;
+
+            nPid = pid_t( xcb_res_client_id_value_value( iter.data )[0] );
+            if ( nPid > 0 )
+                break;
+        }
+
+        free( pReply );
+        m_nClientPid = nPid;
+        return nPid;
+    }
+}
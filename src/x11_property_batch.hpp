@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <xcb/xcb.h>
+
+#include "Utils/NonCopyable.h"
+
+namespace gamescope
+{
+    enum class EX11PropertyKind
+    {
+        // A single CARDINAL.
+        Cardinal,
+        CardinalList,
+        // Any type, read like XGetTextProperty.
+        Text,
+        AtomList,
+        // WM_NORMAL_HINTS.
+        SizeHints,
+        // WM_HINTS.
+        WMHints,
+        // WM_TRANSIENT_FOR.
+        WindowId,
+    };
+
+    // Reads a window's properties over XCB, on Xlib's own connection.
+    //
+    // Request sends the GetProperty right away without waiting for it, and
+    // the replies are only waited on when read back, so however many
+    // properties are in a batch it costs a single round trip.
+    // Reading something that wasn't requested up front requests it then.
+    //
+    // Getters behave like the Xlib call they replace.
+    class CX11PropertyBatch : public NonCopyable
+    {
+    public:
+        CX11PropertyBatch( Display *pDisplay, Window window );
+        ~CX11PropertyBatch();
+
+        void Request( Atom prop, EX11PropertyKind eKind );
+        // The pid of the client that owns the window, through XRes.
+        void RequestClientPid();
+
+        uint32_t GetCardinal( Atom prop, uint32_t uDefault, bool *pbFound = nullptr );
+        // Returns whether the property is set at all.
+        bool GetCardinalList( Atom prop, std::vector<uint32_t> *pOutValues );
+        // pOutEncoding gets the property's type, eg. UTF8_STRING.
+        bool GetText( Atom prop, std::string *pOutText, Atom *pOutEncoding );
+        bool GetAtomList( Atom prop, std::vector<Atom> *pOutAtoms );
+        bool GetSizeHints( Atom prop, XSizeHints *pOutHints, long *pOutSupplied );
+        bool GetWMHints( Atom prop, XWMHints *pOutHints );
+        bool GetWindow( Atom prop, Window *pOutWindow );
+        // -1 if it couldn't be found.
+        pid_t GetClientPid();
+
+    private:
+        struct PendingProperty_t
+        {
+            Atom prop = None;
+            EX11PropertyKind eKind = EX11PropertyKind::Cardinal;
+            xcb_get_property_cookie_t cookie = {};
+            bool bCollected = false;
+            xcb_get_property_reply_t *pReply = nullptr;
+        };
+
+        // nullptr if the property isn't set, or the window is gone.
+        const xcb_get_property_reply_t *GetReply( Atom prop, EX11PropertyKind eKind );
+
+        xcb_connection_t *m_pConnection = nullptr;
+        Window m_Window = None;
+        std::vector<PendingProperty_t> m_Properties;
+
+        bool m_bClientPidRequested = false;
+        bool m_bClientPidCollected = false;
+        unsigned int m_uClientPidSequence = 0;
+        pid_t m_nClientPid = -1;
+    };
+}
@@ -2,6 +2,7 @@
 
 #include "backend.h"
 #include "waitable.h"
+#include "Utils/OpenHashMap.h"
 
 #include <mutex>
 #include <memory>
@@ -20,6 +21,7 @@
 class gamescope_xwayland_server_t;
 struct ignore;
 struct steamcompmgr_win_t;
+struct wlr_surface;
 class MouseCursor;
 
 extern LogScope xwm_log;
@@ -67,6 +69,17 @@ struct xwayland_ctx_t final : public gamescope::IWaitable
 	// wlserver wants it.
 	std::mutex list_mutex;
 	steamcompmgr_win_t				*list;
+	// Every window in list by XID, kept in sync with it.
+	gamescope::COpenHashMap<Window, steamcompmgr_win_t *> windowIndex;
+
+	// Child windows we've already walked up from with XQueryTree, to the
+	// toplevel they're under. Forgotten on any reparent.
+	// find_win can also come from the wayland thread.
+	std::mutex childToplevelMutex;
+	gamescope::COpenHashMap<Window, Window> childToplevels;
+
+	// Which window a surface was last seen on, steamcompmgr thread only.
+	gamescope::COpenHashMap<struct wlr_surface *, Window> surfaceWindows;
 	int				scr;
 	Window			root;
 	XserverRegion	allDamage;
@@ -0,0 +1,132 @@
+#include "yuv_convert.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Utils/WorkerPool.h"
+
+namespace gamescope
+{
+    // Even, so a job never splits a chroma row.
+    static constexpr uint32_t kRowsPerJob = 64;
+
+    struct YCbCrToRGB_t
+    {
+        float flYOffset;
+        float flYScale;
+        float flCrToR;
+        float flCbToG;
+        float flCrToG;
+        float flCbToB;
+    };
+
+    static YCbCrToRGB_t GetYCbCrToRGB( YCbCrMatrix eMatrix, bool bFullRange )
+    {
+        const float flKr = eMatrix == YCBCR_MATRIX_BT709 ? 0.2126f : 0.299f;
+        const float flKb = eMatrix == YCBCR_MATRIX_BT709 ? 0.0722f : 0.114f;
+        const float flKg = 1.0f - flKr - flKb;
+
+        // Limited range is Y in [16, 235], CbCr in [16, 240].
+        const float flYScale = bFullRange ? 1.0f : 255.0f / 219.0f;
+        const float flCScale = bFullRange ? 1.0f : 255.0f / 224.0f;
+
+        return YCbCrToRGB_t
+        {
+            .flYOffset = bFullRange ? 0.0f : 16.0f,
+            .flYScale  = flYScale,
+            .flCrToR   = flCScale * 2.0f * ( 1.0f - flKr ),
+            .flCbToG   = -flCScale * 2.0f * flKb * ( 1.0f - flKb ) / flKg,
+            .flCrToG   = -flCScale * 2.0f * flKr * ( 1.0f - flKr ) / flKg,
+            .flCbToB   = flCScale * 2.0f * ( 1.0f - flKb ),
+        };
+    }
+
+    static inline uint8_t ClampToU8( float flValue )
+    {
+        return uint8_t( std::clamp( flValue + 0.5f, 0.0f, 255.0f ) );
+    }
+
+    static void ConvertRow( const uint8_t *pLuma, const uint8_t *pChroma, uint8_t *pDst, uint32_t uWidth, const YCbCrToRGB_t &conv )
+    {
+        uint32_t x = 0;
+#ifdef __SSE2__
+        const __m128i vZero = _mm_setzero_si128();
+        const __m128 vYOffset = _mm_set1_ps( conv.flYOffset );
+        const __m128 vYScale = _mm_set1_ps( conv.flYScale );
+        const __m128 vChromaOffset = _mm_set1_ps( 128.0f );
+        const __m128 vCrToR = _mm_set1_ps( conv.flCrToR );
+        const __m128 vCbToG = _mm_set1_ps( conv.flCbToG );
+        const __m128 vCrToG = _mm_set1_ps( conv.flCrToG );
+        const __m128 vCbToB = _mm_set1_ps( conv.flCbToB );
+        const __m128 vHalf = _mm_set1_ps( 0.5f );
+        const __m128i vAlpha = _mm_set1_epi32( 255 );
+
+        // 4 pixels at a time, sharing 2 CbCr pairs.
+        for ( ; x + 4 <= uWidth; x += 4 )
+        {
+            int32_t nLuma, nChroma;
+            memcpy( &nLuma, pLuma + x, sizeof( nLuma ) );
+            memcpy( &nChroma, pChroma + x, sizeof( nChroma ) );
+
+            __m128i vY32 = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( nLuma ), vZero ), vZero );
+            // Cb0 Cr0 Cb1 Cr1
+            __m128i vC32 = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( nChroma ), vZero ), vZero );
+            __m128i vCb32 = _mm_shuffle_epi32( vC32, _MM_SHUFFLE( 2, 2, 0, 0 ) );
+            __m128i vCr32 = _mm_shuffle_epi32( vC32, _MM_SHUFFLE( 3, 3, 1, 1 ) );
+
+            __m128 vY = _mm_mul_ps( _mm_sub_ps( _mm_cvtepi32_ps( vY32 ), vYOffset ), vYScale );
+            __m128 vCb = _mm_sub_ps( _mm_cvtepi32_ps( vCb32 ), vChromaOffset );
+            __m128 vCr = _mm_sub_ps( _mm_cvtepi32_ps( vCr32 ), vChromaOffset );
+
+            __m128 vR = _mm_add_ps( _mm_add_ps( vY, _mm_mul_ps( vCr, vCrToR ) ), vHalf );
+            __m128 vG = _mm_add_ps( _mm_add_ps( vY, _mm_add_ps( _mm_mul_ps( vCb, vCbToG ), _mm_mul_ps( vCr, vCrToG ) ) ), vHalf );
+            __m128 vB = _mm_add_ps( _mm_add_ps( vY, _mm_mul_ps( vCb, vCbToB ) ), vHalf );
+
+            // Saturating packs do the clamping, the 0.5 above makes the truncation round.
+            // Negative values truncate towards zero, which still clamps to 0.
+            __m128i vRG16 = _mm_packs_epi32( _mm_cvttps_epi32( vR ), _mm_cvttps_epi32( vG ) );
+            __m128i vBA16 = _mm_packs_epi32( _mm_cvttps_epi32( vB ), vAlpha );
+            // R0 R1 R2 R3 G0 G1 G2 G3 B0 B1 B2 B3 A0 A1 A2 A3
+            __m128i vPlanar = _mm_packus_epi16( vRG16, vBA16 );
+            // R0 B0 R1 B1 R2 B2 R3 B3 G0 A0 G1 A1 G2 A2 G3 A3
+            __m128i vHalfInterleaved = _mm_unpacklo_epi8( vPlanar, _mm_srli_si128( vPlanar, 8 ) );
+            // R0 G0 B0 A0 R1 G1 B1 A1 ...
+            __m128i vOut = _mm_unpacklo_epi8( vHalfInterleaved, _mm_srli_si128( vHalfInterleaved, 8 ) );
+
+            _mm_storeu_si128( reinterpret_cast<__m128i *>( pDst + x * 4 ), vOut );
+        }
+#endif
+        for ( ; x < uWidth; x++ )
+        {
+            const uint32_t uChromaX = x & ~1u;
+            const float flY = ( float( pLuma[x] ) - conv.flYOffset ) * conv.flYScale;
+            const float flCb = float( pChroma[ uChromaX + 0 ] ) - 128.0f;
+            const float flCr = float( pChroma[ uChromaX + 1 ] ) - 128.0f;
+
+            pDst[ x * 4 + 0 ] = ClampToU8( flY + flCr * conv.flCrToR );
+            pDst[ x * 4 + 1 ] = ClampToU8( flY + flCb * conv.flCbToG + flCr * conv.flCrToG );
+            pDst[ x * 4 + 2 ] = ClampToU8( flY + flCb * conv.flCbToB );
+            pDst[ x * 4 + 3 ] = 255;
+        }
+    }
+
+    void ConvertNV12ToRGBA( const uint8_t *pLuma, size_t uLumaPitch, const uint8_t *pChroma, size_t uChromaPitch,
+                            uint8_t *pDst, size_t uDstPitch, uint32_t uWidth, uint32_t uHeight,
+                            YCbCrMatrix eMatrix, bool bFullRange )
+    {
+        const YCbCrToRGB_t conv = GetYCbCrToRGB( eMatrix, bFullRange );
+
+        const uint32_t uJobCount = ( uHeight + kRowsPerJob - 1 ) / kRowsPerJob;
+        CWorkerPool::GetBackground().ParallelFor( uJobCount, [&]( uint32_t uJob )
+        {
+            const uint32_t uStartRow = uJob * kRowsPerJob;
+            const uint32_t uEndRow = std::min( uStartRow + kRowsPerJob, uHeight );
+            for ( uint32_t y = uStartRow; y < uEndRow; y++ )
+                ConvertRow( pLuma + y * uLumaPitch, pChroma + ( y / 2 ) * uChromaPitch, pDst + y * uDstPitch, uWidth, conv );
+        });
+    }
+}
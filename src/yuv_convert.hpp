@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace gamescope
+{
+    // Matches the matrices cs_rgb_to_nv12 encodes with.
+    enum YCbCrMatrix
+    {
+        YCBCR_MATRIX_BT601,
+        YCBCR_MATRIX_BT709,
+    };
+
+    // NV12 (8-bit Y plane + interleaved, 2x2 subsampled CbCr plane) -> RGBA.
+    // Chroma is upsampled nearest-neighbour, alpha is opaque.
+    // Rows are split across the shared worker pool, SSE2 where available.
+    void ConvertNV12ToRGBA( const uint8_t *pLuma, size_t uLumaPitch, const uint8_t *pChroma, size_t uChromaPitch,
+                            uint8_t *pDst, size_t uDstPitch, uint32_t uWidth, uint32_t uHeight,
+                            YCbCrMatrix eMatrix, bool bFullRange );
+}